@@ -3,6 +3,43 @@
 
 //#define DEBUG_PRINT_CODE
 //#define DEBUG_TRACE_EXECUTION
+// Count how often every opcode sequence(n-gram) executes and print the most frequent ones on exit.
+// Used to pick superinstructions.
+//#define DEBUG_PROFILE_NGRAMS
+// Collect garbage at every back-edge and call that follows an allocation, to find objects that
+// aren't reachable from the roots while still in use.
+//#define DEBUG_STRESS_GC
+// Print when collections start and end, and what they free.
+//#define DEBUG_LOG_GC
+
+// Dispatch instructions in the interpreter loop through a per-opcode label table(computed goto).
+// Ignored by compilers without labels-as-values, which fall back to a switch.
+#define THREADED_DISPATCH
+
+// Pack values into a single 64-bit word by storing non-number values inside quiet NaNs.
+// Requires object pointers to fit in 48 bits. Comment out to use the tagged-union representation.
+#define NAN_BOXING
+
+// Compile hot functions to x86-64 machine code. Only used on x86-64 POSIX systems with NAN_BOXING.
+#define JIT
+
+// Non-blocking I/O natives that park the calling fiber, driven by an epoll event loop. Only used
+// on Linux.
+#define ASYNC_IO
+
+// Allocate small objects and arrays from per-VM size classes carved out of large mapped regions,
+// rather than with malloc(see core/slab.h). Only used on Linux and macOS. Define
+// NO_SLAB_ALLOCATOR when building to compare against malloc.
+#ifndef NO_SLAB_ALLOCATOR
+#define SLAB_ALLOCATOR
+#endif
+// Ask the kernel to back the slab regions with transparent huge pages.
+//#define SLAB_HUGE_PAGES
+
+// Hash strings a byte at a time with FNV-1a, rather than a word at a time(see common/hash.h).
+// Either way, the hash is seeded with a random value per process. Define STRING_HASH_SEED=N when
+// building to use a fixed seed instead.
+//#define STRING_HASH_FNV
 
 #include <stdbool.h>
 #include <stddef.h>
@@ -0,0 +1,9 @@
+#ifndef _CLOX_HASH_H_
+#define _CLOX_HASH_H_
+
+#include "common/common.h"
+
+void lox_InitHashSeed(void);
+uint32_t lox_HashString(const char *chars, int length);
+
+#endif
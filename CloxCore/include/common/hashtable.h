@@ -4,7 +4,12 @@
 #include "common/common.h"
 #include "core/value.h"
 
-#define TABLE_MAX_LOAD 0.75
+// Slots are probed a group at a time. Capacities are powers of two, and at least one group.
+#define TABLE_GROUP_SIZE 16
+// A table is rehashed once its live and deleted slots would go over 7/8 of its capacity, into
+// a capacity that leaves it at most half full.
+#define TABLE_MAX_LOAD_NUMERATOR 7
+#define TABLE_MAX_LOAD_DENOMINATOR 8
 
 typedef struct
 {
@@ -12,19 +17,32 @@ typedef struct
     Value value;
 } Entry;
 
+// Every slot has a control byte: empty, deleted, or the low 7 bits of the hash of its key. A
+// lookup compares the control bytes of a whole group against the key's at once (with SSE2 where
+// available), and only looks at the entries that match. A removed entry leaves its slot empty
+// unless a lookup may have probed past its group while it was full, and only then a tombstone.
+// Tombstones are dropped when the table is rehashed.
 typedef struct
 {
+    // Live entries.
     size_t count;
+    // Tombstones.
+    size_t deleted;
     size_t capacity;
+    // Follow the entries, in the same allocation.
+    uint8_t *controls;
+    // Slots that aren't live have a NULL key.
     Entry *entries;
 } HashTable;
 
 void lox_InitHashTable(HashTable *table);
-void lox_FreeHashTable(HashTable *table);
-bool lox_AddEntryHashTable(HashTable *table, ObjString *key, Value value);
-void lox_CopyHashTable(HashTable *src, HashTable *dest);
+void lox_FreeHashTable(VM *vm, HashTable *table);
+bool lox_AddEntryHashTable(VM *vm, HashTable *table, ObjString *key, Value value);
+void lox_CopyHashTable(VM *vm, HashTable *src, HashTable *dest);
+void lox_CompactHashTable(VM *vm, HashTable *table);
 bool lox_GetEntryHashTable(HashTable *table, ObjString *key, Value *value);
 bool lox_RemoveEntryHashTable(HashTable* table, ObjString* key);
+bool lox_ReplaceKeyHashTable(HashTable *table, ObjString *key, ObjString *replacement);
 ObjString *lox_FindStringHashTable(HashTable *table, const char *chars, int length, uint32_t hash);
 
 #endif
@@ -4,6 +4,6 @@
 #include "common/common.h"
 #include "core/object.h"
 
-ObjFunction *lox_Compile(const char *source);
+ObjFunction *lox_Compile(VM *vm, const char *source);
 
 #endif
@@ -60,7 +60,14 @@ typedef struct
     int line;
 } Token;
 
-void lox_InitScanner(const char *source);
-Token lox_ScanToken();
+typedef struct
+{
+    const char *start;
+    const char *current;
+    int line;
+} Scanner;
+
+void lox_InitScanner(Scanner *scanner, const char *source);
+Token lox_ScanToken(Scanner *scanner);
 
 #endif
@@ -22,16 +22,36 @@ typedef enum
     OP_LESS,
     OP_PRINT,
     OP_POP,
-    OP_DEFINE_GLOBAL,
-    OP_GET_GLOBAL,
-    OP_SET_GLOBAL,
+    // Global instructions take a 16-bit operand indexing vm.global_values.
+    OP_DEFINE_GLOBAL_SLOT,
+    OP_GET_GLOBAL_SLOT,
+    OP_SET_GLOBAL_SLOT,
     OP_GET_LOCAL,
     OP_SET_LOCAL,
     OP_JUMP_IF_FALSE,
     OP_JUMP,
     OP_LOOP,
     OP_CALL,
+    // A call in tail position(return f(...)). It reuses the caller's frame.
+    OP_TAIL_CALL,
     OP_CLOSURE,
+
+    // Superinstructions. The compiler emits these in place of common instruction sequences.
+    OP_GET_LOCAL_CONSTANT,
+    OP_GET_LOCAL_LOCAL,
+    OP_INCREMENT_LOCAL,
+    OP_LESS_JUMP_IF_FALSE,
+
+    // Quickened instructions. These are never emitted by the compiler. The VM rewrites a generic
+    // instruction into its specialized form once it has observed the operand types, and rewrites
+    // it back if a later execution sees different types.
+    OP_ADD_NUMBER,
+    OP_ADD_STRING,
+    OP_SUBTRACT_NUMBER,
+    OP_MULTIPLY_NUMBER,
+    OP_DIVIDE_NUMBER,
+    OP_GREATER_NUMBER,
+    OP_LESS_NUMBER,
 } Opcode;
 
 typedef struct
@@ -44,8 +64,9 @@ typedef struct
 } Chunk;
 
 void lox_InitChunk(Chunk *chunk);
-void lox_WriteChunk(Chunk *chunk, uint8_t byte, int line);
-int lox_AddConstant(Chunk *chunk, Value value);
-void lox_FreeChunk(Chunk *chunk);
+void lox_WriteChunk(VM *vm, Chunk *chunk, uint8_t byte, int line);
+int lox_AddConstant(VM *vm, Chunk *chunk, Value value);
+void lox_FreeChunk(VM *vm, Chunk *chunk);
+int lox_InstructionLength(uint8_t opcode);
 
 #endif
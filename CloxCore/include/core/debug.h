@@ -2,8 +2,10 @@
 #define _CLOX_DEBUG_H_
 
 #include "core/chunk.h"
+#include "core/object.h"
 
-void lox_DisassembleChunk(Chunk *chunk, const char *name);
-int lox_DisassembleInstruction(Chunk *chunk, int offset);
+void lox_DisassembleChunk(VM *vm, Chunk *chunk, const char *name);
+int lox_DisassembleInstruction(VM *vm, Chunk *chunk, int offset);
+const char *lox_OpcodeName(uint8_t opcode);
 
 #endif
@@ -4,41 +4,96 @@
 #include "common/common.h"
 #include "core/object.h"
 
+// A collection is due once the heap has grown by this factor since the last one.
+#define GC_HEAP_GROW_FACTOR 2
+// Bytes allocated before the first collection.
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+// Size of the nursery, where short-lived strings are bump-allocated(see lox_CollectNursery).
+#define NURSERY_SIZE (256 * 1024)
+// Larger objects are allocated in the old space directly, rather than copied out later.
+#define NURSERY_MAX_OBJECT (NURSERY_SIZE / 16)
+// Collection pauses are counted by length: bucket i counts those shorter than 2^i microseconds,
+// and the last one those longer.
+#define GC_PAUSE_BUCKETS 24
+
+typedef struct
+{
+    uint64_t pauses[GC_PAUSE_BUCKETS];
+    uint64_t pause_count;
+    uint64_t total_pause_ns;
+    uint64_t longest_pause_ns;
+    uint64_t minor_count;
+    // Collections of the old space that have finished.
+    uint64_t major_count;
+} GcStats;
+
+typedef struct
+{
+    // Bytes the heap takes up now, as counted against the memory limit, and the most it has.
+    size_t bytes_allocated;
+    size_t peak_bytes;
+    // SIZE_MAX if there's no limit.
+    size_t memory_limit;
+    // Objects of each type allocated since the VM was created, young ones included, and those
+    // that haven't been freed yet.
+    uint64_t objects_allocated[OBJ_TYPE_COUNT];
+    uint64_t objects_live[OBJ_TYPE_COUNT];
+} MemoryStats;
+
 /// @brief Increases capacity by a factor of two.
 /// @param capacity to increase.
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity) * 2)
 
 /// @brief Reallocates array from current capacity(old_count) to requested capacity(new_count).
+/// @param vm that owns the memory.
 /// @param type of data.
 /// @param pointer to current memory.
 /// @param old_count is the current capacity.
 /// @param new_count is the requested capacity.
 /// @return pointer to new memory(might be the same address or new). 
-#define GROW_ARRAY(type, pointer, old_count, new_count)         \
-    (type *)lox_Reallocate(pointer, sizeof(type) * (old_count), \
+#define GROW_ARRAY(vm, type, pointer, old_count, new_count)         \
+    (type *)lox_Reallocate(vm, pointer, sizeof(type) * (old_count), \
                            sizeof(type) * (new_count))
 
 /// @brief Reallocates the array to size 0(free it).
+/// @param vm that owns the memory.
 /// @param type of array element.
 /// @param pointer to array.
 /// @param old_count is the current capacity of the array.
-#define FREE_ARRAY(type, pointer, old_count) \
-    lox_Reallocate(pointer, sizeof(type) * (old_count), 0)
+#define FREE_ARRAY(vm, type, pointer, old_count) \
+    lox_Reallocate(vm, pointer, sizeof(type) * (old_count), 0)
 
 /// @brief Reallocates data memory to size 0(free it).
+/// @param vm that owns the memory.
 /// @param type of data.
 /// @param pointer to data memory.
-#define FREE(type, pointer) lox_Reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, type, pointer) lox_Reallocate(vm, pointer, sizeof(type), 0)
 
 /// @brief Allocates data memory with size specified by sizeof(type) * count.
+/// @param vm that owns the memory.
 /// @param type of data.
 /// @param count is the amount of elements of type.
 /// @return pointer to allocated memory.
-#define ALLOCATE(type, count) \
-    (type *)lox_Reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(vm, type, count) \
+    (type *)lox_Reallocate(vm, NULL, 0, sizeof(type) * (count))
 
-void *lox_Reallocate(void *pointer, size_t old_size, size_t new_size);
-void lox_FreeObjects();
+void *lox_Reallocate(VM *vm, void *pointer, size_t old_size, size_t new_size);
+void *lox_AllocateYoung(VM *vm, size_t size);
+void lox_DiscardObject(VM *vm, Obj *object);
+void lox_RememberObject(VM *vm, Obj *object);
+void lox_CollectNursery(VM *vm);
+Obj *lox_ForwardObject(VM *vm, Obj *object);
+void lox_ForwardValue(VM *vm, Value *slot);
+void lox_CollectAtSafepoint(VM *vm);
+void lox_CollectGarbage(VM *vm);
+void lox_ShadeObject(VM *vm, Obj *object);
+void lox_GetGcStats(VM *vm, GcStats *stats);
+void lox_PrintGcStats(VM *vm);
+void lox_GetMemoryStats(VM *vm, MemoryStats *stats);
+void lox_PrintMemoryStats(VM *vm);
+void lox_MarkObject(VM *vm, Obj *object);
+void lox_MarkValue(VM *vm, Value value);
+void lox_FreeObjects(VM *vm);
 
 #endif
@@ -5,21 +5,39 @@
 #include "value.h"
 #include "chunk.h"
 
+typedef struct VM VM;
+typedef struct CallFrame CallFrame;
+
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
 #define IS_CLOSURE(value) IsObjType(value, OBJ_CLOSURE)
 #define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
 
+#define IS_FIBER(value) IsObjType(value, OBJ_FIBER)
+#define AS_FIBER(value) ((ObjFiber *)AS_OBJ(value))
+
 #define IS_FUNCTION(value) IsObjType(value, OBJ_FUNCTION)
 #define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
 
 #define IS_NATIVE(value) IsObjType(value, OBJ_NATIVE)
 #define AS_NATIVE(value) (((ObjNative *)AS_OBJ(value))->function)
 
+#define IS_ROPE(value) IsObjType(value, OBJ_ROPE)
+#define AS_ROPE(value) ((ObjRope *)AS_OBJ(value))
+
 #define IS_STRING(value) IsObjType(value, OBJ_STRING)
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
 
+// Strings and ropes are both strings to scripts. Only ObjString has its characters in one place.
+#define IS_TEXT(value) (IS_STRING(value) || IS_ROPE(value))
+
+// Concatenations at least this long make a rope instead of copying both operands.
+#define ROPE_MIN_LENGTH 256
+// Appending to a rope copies the string it ends in along with the appended one, as long as the
+// two add up to at most this. Appending in small pieces then doesn't need a node per piece.
+#define ROPE_LEAF_LENGTH 128
+
 typedef enum
 {
     OBJ_STRING,
@@ -28,15 +46,31 @@ typedef enum
     // Closure is the runtime representation of a function.
     OBJ_CLOSURE,
     OBJ_NATIVE,
+    OBJ_FIBER,
+    // The concatenation of two strings or ropes, whose characters are only copied once needed.
+    OBJ_ROPE,
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_ROPE + 1)
+
 struct Obj
 {
     ObjType type;
+    // Reached by the collector during the current collection.
+    bool is_marked;
+    // Allocated by a VM running shared code(see lox_InitSharedVM). Such a VM only collects
+    // these. Everything else it sees belongs to the owner.
+    bool worker_owned;
+    // Listed in vm->remembered, as an old object that may refer to young ones.
+    bool is_remembered;
+    // The next object on vm->objects. Young objects aren't on it. Once one has been copied out
+    // of the nursery, it's marked and this points to the copy.
     struct Obj *next;
 };
 
-typedef Value (*NativeFn)(int argCount, Value *args);
+// Natives get their arguments in 'args' and return their result in 'result'. They return false
+// after reporting a runtime error.
+typedef bool (*NativeFn)(VM *vm, int arg_count, Value *args, Value *result);
 
 typedef struct
 {
@@ -44,14 +78,32 @@ typedef struct
     NativeFn function;
 } ObjNative;
 
+// A string and its characters are a single allocation of STRING_SIZE(length) bytes.
 struct ObjString
 {
     Obj obj;
     int length;
-    char *chars;
     uint32_t hash;
+    // Null-terminated.
+    char chars[];
 };
 
+/// @brief Bytes taken up by a string of 'length' characters, including the terminator.
+#define STRING_SIZE(length) (sizeof(ObjString) + (size_t)(length) + 1)
+
+// Repeated concatenation builds a tree of ropes, so it takes time linear in the length of the
+// result. The characters are copied into a string when a native needs them, or the rope is
+// printed(see lox_FlattenText). Ropes are never interned, so comparing one compares characters.
+typedef struct
+{
+    Obj obj;
+    // The length of left and right together.
+    int length;
+    // Each is an ObjString or an ObjRope.
+    Obj *left;
+    Obj *right;
+} ObjRope;
+
 // ObjFunction is the compile-time representation of a function.
 typedef struct
 {
@@ -59,6 +111,13 @@ typedef struct
     int arity;
     Chunk chunk;
     ObjString *name;
+    // Number of calls, used by the JIT to find hot functions.
+    int call_count;
+    // Machine code compiled by the JIT, or NULL.
+    void *native;
+    size_t native_size;
+    // Loops of the chunk seen by the trace recorder.
+    struct Trace *traces;
 } ObjFunction;
 
 // ObjClosure is a wrapped around ObjFunction providing the runtime-representation of a function.
@@ -69,11 +128,49 @@ typedef struct
     ObjFunction *function;
 } ObjClosure;
  
-ObjClosure *lox_CreateClosure(ObjFunction *function);
-ObjFunction *lox_CreateFunction();
-ObjNative *lox_CreateNative(NativeFn function);
-ObjString *lox_CopyString(const char *chars, int length);
-ObjString *lox_TakeString(char *chars, int length);
+typedef enum
+{
+    // Created, but its function hasn't been called yet.
+    FIBER_NEW,
+    // Running, or waiting for a fiber it resumed.
+    FIBER_RUNNING,
+    // Yielded, and can be resumed.
+    FIBER_SUSPENDED,
+    // Parked on I/O or in wait(), until the event loop switches back to it(see vm/io.h).
+    FIBER_WAITING,
+    // Its function returned, or a runtime error unwound it.
+    FIBER_DONE,
+} FiberState;
+
+// ObjFiber is a coroutine with its own frames and value stack(see vm/fiber.h). The stacks of the
+// running fiber are in the VM. The others keep theirs here while they wait.
+typedef struct ObjFiber
+{
+    Obj obj;
+    FiberState state;
+    CallFrame *frames;
+    int frame_count;
+    int frame_capacity;
+    Value *stack;
+    Value *stack_top;
+    int stack_capacity;
+    // The fiber that resumed this one, which a yield returns to.
+    struct ObjFiber *resumer;
+    // Created by spawn. The event loop runs it, so it can't be resumed or yield.
+    bool spawned;
+} ObjFiber;
+
+ObjClosure *lox_CreateClosure(VM *vm, ObjFunction *function);
+ObjFiber *lox_CreateFiber(VM *vm, Value function);
+ObjFunction *lox_CreateFunction(VM *vm);
+ObjNative *lox_CreateNative(VM *vm, NativeFn function);
+ObjString *lox_CopyString(VM *vm, const char *chars, int length);
+ObjString *lox_ReserveString(VM *vm, int length);
+ObjString *lox_InternString(VM *vm, ObjString *string);
+Obj *lox_ConcatenateText(VM *vm, Obj *left, Obj *right);
+void lox_CopyText(Obj *text, char *dest);
+ObjString *lox_FlattenText(VM *vm, Value value);
+bool lox_TextsEqual(Obj *a, Obj *b);
 void lox_PrintObject(Value value);
 
 static inline bool IsObjType(Value value, ObjType type)
@@ -81,4 +178,10 @@ static inline bool IsObjType(Value value, ObjType type)
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+/// @return the length of a string or a rope.
+static inline int TextLength(Obj *text)
+{
+    return text->type == OBJ_STRING ? ((ObjString *)text)->length : ((ObjRope *)text)->length;
+}
+
 #endif
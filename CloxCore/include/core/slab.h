@@ -0,0 +1,31 @@
+#ifndef _CLOX_SLAB_H_
+#define _CLOX_SLAB_H_
+
+#include "common/common.h"
+#include "core/object.h"
+
+// AddressSanitizer only sees blocks from malloc, so it can't find misuse of slab blocks.
+#if defined(SLAB_ALLOCATOR) && (defined(__linux__) || defined(__APPLE__)) && !defined(__SANITIZE_ADDRESS__)
+#define USE_SLABS
+#endif
+
+#ifdef USE_SLABS
+
+// Small allocations are rounded up to a multiple of SLAB_GRANULE, and each size up to
+// SLAB_MAX_SIZE is a class with its own free list. Larger ones go to malloc.
+#define SLAB_GRANULE 16
+#define SLAB_MAX_SIZE 256
+#define SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_GRANULE)
+// A class takes blocks of SLAB_RUN_SIZE from a region, and bump-allocates in them once its free
+// list is empty. Regions are mapped SLAB_REGION_SIZE at a time, aligned to their size, so the
+// kernel can back them with a huge page.
+#define SLAB_RUN_SIZE (64 * 1024)
+#define SLAB_REGION_SIZE (2 * 1024 * 1024)
+
+void *lox_AllocateSlab(VM *vm, size_t size);
+void lox_FreeSlab(VM *vm, void *pointer, size_t size);
+void lox_FreeSlabs(VM *vm);
+
+#endif
+
+#endif
@@ -1,17 +1,72 @@
 #ifndef _CLOX_VALUE_H_
 #define _CLOX_VALUE_H_
 
+#include <string.h>
+
 #include "common/common.h"
 
+typedef struct VM VM;
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#ifdef NAN_BOXING
+
+// With NaN-boxing, every value is packed into a single 64-bit word.
+// Numbers are stored as-is. Everything else lives inside the unused payload of a quiet NaN:
+// - nil, false and true are small tags in the lowest bits.
+// - Objects set the sign-bit and store the pointer in the lower 48 bits.
+typedef uint64_t Value;
+
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+#define TAG_UNDEFINED 4
+
+#define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
+
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUMBER(value) ValueToNumber(value)
+#define AS_OBJ(value) ((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(value) ((value) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define NUMBER_VAL(value) NumberToValue(value)
+#define OBJ_VAL(object) ((Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(object)))
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+
+static inline double ValueToNumber(Value value)
+{
+    double number;
+    memcpy(&number, &value, sizeof(Value));
+    return number;
+}
+
+static inline Value NumberToValue(double number)
+{
+    Value value;
+    memcpy(&value, &number, sizeof(double));
+    return value;
+}
+
+#else
+
 typedef enum
 {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
     VAL_OBJ,
+    VAL_UNDEFINED,
 } ValueType;
 
 typedef struct
@@ -29,6 +84,7 @@ typedef struct
 #define IS_NIL(value) ((value).type == VAL_NIL)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
@@ -38,6 +94,12 @@ typedef struct
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj *)object}})
+#define UNDEFINED_VAL ((Value){VAL_UNDEFINED, {.number = 0}})
+
+#endif
+
+// UNDEFINED_VAL marks global slots that are declared, but not yet defined.
+// It's never visible to Lox code.
 
 typedef struct
 {
@@ -47,8 +109,8 @@ typedef struct
 } ValueArray;
 
 void lox_InitValueArray(ValueArray *array);
-void lox_WriteValueArray(ValueArray *array, Value value);
-void lox_FreeValueArray(ValueArray *array);
+void lox_WriteValueArray(VM *vm, ValueArray *array, Value value);
+void lox_FreeValueArray(VM *vm, ValueArray *array);
 void lox_PrintValue(Value value);
 bool lox_ValuesEqual(Value a, Value b);
 
@@ -0,0 +1,24 @@
+#ifndef _CLOX_FIBER_H_
+#define _CLOX_FIBER_H_
+
+#include "common/common.h"
+#include "core/object.h"
+#include "vm/vm.h"
+
+// Fibers are coroutines, exposed to scripts as natives:
+//   fiber(fn)        - creates a fiber that calls fn(taking at most one argument) when resumed.
+//   resume(f, value) - runs f until it yields or returns, and returns what it yielded or returned.
+//                      The first resume passes 'value' to fn, later ones return it from yield.
+//   yield(value)     - suspends the running fiber and returns 'value' from its resume.
+//   isDone(f)        - true once f's function has returned.
+// Switching only swaps the stacks in the VM, so it doesn't depend on how deep either fiber is.
+
+bool lox_FiberNative(VM *vm, int arg_count, Value *args, Value *result);
+bool lox_ResumeNative(VM *vm, int arg_count, Value *args, Value *result);
+bool lox_YieldNative(VM *vm, int arg_count, Value *args, Value *result);
+bool lox_IsDoneNative(VM *vm, int arg_count, Value *args, Value *result);
+bool lox_TransferFiber(VM *vm, Value value);
+bool lox_FinishFiber(VM *vm, Value result);
+void lox_UnwindFibers(VM *vm);
+
+#endif
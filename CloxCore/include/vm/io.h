@@ -0,0 +1,59 @@
+#ifndef _CLOX_IO_H_
+#define _CLOX_IO_H_
+
+#include "common/common.h"
+#include "core/object.h"
+#include "vm/vm.h"
+
+#if defined(ASYNC_IO) && defined(__linux__)
+#define USE_EPOLL
+#endif
+
+#ifdef USE_EPOLL
+
+// Events handled by one epoll_wait.
+#define IO_MAX_EVENTS 64
+
+// Non-blocking I/O on file descriptors, exposed to scripts as natives. Descriptors are numbers.
+//   spawn(fn, value)    - creates a fiber that the event loop runs, and calls fn(value) once the
+//                         running fiber waits. The value is optional.
+//   wait()              - waits until every spawned fiber has finished.
+//   pipe()              - creates a pipe and returns its read end.
+//   pipeWriter(fd)      - returns the write end of the pipe whose read end is fd.
+//   open(path, mode)    - opens a file for reading("r"), writing("w") or appending("a").
+//   listen(path)        - creates a Unix socket listening at path.
+//   accept(fd)          - waits for a connection to a listening socket and returns its socket.
+//   connect(path)       - connects to the Unix socket listening at path.
+//   read(fd, max)       - reads at most max bytes, and returns them as a string or nil at the end.
+//   write(fd, string)   - writes the string, and returns the number of bytes written.
+//   close(fd)           - closes a descriptor.
+// An operation that would block parks the running fiber and registers its descriptor with the
+// VM's epoll instance. The VM then switches to the next fiber that can run. When none can, it
+// waits for a descriptor to become ready, completes that fiber's operation and switches back to
+// it with the result. So one thread can have any number of operations outstanding.
+// Errors found while an operation was parked end it instead: read and accept return nil, and
+// write returns the number of bytes written before the error.
+
+// Per-VM event loop state(see vm->io_loop).
+typedef struct IoLoop IoLoop;
+
+bool lox_SpawnNative(VM *vm, int arg_count, Value *args, Value *result);
+bool lox_WaitNative(VM *vm, int arg_count, Value *args, Value *result);
+bool lox_PipeNative(VM *vm, int arg_count, Value *args, Value *result);
+bool lox_PipeWriterNative(VM *vm, int arg_count, Value *args, Value *result);
+bool lox_OpenNative(VM *vm, int arg_count, Value *args, Value *result);
+bool lox_ListenNative(VM *vm, int arg_count, Value *args, Value *result);
+bool lox_AcceptNative(VM *vm, int arg_count, Value *args, Value *result);
+bool lox_ConnectNative(VM *vm, int arg_count, Value *args, Value *result);
+bool lox_ReadNative(VM *vm, int arg_count, Value *args, Value *result);
+bool lox_WriteNative(VM *vm, int arg_count, Value *args, Value *result);
+bool lox_CloseNative(VM *vm, int arg_count, Value *args, Value *result);
+bool lox_FinishSpawnedFiber(VM *vm);
+void lox_CancelIo(VM *vm);
+void lox_MarkIoRoots(VM *vm);
+void lox_ForwardIoRoots(VM *vm);
+void lox_FreeIoLoop(VM *vm);
+
+#endif
+
+#endif
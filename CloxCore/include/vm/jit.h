@@ -0,0 +1,38 @@
+#ifndef _CLOX_JIT_H_
+#define _CLOX_JIT_H_
+
+#include "common/common.h"
+#include "core/object.h"
+#include "vm/vm.h"
+
+#if defined(JIT) && defined(NAN_BOXING) && defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define USE_JIT
+#endif
+
+#ifdef USE_JIT
+
+// A function is compiled on the call that brings its call count to the threshold.
+#define JIT_THRESHOLD 100
+// Native frames nest on the C stack, so deeper calls fall back on the interpreter.
+#define JIT_MAX_DEPTH 1024
+
+typedef enum
+{
+    // The function has no native code. Run it in the interpreter.
+    JIT_NOT_COMPILED,
+    JIT_OK,
+    JIT_ERROR
+} JitResult;
+
+struct Trace;
+
+bool lox_JitCompile(ObjFunction *function);
+JitResult lox_JitRunFrame(VM *vm, CallFrame *frame);
+void lox_JitFree(ObjFunction *function);
+bool lox_JitCompileTrace(struct Trace *trace);
+JitResult lox_JitRunTrace(VM *vm, struct Trace *trace, CallFrame *frame);
+void lox_JitFreeTrace(struct Trace *trace);
+
+#endif
+
+#endif
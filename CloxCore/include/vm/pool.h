@@ -0,0 +1,14 @@
+#ifndef _CLOX_POOL_H_
+#define _CLOX_POOL_H_
+
+#include "common/common.h"
+#include "core/object.h"
+#include "vm/vm.h"
+
+// The most threads a pool runs.
+#define POOL_MAX_WORKERS 256
+
+int lox_RunPool(VM *owner, ObjFunction *script, const char *entry,
+                const char **inputs, int input_count, int worker_count);
+
+#endif
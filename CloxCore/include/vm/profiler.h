@@ -0,0 +1,12 @@
+#ifndef _CLOX_PROFILER_H_
+#define _CLOX_PROFILER_H_
+
+#include "common/common.h"
+
+// The longest opcode sequence recorded by the profiler.
+#define NGRAM_MAX 5
+
+void lox_ProfileInstruction(uint8_t *ip);
+void lox_PrintProfile();
+
+#endif
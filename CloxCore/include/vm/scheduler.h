@@ -0,0 +1,35 @@
+#ifndef _CLOX_SCHEDULER_H_
+#define _CLOX_SCHEDULER_H_
+
+#include "common/common.h"
+#include "core/object.h"
+#include "vm/vm.h"
+
+// The most threads a scheduler runs.
+#define SCHEDULER_MAX_THREADS 256
+// Tasks are allocated in blocks that never move, so a task id can be looked up without a lock.
+#define TASK_BLOCK_SIZE 1024
+#define TASK_MAX_BLOCKS 16384
+
+// Tasks are lightweight units of work, multiplexed over a fixed number of threads. Each thread
+// has its own VM over the owner's compiled code(see lox_InitSharedVM) and runs its tasks as
+// fibers. Exposed to scripts as natives:
+//   task(fn, value) - creates a task that calls fn(value) on any thread, and returns its id.
+//                     The value is optional.
+//   join(id)        - waits for a task to finish, and returns its result, or nil if it failed.
+// A new task goes onto the bottom of its thread's deque. Threads take their own tasks from the
+// bottom, newest first, and steal from the top of other threads' deques when they run out.
+// A task waiting in join parks its fiber, so its thread runs other tasks in the meantime. It is
+// resumed on the same thread once the joined task finishes.
+// Values passed to and returned from tasks are copied between VMs. Only nil, booleans, numbers,
+// strings and functions can be passed.
+
+// Per-thread scheduler state(see vm->task_worker).
+typedef struct TaskWorker TaskWorker;
+
+bool lox_TaskNative(VM *vm, int arg_count, Value *args, Value *result);
+bool lox_JoinNative(VM *vm, int arg_count, Value *args, Value *result);
+InterpretResult lox_RunTasks(VM *owner, Value entry, int thread_count, Value *result);
+void lox_MarkTaskRoots(VM *vm);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef _CLOX_TRACE_H_
+#define _CLOX_TRACE_H_
+
+#include "common/common.h"
+#include "core/object.h"
+#include "vm/jit.h"
+#include "vm/vm.h"
+
+#ifdef USE_JIT
+
+// Back-edges taken to a loop header before its next iteration is recorded.
+#define TRACE_HOT_LOOP 50
+// Instructions in a trace. Longer recordings are aborted.
+#define TRACE_MAX_LENGTH 512
+// Aborted recordings before a loop is no longer traced.
+#define TRACE_MAX_ABORTS 3
+
+typedef enum
+{
+    // Operands were numbers.
+    TRACE_NUMBERS = 1 << 0,
+    // Operands were strings.
+    TRACE_STRINGS = 1 << 1,
+    // The conditional jump was taken.
+    TRACE_TAKEN = 1 << 2,
+    // The back-edge jumped to the start of the trace.
+    TRACE_CLOSES_LOOP = 1 << 3,
+} TraceObservation;
+
+typedef struct
+{
+    // The recorded instruction.
+    uint8_t *ip;
+    // What was observed when it executed, used to pick guards.
+    uint8_t observed;
+} TraceStep;
+
+// A trace is one iteration of a loop, recorded as the linear sequence of instructions the
+// interpreter executed in the loop's frame. Calls are recorded, but not the callee's instructions.
+typedef struct Trace
+{
+    ObjFunction *function;
+    // Target of the back-edge, where the trace starts.
+    uint8_t *header;
+    int hits;
+    int aborts;
+    TraceStep *steps;
+    int step_count;
+    int step_capacity;
+    // Machine code compiled by the JIT, or NULL.
+    void *native;
+    size_t native_size;
+    struct Trace *next;
+} Trace;
+
+// Per-VM recording state(see vm->trace_recorder).
+typedef struct TraceRecorder TraceRecorder;
+
+Trace *lox_TraceBackEdge(VM *vm, CallFrame *frame, uint8_t *header);
+bool lox_TraceRecord(VM *vm, CallFrame *frame, uint8_t *ip, Value *stack_top);
+bool lox_TraceIsRecording(VM *vm);
+void lox_TraceAbort(VM *vm);
+void lox_FreeTraces(VM *vm, ObjFunction *function);
+void lox_PrintTraceStats(VM *vm);
+void lox_FreeTraceRecorder(VM *vm);
+
+#endif
+
+#endif
@@ -7,40 +7,155 @@
 #include "core/value.h"
 #include "common/hashtable.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// The frame and value stacks start small and grow on demand, up to vm->frames_max frames.
+// Each frame is guaranteed room for UINT8_COUNT values.
+#define FRAMES_INITIAL 8
+#define STACK_INITIAL UINT8_COUNT
+// The default limit on the number of frames.
+#define FRAMES_MAX 4096
 
+// Where the heap of a VM gets its memory from(see lox_InitVMWithAllocator). 'allocate' returns a
+// block of 'size' bytes, and 'free' is given it back with the same size. Both get 'user_data'.
 typedef struct
+{
+    void *(*allocate)(void *user_data, size_t size);
+    void (*free)(void *user_data, void *pointer, size_t size);
+    void *user_data;
+} Allocator;
+
+// The phase of the collection of the old space(see core/memory.h).
+typedef enum
+{
+    GC_IDLE,
+    // Tracing from the roots, in steps or on a background thread.
+    GC_MARKING,
+    // Freeing what wasn't marked, in steps.
+    GC_SWEEPING,
+} GcPhase;
+
+struct CallFrame
 {
     ObjFunction *function;
     uint8_t *ip;
     Value *slots;
-} CallFrame;
+};
 
-typedef struct
+// All interpreter state lives in a VM. Interpreters don't share anything, so separate VMs
+// can run concurrently on separate threads.
+struct VM
 {
-    CallFrame frames[FRAMES_MAX];
+    // Growing a stack may move it. Pointers into the frames and the value stack must be
+    // reloaded after anything that can push a frame.
+    // These are the stacks of the running fiber. Switching fibers swaps them.
+    CallFrame *frames;
     int frame_count;
-    Value stack[STACK_MAX];
+    int frame_capacity;
+    // The limit on call depth. Exceeding it is a stack overflow.
+    int frames_max;
+    Value *stack;
     Value *stack_top;
+    int stack_capacity;
+    // The running fiber. Scripts and calls from C start on main_fiber, which keeps the
+    // original stacks while another fiber runs.
+    ObjFiber *fiber;
+    ObjFiber main_fiber;
+    // Set by a native that resumes, yields or waits, to the fiber to switch to once it returns.
+    ObjFiber *transfer_to;
     Obj *objects;
     HashTable strings;
-    HashTable globals;
-} VM;
+    // Globals are resolved to slots at compile-time.
+    // global_slots maps a name to its slot, global_names maps a slot back to its name
+    // and global_values holds the values. Slots not yet defined hold UNDEFINED_VAL.
+    HashTable global_slots;
+    ValueArray global_names;
+    ValueArray global_values;
+    // Functions compiled by lox_CompileSource. They stay alive as long as the VM.
+    ValueArray handles;
+    // Record and compile hot loops(see vm/trace.h).
+    bool trace_loops;
+    // The loop being recorded, allocated on first use.
+    struct TraceRecorder *trace_recorder;
+    // Parked I/O and the fibers waiting to run(see vm/io.h), allocated on first use.
+    struct IoLoop *io_loop;
+    // The scheduler thread this VM runs tasks for(see vm/scheduler.h), or NULL.
+    struct TaskWorker *task_worker;
+    // Execution budgets(see lox_SetLimits). 'fuel' is the number of instructions left to run.
+    // It is only charged on back-edges and calls, so checking it costs one subtraction there.
+    // Back-edges and calls are also the safepoints where garbage is collected. Requesting one
+    // moves the fuel to fuel_reserve, so the next check is taken(see lox_Safepoint).
+    int64_t fuel;
+    int64_t fuel_reserve;
+    // Bytes currently allocated through lox_Reallocate, and in the nursery.
+    size_t bytes_allocated;
+    size_t peak_bytes;
+    // Objects of each type allocated and freed since the VM was created(see lox_GetMemoryStats).
+    uint64_t objects_allocated[OBJ_TYPE_COUNT];
+    uint64_t objects_freed[OBJ_TYPE_COUNT];
+    // The heap's memory comes from here if 'allocate' is set, and from malloc and the slabs if not.
+    Allocator allocator;
+    // The size classes small allocations are taken from(see core/slab.h), allocated on first use.
+    struct SlabHeap *slabs;
+    size_t memory_limit;
+    // The garbage collector(see core/memory.h). A collection is due once bytes_allocated passes
+    // next_gc. Marked objects whose references haven't been marked yet are on the gray stack.
+    size_t next_gc;
+    Obj **gray_stack;
+    int gray_count;
+    int gray_capacity;
+    // Young objects are bump-allocated from nursery_top up to nursery_end, allocated on first
+    // use. 'remembered' lists the old objects that may refer to them.
+    char *nursery;
+    char *nursery_top;
+    char *nursery_end;
+    Obj **remembered;
+    int remembered_count;
+    int remembered_capacity;
+    // Collections of the old space are spread over safepoints, tracing or sweeping gc_quantum
+    // objects at each, or done all at once if it's 0. With gc_concurrent, the tracing is done
+    // on a background thread.
+    int gc_quantum;
+    bool gc_concurrent;
+    GcPhase gc_phase;
+    // The collection in progress and the pause statistics, allocated on first use.
+    struct Collector *collector;
+    // Set when the last runtime error was a budget running out.
+    bool limit_exceeded;
+    // Native frames currently nested on the C stack(see vm/jit.h).
+    int native_depth;
+    // The functions run by this VM were compiled by another VM and are shared with other
+    // threads(see vm/pool.h). This VM treats their chunks as read-only: it doesn't quicken or
+    // deoptimize them, and doesn't compile or run them natively. The owner may have quickened
+    // or compiled them before they were shared.
+    bool shared_code;
+};
 
 typedef enum
 {
     INTERPRET_OK,
     INTERPRET_COMPILE_ERROR,
-    INTERPRET_RUNTIME_ERROR
+    INTERPRET_RUNTIME_ERROR,
+    // The instruction, memory or call depth budget ran out. The error has been reported.
+    INTERPRET_LIMIT_EXCEEDED
 } InterpretResult;
 
-extern VM vm;
-
-void lox_InitVM();
-void lox_FreeVM();
-InterpretResult lox_InterpretSource(const char *source);
-void lox_PushStack(Value value);
-Value lox_PopStack();
+void lox_InitVM(VM *vm);
+void lox_InitVMWithAllocator(VM *vm, const Allocator *allocator);
+void lox_InitSharedVM(VM *vm, VM *owner);
+void lox_FreeVM(VM *vm);
+void lox_SetLimits(VM *vm, int64_t max_instructions, size_t max_bytes);
+InterpretResult lox_InterpretSource(VM *vm, const char *source);
+ObjFunction *lox_CompileSource(VM *vm, const char *source);
+InterpretResult lox_CallFunction(VM *vm, Value callee, int arg_count, const Value *args, Value *result);
+bool lox_GetGlobal(VM *vm, const char *name, Value *value);
+void lox_PushStack(VM *vm, Value value);
+Value lox_PopStack(VM *vm);
+int lox_ResolveGlobalSlot(VM *vm, ObjString *name);
+InterpretResult lox_RunFrames(VM *vm, ObjFiber *base_fiber, int base_frame);
+bool lox_CallValue(VM *vm, Value callee, int arg_count);
+bool lox_TailCallValue(VM *vm, Value callee, int arg_count);
+bool lox_Concatenate(VM *vm);
+void lox_RuntimeError(VM *vm, const char *format, ...);
+void lox_RequestSafepoint(VM *vm);
+bool lox_Safepoint(VM *vm);
 
 #endif
@@ -0,0 +1,167 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "common/hash.h"
+
+#ifndef STRING_HASH_FNV
+// Odd constants with well-mixed bits(those of wyhash).
+#define HASH_PRIME_0 0xa0761d6478bd642full
+#define HASH_PRIME_1 0xe7037ed1a0b428dbull
+#endif
+
+static uint64_t ChooseSeed(void);
+static void InitSeed(void);
+#ifndef STRING_HASH_FNV
+static uint64_t Mix(uint64_t a, uint64_t b);
+static uint64_t Read64(const uint8_t *bytes);
+static uint64_t Read32(const uint8_t *bytes);
+#endif
+
+static pthread_once_t seed_once = PTHREAD_ONCE_INIT;
+// Shared by every VM in the process, since VMs running shared code start out with the strings,
+// and the hashes, of the VM that compiled it.
+static uint64_t seed;
+
+/// @brief Picks the seed of lox_HashString, once per process. Called by lox_InitVM, so it's done
+///        before any string is hashed.
+void lox_InitHashSeed(void)
+{
+    pthread_once(&seed_once, InitSeed);
+}
+
+#ifndef STRING_HASH_FNV
+
+/// @brief Hashes a string 8 bytes at a time(after wyhash). Strings of up to 16 bytes are read as
+///        a few overlapping words, with no loop. The seed keeps the hashes of given strings from
+///        being known in advance, so input can't be crafted to collide in the tables.
+/// @param chars to hash.
+/// @param length of 'chars'.
+/// @return the hash.
+uint32_t lox_HashString(const char *chars, int length)
+{
+    const uint8_t *bytes = (const uint8_t *)chars;
+    size_t left = (size_t)length;
+    uint64_t state = seed;
+    uint64_t a = 0;
+    uint64_t b = 0;
+    if (left <= 16)
+    {
+        if (left >= 4)
+        {
+            // Two 4-byte words from each end. They overlap for lengths below 16.
+            size_t middle = (left >> 3) << 2;
+            a = (Read32(bytes) << 32) | Read32(bytes + middle);
+            b = (Read32(bytes + left - 4) << 32) | Read32(bytes + left - 4 - middle);
+        }
+        else if (left > 0)
+        {
+            a = ((uint64_t)bytes[0] << 16) | ((uint64_t)bytes[left >> 1] << 8) | bytes[left - 1];
+        }
+    }
+    else
+    {
+        for (; left > 16; left -= 16, bytes += 16)
+            state = Mix(Read64(bytes) ^ HASH_PRIME_1, Read64(bytes + 8) ^ state);
+        // The last 16 bytes, which may overlap the words already mixed in.
+        a = Read64(bytes + left - 16);
+        b = Read64(bytes + left - 8);
+    }
+    return (uint32_t)Mix(HASH_PRIME_0 ^ (uint64_t)length, Mix(a ^ HASH_PRIME_1, b ^ state));
+}
+
+#else
+
+/// @brief Hashes a string a byte at a time using FNV-1a, starting from the seed.
+/// @param chars to hash.
+/// @param length of 'chars'.
+/// @return the hash.
+uint32_t lox_HashString(const char *chars, int length)
+{
+    uint32_t hash = 2166136261u ^ (uint32_t)seed;
+    for (int i = 0; i < length; i++)
+    {
+        hash ^= (uint8_t)chars[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+#endif
+
+/// @return STRING_HASH_SEED if it's defined, so runs can be reproduced. Otherwise random bytes
+///         from the system, or if there are none, the time mixed with addresses that change
+///         between runs.
+uint64_t ChooseSeed(void)
+{
+#ifdef STRING_HASH_SEED
+    return (uint64_t)STRING_HASH_SEED;
+#else
+    uint64_t random = 0;
+    FILE *source = fopen("/dev/urandom", "rb");
+    if (source != NULL)
+    {
+        size_t read = fread(&random, sizeof(random), 1, source);
+        fclose(source);
+        if (read == 1)
+            return random;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    random = (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+    random ^= (uint64_t)(uintptr_t)&random;
+    random ^= (uint64_t)(uintptr_t)&ChooseSeed << 17;
+    return random;
+#endif
+}
+
+void InitSeed(void)
+{
+    seed = ChooseSeed();
+#ifndef STRING_HASH_FNV
+    // Spread the seed's bits, which the hash would otherwise do for every string.
+    seed ^= Mix(seed ^ HASH_PRIME_0, HASH_PRIME_1);
+#endif
+}
+
+#ifndef STRING_HASH_FNV
+
+/// @return the high and low halves of the 128-bit product of 'a' and 'b', xor'ed together.
+uint64_t Mix(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+    uint64_t a_high = a >> 32, a_low = (uint32_t)a;
+    uint64_t b_high = b >> 32, b_low = (uint32_t)b;
+    uint64_t high = a_high * b_high;
+    uint64_t middle_0 = a_high * b_low;
+    uint64_t middle_1 = b_high * a_low;
+    uint64_t low = a_low * b_low;
+    uint64_t sum = low + (middle_0 << 32);
+    uint64_t carry = sum < low;
+    uint64_t result_low = sum + (middle_1 << 32);
+    carry += result_low < sum;
+    uint64_t result_high = high + (middle_0 >> 32) + (middle_1 >> 32) + carry;
+    return result_low ^ result_high;
+#endif
+}
+
+uint64_t Read64(const uint8_t *bytes)
+{
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+uint64_t Read32(const uint8_t *bytes)
+{
+    uint32_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+#endif
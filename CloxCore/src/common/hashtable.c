@@ -1,130 +1,110 @@
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "common/hashtable.h"
 #include "core/memory.h"
 #include "core/object.h"
 #include "core/value.h"
 
+// Control bytes of slots without a live entry have the high bit set.
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xFE
+// The bits of the hash that pick the first group, and those kept in the control byte.
+#define HASH_GROUP(hash) ((size_t)(hash) >> 7)
+#define HASH_CONTROL(hash) ((uint8_t)((hash) & 0x7F))
+// No slot.
+#define NOT_FOUND SIZE_MAX
+// The entries and the control bytes after them are a single allocation.
+#define TABLE_SIZE(capacity) ((capacity) * (sizeof(Entry) + 1))
+
+static uint32_t MatchControl(const uint8_t *group, uint8_t control);
+static uint32_t MatchFree(const uint8_t *group);
+static size_t FindSlot(HashTable *table, ObjString *key);
+static size_t FindFreeSlot(HashTable *table, uint32_t hash);
+static size_t CapacityFor(size_t count);
+static void Resize(VM *vm, HashTable *table, size_t capacity);
+
 /// @brief Initializes hash-table. Sets everything to zero/NULL.
 /// @param table to initialize.
 void lox_InitHashTable(HashTable *table)
 {
     table->count = 0;
+    table->deleted = 0;
     table->capacity = 0;
+    table->controls = NULL;
     table->entries = NULL;
 }
 
 /// @brief Deletes data in 'table'.
+/// @param vm owns the table's memory.
 /// @param table to delete.
-void lox_FreeHashTable(HashTable *table)
+void lox_FreeHashTable(VM *vm, HashTable *table)
 {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(vm, char, table->entries, TABLE_SIZE(table->capacity));
     lox_InitHashTable(table);
 }
 
-static Entry *FindEntry(Entry *entries, int capacity, ObjString *key)
-{
-    uint32_t index = key->hash % capacity;
-    Entry *tombstone = NULL;
-
-    for (;;)
-    {
-        Entry *entry = &entries[index];
-        if (entry->key == NULL)
-        {
-            if (IS_NIL(entry->value))
-            {
-                // Empty entry.
-                return tombstone != NULL ? tombstone : entry;
-            }
-            else
-            {
-                // We found a tombstone.
-                if (tombstone == NULL)
-                    tombstone = entry;
-            }
-        }
-        else if (entry->key == key)
-        {
-            // We found the key.
-            return entry;
-        }
-
-        index = (index + 1) % capacity;
-    }
-}
-
-static void AdjustCapacity(HashTable *table, int capacity)
-{
-    // Allocate new hash-table.
-    Entry *entries = ALLOCATE(Entry, capacity);
-    for (int i = 0; i < capacity; i++)
-    {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
-    }
-
-    // Insert old(used) buckets into new hash-table.
-    table->count = 0;
-    for (int i = 0; i < table->capacity; i++)
-    {
-        Entry *entry = &table->entries[i];
-        if (entry->key == NULL)
-            continue;
-
-        Entry *dest = FindEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
-    }
-
-    // Free old hash-table.
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-
-    // Update hash-table structure.
-    table->entries = entries;
-    table->capacity = capacity;
-}
-
 /// @brief Adds an entry with 'key' and 'value' to 'table'.
+/// @param vm owns the table's memory.
 /// @param table to add into.
 /// @param key to add.
 /// @param value to add.
 /// @return true if entry does not exist. False if it does.
-bool lox_AddEntryHashTable(HashTable *table, ObjString *key, Value value)
+bool lox_AddEntryHashTable(VM *vm, HashTable *table, ObjString *key, Value value)
 {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD)
+    size_t index = table->count > 0 ? FindSlot(table, key) : NOT_FOUND;
+    if (index != NOT_FOUND)
     {
-        int capacity = GROW_CAPACITY(table->capacity);
-        AdjustCapacity(table, capacity);
+        table->entries[index].value = value;
+        return false;
     }
 
-    Entry *entry = FindEntry(table->entries, table->capacity, key);
-    bool is_new_key = entry->key == NULL;
-    if (is_new_key && IS_NIL(entry->value))
-        table->count++;
+    if ((table->count + table->deleted + 1) * TABLE_MAX_LOAD_DENOMINATOR >
+        table->capacity * TABLE_MAX_LOAD_NUMERATOR)
+        Resize(vm, table, CapacityFor(table->count + 1));
 
-    entry->key = key;
-    entry->value = value;
-    return is_new_key;
+    index = FindFreeSlot(table, key->hash);
+    if (table->controls[index] == CONTROL_DELETED)
+        table->deleted--;
+    table->controls[index] = HASH_CONTROL(key->hash);
+    table->entries[index].key = key;
+    table->entries[index].value = value;
+    table->count++;
+    return true;
 }
 
 /// @brief Copies entries in 'src' that does not exist in 'dest' to 'dest'.
+/// @param vm owns the memory of 'dest'.
 /// @param src is copied from.
 /// @param dest is copied to.
-void lox_CopyHashTable(HashTable *src, HashTable *dest)
+void lox_CopyHashTable(VM *vm, HashTable *src, HashTable *dest)
 {
-    for (int i = 0; i < src->capacity; i++)
+    for (size_t i = 0; i < src->capacity; i++)
     {
-        Entry *entry = &dest->entries[i];
+        Entry *entry = &src->entries[i];
         if (entry->key != NULL)
         {
-            lox_AddEntryHashTable(dest, entry->key, entry->value);
+            lox_AddEntryHashTable(vm, dest, entry->key, entry->value);
         }
     }
 }
 
+/// @brief Shrinks 'table' once it's at most an eighth full, and drops its tombstones once they
+///        take up a quarter of it. Otherwise it's left as it is. Call it after removing entries.
+/// @param vm owns the table's memory.
+/// @param table to compact.
+void lox_CompactHashTable(VM *vm, HashTable *table)
+{
+    size_t capacity = CapacityFor(table->count);
+    if (capacity <= table->capacity / 4)
+        Resize(vm, table, capacity);
+    else if (table->deleted * 4 > table->capacity)
+        Resize(vm, table, table->capacity);
+}
+
 /// @brief Retrieves a value into 'value' if there exists an element with 'key'.
 ///        If no elements exists with 'key', value is NULL.
 /// @param table to search.
@@ -136,11 +116,11 @@ bool lox_GetEntryHashTable(HashTable *table, ObjString *key, Value *value)
     if (table->count == 0)
         return false;
 
-    Entry *entry = FindEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL)
+    size_t index = FindSlot(table, key);
+    if (index == NOT_FOUND)
         return false;
 
-    *value = entry->value;
+    *value = table->entries[index].value;
     return true;
 }
 
@@ -153,14 +133,45 @@ bool lox_RemoveEntryHashTable(HashTable *table, ObjString *key)
     if (table->count == 0)
         return false;
 
-    // Find the entry.
-    Entry *entry = FindEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL)
+    size_t index = FindSlot(table, key);
+    if (index == NOT_FOUND)
         return false;
 
-    // Place a tombstone in the entry.
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    // Lookups stop at the first group with an empty slot, so if this group has one, none ever
+    // went past it, and the slot can be empty too. Otherwise one may have, and it needs a
+    // tombstone to carry on.
+    const uint8_t *group = table->controls + (index & ~(size_t)(TABLE_GROUP_SIZE - 1));
+    if (MatchControl(group, CONTROL_EMPTY) != 0)
+    {
+        table->controls[index] = CONTROL_EMPTY;
+    }
+    else
+    {
+        table->controls[index] = CONTROL_DELETED;
+        table->deleted++;
+    }
+    table->entries[index].key = NULL;
+    table->entries[index].value = NIL_VAL;
+    table->count--;
+    return true;
+}
+
+/// @brief Replaces 'key' with 'replacement', which has the same hash. Used when the garbage
+///        collector moves a key.
+/// @param table to update.
+/// @param key to replace.
+/// @param replacement for 'key'.
+/// @return true if found and replaced. False if not.
+bool lox_ReplaceKeyHashTable(HashTable *table, ObjString *key, ObjString *replacement)
+{
+    if (table->count == 0)
+        return false;
+
+    size_t index = FindSlot(table, key);
+    if (index == NOT_FOUND)
+        return false;
+
+    table->entries[index].key = replacement;
     return true;
 }
 
@@ -169,24 +180,124 @@ ObjString *lox_FindStringHashTable(HashTable *table, const char *chars, int leng
     if (table->count == 0)
         return NULL;
 
-    uint32_t index = hash % table->capacity;
-    for (;;)
+    size_t mask = table->capacity - 1;
+    size_t base = (HASH_GROUP(hash) * TABLE_GROUP_SIZE) & mask;
+    uint8_t control = HASH_CONTROL(hash);
+    for (size_t stride = TABLE_GROUP_SIZE;; stride += TABLE_GROUP_SIZE)
     {
-        Entry *entry = &table->entries[index];
-        if (entry->key == NULL)
+        const uint8_t *group = table->controls + base;
+        for (uint32_t matches = MatchControl(group, control); matches != 0; matches &= matches - 1)
         {
-            // Stop if we find an empty non-tombstone entry.
-            if (IS_NIL(entry->value))
-                return NULL;
+            ObjString *key = table->entries[base + __builtin_ctz(matches)].key;
+            if (key->length == length && key->hash == hash && memcmp(key->chars, chars, length) == 0)
+                return key;
         }
-        else if (entry->key->length == length &&
-                 entry->key->hash == hash &&
-                 memcmp(entry->key->chars, chars, length) == 0)
+        if (MatchControl(group, CONTROL_EMPTY) != 0)
+            return NULL;
+        base = (base + stride) & mask;
+    }
+}
+
+/// @return a bit for each control byte in the group that equals 'control'.
+uint32_t MatchControl(const uint8_t *group, uint8_t control)
+{
+#ifdef __SSE2__
+    __m128i controls = _mm_loadu_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(controls, _mm_set1_epi8((char)control)));
+#else
+    uint32_t matches = 0;
+    for (int i = 0; i < TABLE_GROUP_SIZE; i++)
+        matches |= (uint32_t)(group[i] == control) << i;
+    return matches;
+#endif
+}
+
+/// @return a bit for each slot in the group that is empty or deleted.
+uint32_t MatchFree(const uint8_t *group)
+{
+#ifdef __SSE2__
+    // Only those have the high bit set.
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+    uint32_t matches = 0;
+    for (int i = 0; i < TABLE_GROUP_SIZE; i++)
+        matches |= (uint32_t)(group[i] >> 7) << i;
+    return matches;
+#endif
+}
+
+/// @brief Probes the groups from the one the key's hash picks, skipping ahead by one more group
+///        each time, which visits every group of a power-of-two table.
+/// @return the slot of 'key', or NOT_FOUND.
+size_t FindSlot(HashTable *table, ObjString *key)
+{
+    size_t mask = table->capacity - 1;
+    size_t base = (HASH_GROUP(key->hash) * TABLE_GROUP_SIZE) & mask;
+    uint8_t control = HASH_CONTROL(key->hash);
+    for (size_t stride = TABLE_GROUP_SIZE;; stride += TABLE_GROUP_SIZE)
+    {
+        const uint8_t *group = table->controls + base;
+        for (uint32_t matches = MatchControl(group, control); matches != 0; matches &= matches - 1)
         {
-            // We found it.
-            return entry->key;
+            size_t index = base + __builtin_ctz(matches);
+            if (table->entries[index].key == key)
+                return index;
         }
+        if (MatchControl(group, CONTROL_EMPTY) != 0)
+            return NOT_FOUND;
+        base = (base + stride) & mask;
+    }
+}
+
+/// @return the first empty or deleted slot on the probe sequence of 'hash'. The load limit
+///         guarantees there is one.
+size_t FindFreeSlot(HashTable *table, uint32_t hash)
+{
+    size_t mask = table->capacity - 1;
+    size_t base = (HASH_GROUP(hash) * TABLE_GROUP_SIZE) & mask;
+    for (size_t stride = TABLE_GROUP_SIZE;; stride += TABLE_GROUP_SIZE)
+    {
+        uint32_t free_slots = MatchFree(table->controls + base);
+        if (free_slots != 0)
+            return base + __builtin_ctz(free_slots);
+        base = (base + stride) & mask;
+    }
+}
+
+/// @return the smallest capacity that leaves 'count' entries at most half full.
+size_t CapacityFor(size_t count)
+{
+    size_t capacity = TABLE_GROUP_SIZE;
+    while (capacity < count * 2)
+        capacity *= 2;
+    return capacity;
+}
+
+/// @brief Moves the live entries into fresh arrays of 'capacity' slots, dropping the tombstones.
+void Resize(VM *vm, HashTable *table, size_t capacity)
+{
+    Entry *entries = (Entry *)ALLOCATE(vm, char, TABLE_SIZE(capacity));
+    uint8_t *controls = (uint8_t *)(entries + capacity);
+    // Only the keys of free slots are ever looked at.
+    memset(entries, 0, sizeof(Entry) * capacity);
+    memset(controls, CONTROL_EMPTY, capacity);
 
-        index = (index + 1) % table->capacity;
+    Entry *old_entries = table->entries;
+    size_t old_capacity = table->capacity;
+    table->controls = controls;
+    table->entries = entries;
+    table->capacity = capacity;
+    table->deleted = 0;
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        ObjString *key = old_entries[i].key;
+        if (key == NULL)
+            continue;
+
+        size_t index = FindFreeSlot(table, key->hash);
+        controls[index] = HASH_CONTROL(key->hash);
+        entries[index] = old_entries[i];
     }
+
+    FREE_ARRAY(vm, char, old_entries, TABLE_SIZE(old_capacity));
 }
@@ -5,13 +5,22 @@
 #include "compiler/compiler.h"
 #include "compiler/scanner.h"
 #include "core/object.h"
+#include "vm/vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "core/debug.h"
 #endif
 
+typedef struct Compiler Compiler;
+
+// The state of one compilation. Everything the compiler needs is reached through it, so any
+// number of scripts can be compiled at once.
 typedef struct
 {
+    VM *vm;
+    Scanner scanner;
+    // The compiler of the innermost function being compiled.
+    Compiler *compiler;
     Token current;
     Token previous;
     bool had_error;
@@ -33,7 +42,7 @@ typedef enum
     PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(bool can_assign);
+typedef void (*ParseFn)(Parser *parser, bool can_assign);
 
 typedef struct
 {
@@ -54,7 +63,9 @@ typedef enum
     TYPE_SCRIPT
 } FunctionType;
 
-typedef struct Compiler Compiler;
+// The number of recently emitted instructions remembered for superinstruction fusion.
+#define RECENT_MAX 4
+
 struct Compiler
 {
     Compiler *enclosing;
@@ -63,364 +74,380 @@ struct Compiler
     Local locals[UINT8_COUNT];
     int local_count;
     int scope_depth;
+    // Offsets of the most recently emitted instructions, oldest first.
+    int recent[RECENT_MAX];
+    int recent_count;
+    // Operand bytes left to emit for the instruction at the end of 'recent'.
+    int pending_operands;
+    // Offset of the last instruction that is the target of a jump.
+    // Instructions are never fused across it.
+    int last_jump_target;
 };
 
-Parser parser;
-Compiler *current = NULL;
-Chunk *compiling_chunk;
-
-static void Advance();
-static void Consume(TokenType type, const char *message);
-static void EmitByte(uint8_t byte);
-static void EmitReturn();
-static void EmitBytes(uint8_t byte1, uint8_t byte2);
-static void EmitConstant(Value value);
-static int EmitJump(uint8_t instruction);
-static void PatchJump(int offset);
-static void EmitLoop(int loop_start);
-static uint8_t MakeConstant(Value value);
-static Chunk *CurrentChunk();
-static ObjFunction *EndCompiler();
-static bool Match(TokenType type);
-static bool Check(TokenType type);
-static void AddLocal(Token name);
-static void MarkInitialized();
-
-static void ParsePrecedence(Precedence precedence);
+static void Advance(Parser *parser);
+static void Consume(Parser *parser, TokenType type, const char *message);
+static void EmitByte(Parser *parser, uint8_t byte);
+static void EmitReturn(Parser *parser);
+static void EmitBytes(Parser *parser, uint8_t byte1, uint8_t byte2);
+static void EmitConstant(Parser *parser, Value value);
+static void EmitGlobal(Parser *parser, uint8_t instruction, uint16_t slot);
+static int EmitJump(Parser *parser, uint8_t instruction);
+static int EmitConditionalJump(Parser *parser);
+static int MarkJumpTarget(Parser *parser);
+static void FuseSuperinstructions(Parser *parser);
+static int RecentInstruction(Parser *parser, int distance);
+static void TruncateRecent(Parser *parser, int count);
+static void PatchJump(Parser *parser, int offset);
+static void EmitLoop(Parser *parser, int loop_start);
+static uint8_t MakeConstant(Parser *parser, Value value);
+static Chunk *CurrentChunk(Parser *parser);
+static ObjFunction *EndCompiler(Parser *parser);
+static bool Match(Parser *parser, TokenType type);
+static bool Check(Parser *parser, TokenType type);
+static void AddLocal(Parser *parser, Token name);
+static void MarkInitialized(Parser *parser);
+
+static void ParsePrecedence(Parser *parser, Precedence precedence);
 static ParseRule *GetRule(TokenType type);
-static uint8_t ParseVariable(const char *err_msg);
-static void DeclareVariable();
-static void DefineVariable(uint8_t global);
-static void NamedVariable(Token name, bool can_assign);
-static void BeginScope();
-static void EndScope();
-static void Function(FunctionType type);
-static uint8_t ArgumentList();
-
-static void Declaration();
-static void VariableDeclaration();
-static void FunctionDeclaration();
-
-static void Statement();
-static void PrintStatement();
-static void ExpressionStatement();
-static void Block();
-static void IfStatement();
-static void WhileStatement();
-static void ForStatement();
-static void ReturnStatement();
-
-static void Expression();
-
-static void Number(bool can_assign);
-static void Grouping(bool can_assign);
-static void Unary(bool can_assign);
-static void Binary(bool can_assign);
-static void Literal(bool can_assign);
-static void String(bool can_assign);
-static void VariableReference(bool can_assign);
-static void And_(bool can_assign);
-static void Or_(bool can_assign);
-static void Call(bool can_assign);
-
-static void Synchronize();
-static void ErrorAtCurrent(const char *message);
-static void ErrorAt(Token *token, const char *message);
-static void Error(const char *message);
-
-static void InitCompiler(Compiler *compiler, FunctionType type)
-{
-    compiler->enclosing = current;
+static uint16_t ParseVariable(Parser *parser, const char *err_msg);
+static void DeclareVariable(Parser *parser);
+static void DefineVariable(Parser *parser, uint16_t global);
+static void NamedVariable(Parser *parser, Token name, bool can_assign);
+static void BeginScope(Parser *parser);
+static void EndScope(Parser *parser);
+static void Function(Parser *parser, FunctionType type);
+static uint8_t ArgumentList(Parser *parser);
+
+static void Declaration(Parser *parser);
+static void VariableDeclaration(Parser *parser);
+static void FunctionDeclaration(Parser *parser);
+
+static void Statement(Parser *parser);
+static void PrintStatement(Parser *parser);
+static void ExpressionStatement(Parser *parser);
+static void Block(Parser *parser);
+static void IfStatement(Parser *parser);
+static void WhileStatement(Parser *parser);
+static void ForStatement(Parser *parser);
+static void ReturnStatement(Parser *parser);
+
+static void Expression(Parser *parser);
+
+static void Number(Parser *parser, bool can_assign);
+static void Grouping(Parser *parser, bool can_assign);
+static void Unary(Parser *parser, bool can_assign);
+static void Binary(Parser *parser, bool can_assign);
+static void Literal(Parser *parser, bool can_assign);
+static void String(Parser *parser, bool can_assign);
+static void VariableReference(Parser *parser, bool can_assign);
+static void And_(Parser *parser, bool can_assign);
+static void Or_(Parser *parser, bool can_assign);
+static void Call(Parser *parser, bool can_assign);
+
+static void Synchronize(Parser *parser);
+static void ErrorAtCurrent(Parser *parser, const char *message);
+static void ErrorAt(Parser *parser, Token *token, const char *message);
+static void Error(Parser *parser, const char *message);
+
+static void InitCompiler(Parser *parser, Compiler *compiler, FunctionType type)
+{
+    compiler->enclosing = parser->compiler;
     compiler->function = NULL;
     compiler->type = type;
     compiler->local_count = 0;
     compiler->scope_depth = 0;
-    compiler->function = lox_CreateFunction();
-    current = compiler;
+    compiler->recent_count = 0;
+    compiler->pending_operands = 0;
+    compiler->last_jump_target = 0;
+    compiler->function = lox_CreateFunction(parser->vm);
+    parser->compiler = compiler;
 
     if (type != TYPE_SCRIPT)
     {
-        current->function->name = lox_CopyString(parser.previous.start, parser.previous.length);
+        parser->compiler->function->name = lox_CopyString(parser->vm, parser->previous.start, parser->previous.length);
     }
 
-    Local *local = &current->locals[current->local_count++];
+    Local *local = &parser->compiler->locals[parser->compiler->local_count++];
     local->depth = 0;
     local->name.start = "";
     local->name.length = 0;
 }
 
-ObjFunction *lox_Compile(const char *source)
+/// @brief Compiles 'source' to the function of the top-level script.
+/// @param vm owns the objects created while compiling.
+/// @param source code.
+/// @return the script function, or NULL if there were compile errors.
+ObjFunction *lox_Compile(VM *vm, const char *source)
 {
-    lox_InitScanner(source);
+    Parser parser;
+    parser.vm = vm;
+    parser.compiler = NULL;
+    lox_InitScanner(&parser.scanner, source);
 
     Compiler compiler;
-    InitCompiler(&compiler, TYPE_SCRIPT);
+    InitCompiler(&parser, &compiler, TYPE_SCRIPT);
 
     parser.panic_mode = false;
     parser.had_error = false;
 
-    Advance();
-    while (!Match(TOKEN_EOF))
+    Advance(&parser);
+    while (!Match(&parser, TOKEN_EOF))
     {
-        Declaration();
+        Declaration(&parser);
     }
-    ObjFunction *function = EndCompiler();
+    ObjFunction *function = EndCompiler(&parser);
     return parser.had_error ? NULL : function;
 }
 
-void ParsePrecedence(Precedence precedence)
+void ParsePrecedence(Parser *parser, Precedence precedence)
 {
-    Advance();
-    ParseFn prefix_rule = GetRule(parser.previous.type)->prefix;
+    Advance(parser);
+    ParseFn prefix_rule = GetRule(parser->previous.type)->prefix;
     if (prefix_rule == NULL)
     {
-        Error("Expect expression.");
+        Error(parser, "Expect expression.");
         return;
     }
 
     bool can_assign = precedence <= PREC_ASSIGNMENT;
-    prefix_rule(can_assign);
+    prefix_rule(parser, can_assign);
 
-    while (precedence <= GetRule(parser.current.type)->precedence)
+    while (precedence <= GetRule(parser->current.type)->precedence)
     {
-        Advance();
-        ParseFn infix_rule = GetRule(parser.previous.type)->infix;
-        infix_rule(can_assign);
+        Advance(parser);
+        ParseFn infix_rule = GetRule(parser->previous.type)->infix;
+        infix_rule(parser, can_assign);
     }
 
-    if (can_assign && Match(TOKEN_EQUAL))
+    if (can_assign && Match(parser, TOKEN_EQUAL))
     {
-        Error("Invalid assignment target.");
+        Error(parser, "Invalid assignment target.");
     }
 }
 
-void Declaration()
+void Declaration(Parser *parser)
 {
-    if (Match(TOKEN_VAR))
+    if (Match(parser, TOKEN_VAR))
     {
-        VariableDeclaration();
+        VariableDeclaration(parser);
     }
-    else if (Match(TOKEN_FUN))
+    else if (Match(parser, TOKEN_FUN))
     {
-        FunctionDeclaration();
+        FunctionDeclaration(parser);
     }
     else
     {
-        Statement();
+        Statement(parser);
     }
 
-    if (parser.panic_mode)
-        Synchronize();
+    if (parser->panic_mode)
+        Synchronize(parser);
 }
 
-void VariableDeclaration()
+void VariableDeclaration(Parser *parser)
 {
-    uint8_t global = ParseVariable("Expect variable name.");
+    uint16_t global = ParseVariable(parser, "Expect variable name.");
 
-    if (Match(TOKEN_EQUAL))
+    if (Match(parser, TOKEN_EQUAL))
     {
-        Expression();
+        Expression(parser);
     }
     else
     {
-        EmitByte(OP_NIL);
+        EmitByte(parser, OP_NIL);
     }
 
-    Consume(TOKEN_SEMICOLON,
+    Consume(parser, TOKEN_SEMICOLON,
             "Expect ';' after variable declaration.");
 
-    DefineVariable(global);
+    DefineVariable(parser, global);
 }
 
-void FunctionDeclaration()
+void FunctionDeclaration(Parser *parser)
 {
-    uint8_t global = ParseVariable("Expect function name.");
-    MarkInitialized();
-    Function(TYPE_FUNCTION);
-    DefineVariable(global);
+    uint16_t global = ParseVariable(parser, "Expect function name.");
+    MarkInitialized(parser);
+    Function(parser, TYPE_FUNCTION);
+    DefineVariable(parser, global);
 }
 
-void Statement()
+void Statement(Parser *parser)
 {
-    if (Match(TOKEN_PRINT))
+    if (Match(parser, TOKEN_PRINT))
     {
-        PrintStatement();
+        PrintStatement(parser);
     }
-    else if (Match(TOKEN_LEFT_BRACE))
+    else if (Match(parser, TOKEN_LEFT_BRACE))
     {
-        BeginScope();
-        Block();
-        EndScope();
+        BeginScope(parser);
+        Block(parser);
+        EndScope(parser);
     }
-    else if (Match(TOKEN_IF))
+    else if (Match(parser, TOKEN_IF))
     {
-        IfStatement();
+        IfStatement(parser);
     }
-    else if (Match(TOKEN_WHILE))
+    else if (Match(parser, TOKEN_WHILE))
     {
-        WhileStatement();
+        WhileStatement(parser);
     }
-    else if (Match(TOKEN_FOR))
+    else if (Match(parser, TOKEN_FOR))
     {
-        ForStatement();
+        ForStatement(parser);
     }
-    else if (Match(TOKEN_RETURN))
+    else if (Match(parser, TOKEN_RETURN))
     {
-        ReturnStatement();
+        ReturnStatement(parser);
     }
     else
     {
-        ExpressionStatement();
+        ExpressionStatement(parser);
     }
 }
 
-void PrintStatement()
+void PrintStatement(Parser *parser)
 {
-    Expression();
-    Consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-    EmitByte(OP_PRINT);
+    Expression(parser);
+    Consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+    EmitByte(parser, OP_PRINT);
 }
 
-void ExpressionStatement()
+void ExpressionStatement(Parser *parser)
 {
-    Expression();
-    Consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    EmitByte(OP_POP);
+    Expression(parser);
+    Consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+    EmitByte(parser, OP_POP);
 }
 
-void Block()
+void Block(Parser *parser)
 {
-    while (!Check(TOKEN_RIGHT_BRACE) && !Check(TOKEN_EOF))
+    while (!Check(parser, TOKEN_RIGHT_BRACE) && !Check(parser, TOKEN_EOF))
     {
-        Declaration();
+        Declaration(parser);
     }
 
-    Consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+    Consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-void IfStatement()
+void IfStatement(Parser *parser)
 {
     // When compiling an if-statement, we will place an OP_JUMP_IF_FALSE at the beginning of the
     // then-statements, so that the then-statement is skipped if the condition evaluates to false.
     // We will also place an OP_JUMP instruction at the end of the then-statement
     // that skips the else-statement if the condition evaluates to true.
 
-    Consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-    Expression();
-    Consume(TOKEN_RIGHT_PAREN, "Expect ')' after 'if'-condition.");
+    Consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    Expression(parser);
+    Consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after 'if'-condition.");
 
     // Use backpatching to hold a temporary offset until we've compiled the
     // then-statement.
-    int then_jump = EmitJump(OP_JUMP_IF_FALSE);
-
     // Right after OP_JUMP_IF_FALSE, we add OP_POP to pop the condition if it evaluated to true.
     // Note: OP_POP will only be executed here if the condition evaluates to true because it follows the
     //       OP_JUMP_IF_FALSE instruction.
-    EmitByte(OP_POP);
+    int then_jump = EmitConditionalJump(parser);
 
-    Statement();
+    Statement(parser);
 
     // After compiling the then-statement, we need to prepare an else-jump regardless of whether
     // the user wrote an else-clause. This is to prevent the VM from executing the else-clause after the
     // then-clause if the condition is true.
-    int else_jump = EmitJump(OP_JUMP);
-
-    // Right after OP_JUMP, we also add OP_POP to pop the condition if it evaluated to false.
-    EmitByte(OP_POP);
+    int else_jump = EmitJump(parser, OP_JUMP);
 
     // When the then-statement is compiled, we patch it with the now-known offset.
-    PatchJump(then_jump);
+    PatchJump(parser, then_jump);
+
+    // The false-path lands right after OP_JUMP, where we add OP_POP to pop the condition.
+    EmitByte(parser, OP_POP);
 
-    if (Match(TOKEN_ELSE))
+    if (Match(parser, TOKEN_ELSE))
     {
-        Statement();
+        Statement(parser);
     }
 
-    PatchJump(else_jump);
+    PatchJump(parser, else_jump);
 }
 
-void WhileStatement()
+void WhileStatement(Parser *parser)
 {
     // Fetch the offset of the while-instruction so we can loop.
-    int loop_start = CurrentChunk()->count;
-    Consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-    Expression();
-    Consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    int loop_start = MarkJumpTarget(parser);
+    Consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    Expression(parser);
+    Consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exit_jump = EmitJump(OP_JUMP_IF_FALSE);
     // If the condition evaluates to true, we don't skip the body of the while-statement
     // and we have to emit OP_POP to clear the condition-value of the stack.
-    EmitByte(OP_POP);
+    int exit_jump = EmitConditionalJump(parser);
     // Then we parse the body of the while-statement.
-    Statement();
+    Statement(parser);
 
     // Then we emit a loop to return to the start of the while-instruction
     // and re-evaluate the condition.
-    EmitLoop(loop_start);
+    EmitLoop(parser, loop_start);
 
     // Backpatch exit_jump to point to the instruction following the body of the while-statement.
-    PatchJump(exit_jump);
+    PatchJump(parser, exit_jump);
     // The first instruction following the while-statement is OP_POP to clear the
     // condition-value from the stack.
-    EmitByte(OP_POP);
+    EmitByte(parser, OP_POP);
 }
 
-void ForStatement()
+void ForStatement(Parser *parser)
 {
     // Create a scope for the for-statement to ensure variables declared in it's initalized
     // is scoped to the for-statement.
-    BeginScope();
+    BeginScope(parser);
 
     // Initializer.
-    Consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-    if (Match(TOKEN_SEMICOLON))
+    Consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    if (Match(parser, TOKEN_SEMICOLON))
     {
         // No initializer.
     }
     // Both VariableDeclaration and ExpressionStatement will check for a semicolon
     // and maintain the stack themselves.
-    else if (Match(TOKEN_VAR))
+    else if (Match(parser, TOKEN_VAR))
     {
-        VariableDeclaration();
+        VariableDeclaration(parser);
     }
     else
     {
-        ExpressionStatement();
+        ExpressionStatement(parser);
     }
 
     // Condition. We mark the loop-start here.
-    int loop_start = CurrentChunk()->count;
+    int loop_start = MarkJumpTarget(parser);
     int exit_jump = -1;
-    if (!Match(TOKEN_SEMICOLON))
+    if (!Match(parser, TOKEN_SEMICOLON))
     {
-        Expression();
-        Consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+        Expression(parser);
+        Consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
         // If the condition evaluates to false, we jump out of the loop.
-        exit_jump = EmitJump(OP_JUMP_IF_FALSE);
         // If not, we pop the evaluated condition of the stack.
-        EmitByte(OP_POP);
+        exit_jump = EmitConditionalJump(parser);
     }
 
     // Incrementer.
     // Since the incrementer is parsed before the body, but needs to execute after the body,
     // we use a jump to first jump to the body, then jump back and execute the incrementer.
-    if (!Match(TOKEN_RIGHT_PAREN))
+    if (!Match(parser, TOKEN_RIGHT_PAREN))
     {
         // OP_JUMP to jump to body. Will be patched at the end of the incrementer, which is also
         // the start of the body.
-        int body_jump = EmitJump(OP_JUMP);
+        int body_jump = EmitJump(parser, OP_JUMP);
         // Mark the start of the incrementer so the body can jump back to it.
-        int incrementer_start = CurrentChunk()->count;
+        int incrementer_start = MarkJumpTarget(parser);
         // Then parse the incrementer expression.
-        Expression();
+        Expression(parser);
         // We must remember to pop the expressions value of the stack.
-        EmitByte(OP_POP);
+        EmitByte(parser, OP_POP);
         // Validate syntax is correct.
-        Consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+        Consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
         // Add OP_LOOP at end of incrementer body.
         // Note: This is also the end of the for-statement, so technically, this will be executed last.
-        EmitLoop(loop_start);
+        EmitLoop(parser, loop_start);
         // We set the loop_start to point to incrementer_start so that when the body
         // emits OP_LOOP, we return to the incrementer, not the top of the loop.
         // This is to achieve what was mentioned above:
@@ -429,156 +456,164 @@ void ForStatement()
         loop_start = incrementer_start;
 
         // Patch body_jump at end of incrementer/start of body.
-        PatchJump(body_jump);
+        PatchJump(parser, body_jump);
     }
 
     // Body.
-    Statement();
+    Statement(parser);
 
     // Emit OP_LOOP at end of body.
-    EmitLoop(loop_start);
+    EmitLoop(parser, loop_start);
 
     // After loop-body, we backpatch the exit_jump if a conditional is present
     // and emit OP_POP to clear the condition of the stack.
     if (exit_jump != -1)
     {
-        PatchJump(exit_jump);
-        EmitByte(OP_POP);
+        PatchJump(parser, exit_jump);
+        EmitByte(parser, OP_POP);
     }
 
-    EndScope();
+    EndScope(parser);
 }
 
-void ReturnStatement()
+void ReturnStatement(Parser *parser)
 {
-    if (current->type == TYPE_SCRIPT)
+    if (parser->compiler->type == TYPE_SCRIPT)
     {
-        Error("Can't return from top-level code.");
+        Error(parser, "Can't return from top-level code.");
     }
 
-    if (Match(TOKEN_SEMICOLON))
+    if (Match(parser, TOKEN_SEMICOLON))
     {
-        EmitReturn();
+        EmitReturn(parser);
     }
     else
     {
-        Expression();
-        Consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-        EmitByte(OP_RETURN);
+        Expression(parser);
+        Consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+        // The call is in tail position if nothing runs between it and the return,
+        // not even as the target of a jump(like in 'return a and f();').
+        int call = RecentInstruction(parser, 0);
+        if (call != -1 && CurrentChunk(parser)->code[call] == OP_CALL)
+        {
+            CurrentChunk(parser)->code[call] = OP_TAIL_CALL;
+        }
+        EmitByte(parser, OP_RETURN);
     }
 }
 
-void Expression()
+void Expression(Parser *parser)
 {
-    ParsePrecedence(PREC_ASSIGNMENT);
+    ParsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
-void Number(bool can_assign)
+void Number(Parser *parser, bool can_assign)
 {
-    double value = strtod(parser.previous.start, NULL);
-    EmitConstant(NUMBER_VAL(value));
+    double value = strtod(parser->previous.start, NULL);
+    EmitConstant(parser, NUMBER_VAL(value));
 }
 
-void Grouping(bool can_assign)
+void Grouping(Parser *parser, bool can_assign)
 {
-    Expression();
-    Consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+    Expression(parser);
+    Consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-void Unary(bool can_assign)
+void Unary(Parser *parser, bool can_assign)
 {
-    TokenType operator_type = parser.previous.type;
+    TokenType operator_type = parser->previous.type;
 
     // Compile the operand.
-    ParsePrecedence(PREC_UNARY);
+    ParsePrecedence(parser, PREC_UNARY);
 
     // Emit the operator instruction.
     switch (operator_type)
     {
     case TOKEN_MINUS:
-        EmitByte(OP_NEGATE);
+        EmitByte(parser, OP_NEGATE);
         break;
     case TOKEN_BANG:
-        EmitByte(OP_NOT);
+        EmitByte(parser, OP_NOT);
         break;
     default:
         return; // Unreachable.
     }
 }
 
-void Binary(bool can_assign)
+void Binary(Parser *parser, bool can_assign)
 {
-    TokenType operator_type = parser.previous.type;
+    TokenType operator_type = parser->previous.type;
     ParseRule *rule = GetRule(operator_type);
-    ParsePrecedence((Precedence)(rule->precedence + 1));
+    ParsePrecedence(parser, (Precedence)(rule->precedence + 1));
 
     switch (operator_type)
     {
     case TOKEN_PLUS:
-        EmitByte(OP_ADD);
+        EmitByte(parser, OP_ADD);
         break;
     case TOKEN_MINUS:
-        EmitByte(OP_SUBTRACT);
+        EmitByte(parser, OP_SUBTRACT);
         break;
     case TOKEN_STAR:
-        EmitByte(OP_MULTIPLY);
+        EmitByte(parser, OP_MULTIPLY);
         break;
     case TOKEN_SLASH:
-        EmitByte(OP_DIVIDE);
+        EmitByte(parser, OP_DIVIDE);
         break;
     case TOKEN_BANG_EQUAL:
-        EmitBytes(OP_EQUAL, OP_NOT);
+        EmitBytes(parser, OP_EQUAL, OP_NOT);
         break;
     case TOKEN_EQUAL_EQUAL:
-        EmitByte(OP_EQUAL);
+        EmitByte(parser, OP_EQUAL);
         break;
     case TOKEN_GREATER:
-        EmitByte(OP_GREATER);
+        EmitByte(parser, OP_GREATER);
         break;
     case TOKEN_GREATER_EQUAL:
-        EmitBytes(OP_LESS, OP_NOT);
+        EmitBytes(parser, OP_LESS, OP_NOT);
         break;
     case TOKEN_LESS:
-        EmitByte(OP_LESS);
+        EmitByte(parser, OP_LESS);
         break;
     case TOKEN_LESS_EQUAL:
-        EmitBytes(OP_GREATER, OP_NOT);
+        EmitBytes(parser, OP_GREATER, OP_NOT);
         break;
     default:
         return; // Unreachable.
     }
 }
 
-void Literal(bool can_assign)
+void Literal(Parser *parser, bool can_assign)
 {
-    switch (parser.previous.type)
+    switch (parser->previous.type)
     {
     case TOKEN_FALSE:
-        EmitByte(OP_FALSE);
+        EmitByte(parser, OP_FALSE);
         break;
     case TOKEN_NIL:
-        EmitByte(OP_NIL);
+        EmitByte(parser, OP_NIL);
         break;
     case TOKEN_TRUE:
-        EmitByte(OP_TRUE);
+        EmitByte(parser, OP_TRUE);
         break;
     default:
         return; // Unreachable.
     }
 }
 
-void String(bool can_assign)
+void String(Parser *parser, bool can_assign)
 {
-    EmitConstant(OBJ_VAL(lox_CopyString(parser.previous.start + 1,
-                                        parser.previous.length - 2)));
+    EmitConstant(parser, OBJ_VAL(lox_CopyString(parser->vm, parser->previous.start + 1,
+                                        parser->previous.length - 2)));
 }
 
-void VariableReference(bool can_assign)
+void VariableReference(Parser *parser, bool can_assign)
 {
-    NamedVariable(parser.previous, can_assign);
+    NamedVariable(parser, parser->previous, can_assign);
 }
 
-void And_(bool can_assign)
+void And_(Parser *parser, bool can_assign)
 {
     // Left hand side of logical-and is already compiled here, and it's evaluated value will
     // be on top of the stack. We simply emit OP_JUMP_IF_FALSE.
@@ -586,199 +621,331 @@ void And_(bool can_assign)
     // so we skip the right-side leaving the evaluated value of the left-side on top of the stack.
     // If the evaluated value is true, we emit OP_POP to pop it off the stack, and we evaluate
     // the right-side.
-    int end_jump = EmitJump(OP_JUMP_IF_FALSE);
-    EmitByte(OP_POP);
-    ParsePrecedence(PREC_AND);
-    PatchJump(end_jump);
+    int end_jump = EmitConditionalJump(parser);
+    ParsePrecedence(parser, PREC_AND);
+    PatchJump(parser, end_jump);
 }
 
-void Or_(bool can_assign)
+void Or_(Parser *parser, bool can_assign)
 {
     // Left-hand side is already evaluated here. If it's value is true, we don't need to
     // evaluate the right-hand side, so we hit the OP_JUMP and skip the rest leaving the left-hand
     // side value on the stack. If it's false, we jump to the right-hand side, we hit the OP_POP to pop
     // the evaluated value of the left-hand side of the stack, and we evaluate the right-hand side
     // leaving it's value on top of the stack.
-    int else_jump = EmitJump(OP_JUMP_IF_FALSE);
-    int end_jump = EmitJump(OP_JUMP);
+    int else_jump = EmitJump(parser, OP_JUMP_IF_FALSE);
+    int end_jump = EmitJump(parser, OP_JUMP);
 
     // Backpatch else_jump so we jump here if the left-hand side is false, and the emit OP_POP
     // so the evaluated left-side value is popped of the stack.
-    PatchJump(else_jump);
-    EmitByte(OP_POP);
-    ParsePrecedence(PREC_OR);
+    PatchJump(parser, else_jump);
+    EmitByte(parser, OP_POP);
+    ParsePrecedence(parser, PREC_OR);
 
     // After the parsed right-hand side, we backpatch the end-jump so we offset the IP
     // by the correct amount if the left-hand side is evaluated to true.
     // We don't emit an OP_POP here, as either we reach this point with left-hand side being true,
     // in which case we wish to leave it's value on the stack, or we reach it after processing
     // the right-hand side, in which case we also want to leave it on the stack.
-    PatchJump(end_jump);
+    PatchJump(parser, end_jump);
 }
 
-void Call(bool can_assign)
+void Call(Parser *parser, bool can_assign)
 {
-    uint8_t arg_count = ArgumentList();
-    EmitBytes(OP_CALL, arg_count);
+    uint8_t arg_count = ArgumentList(parser);
+    EmitBytes(parser, OP_CALL, arg_count);
 }
 
-void Advance()
+void Advance(Parser *parser)
 {
-    parser.previous = parser.current;
+    parser->previous = parser->current;
 
     for (;;)
     {
-        parser.current = lox_ScanToken();
-        if (parser.current.type != TOKEN_ERROR)
+        parser->current = lox_ScanToken(&parser->scanner);
+        if (parser->current.type != TOKEN_ERROR)
         {
             break;
         }
 
-        ErrorAtCurrent(parser.current.start);
+        ErrorAtCurrent(parser, parser->current.start);
     }
 }
 
-void Consume(TokenType type, const char *message)
+void Consume(Parser *parser, TokenType type, const char *message)
 {
-    if (parser.current.type == type)
+    if (parser->current.type == type)
     {
-        Advance();
+        Advance(parser);
         return;
     }
 
-    ErrorAtCurrent(message);
+    ErrorAtCurrent(parser, message);
 }
 
-void EmitByte(uint8_t byte)
+void EmitByte(Parser *parser, uint8_t byte)
 {
-    lox_WriteChunk(CurrentChunk(), byte, parser.previous.line);
+    lox_WriteChunk(parser->vm, CurrentChunk(parser), byte, parser->previous.line);
+
+    // Keep track of where instructions start, so sequences can be fused once they're complete.
+    if (parser->compiler->pending_operands > 0)
+    {
+        parser->compiler->pending_operands--;
+    }
+    else
+    {
+        if (parser->compiler->recent_count == RECENT_MAX)
+        {
+            memmove(parser->compiler->recent, parser->compiler->recent + 1, sizeof(int) * (RECENT_MAX - 1));
+            parser->compiler->recent_count--;
+        }
+        parser->compiler->recent[parser->compiler->recent_count++] = CurrentChunk(parser)->count - 1;
+        parser->compiler->pending_operands = lox_InstructionLength(byte) - 1;
+    }
+
+    if (parser->compiler->pending_operands == 0)
+        FuseSuperinstructions(parser);
 }
 
-void EmitReturn()
+void EmitReturn(Parser *parser)
 {
-    EmitByte(OP_NIL);
-    EmitByte(OP_RETURN);
+    EmitByte(parser, OP_NIL);
+    EmitByte(parser, OP_RETURN);
 }
 
-void EmitBytes(uint8_t byte1, uint8_t byte2)
+void EmitBytes(Parser *parser, uint8_t byte1, uint8_t byte2)
 {
-    EmitByte(byte1);
-    EmitByte(byte2);
+    EmitByte(parser, byte1);
+    EmitByte(parser, byte2);
 }
 
-void EmitConstant(Value value)
+void EmitConstant(Parser *parser, Value value)
 {
-    EmitBytes(OP_CONSTANT, MakeConstant(value));
+    EmitBytes(parser, OP_CONSTANT, MakeConstant(parser, value));
 }
 
-int EmitJump(uint8_t instruction)
+void EmitGlobal(Parser *parser, uint8_t instruction, uint16_t slot)
 {
-    EmitByte(instruction);
+    EmitByte(parser, instruction);
+    EmitByte(parser, (slot >> 8) & 0xFF);
+    EmitByte(parser, slot & 0xFF);
+}
+
+int EmitJump(Parser *parser, uint8_t instruction)
+{
+    EmitByte(parser, instruction);
     // Temporary offset-placeholder.
-    EmitByte(0xFF);
-    EmitByte(0xFF);
+    EmitByte(parser, 0xFF);
+    EmitByte(parser, 0xFF);
     // Return the offset of the jump-instruction.
-    return CurrentChunk()->count - 2;
+    return CurrentChunk(parser)->count - 2;
+}
+
+/// @brief Emits OP_JUMP_IF_FALSE followed by OP_POP to pop the condition when the jump isn't taken.
+///        A preceding OP_LESS is fused into OP_LESS_JUMP_IF_FALSE.
+/// @return the offset of the jump's operand, to be patched.
+int EmitConditionalJump(Parser *parser)
+{
+    int less = RecentInstruction(parser, 0);
+    if (less != -1 && CurrentChunk(parser)->code[less] == OP_LESS)
+    {
+        // Drop OP_LESS and let the fused instruction do the comparison, jump and pop.
+        TruncateRecent(parser, 1);
+        return EmitJump(parser, OP_LESS_JUMP_IF_FALSE);
+    }
+
+    int jump = EmitJump(parser, OP_JUMP_IF_FALSE);
+    EmitByte(parser, OP_POP);
+    return jump;
+}
+
+/// @brief Replaces sequences of recently emitted instructions by a single superinstruction.
+///        Called every time an instruction is complete. The fused sequences were picked from
+///        the n-gram profiles recorded with DEBUG_PROFILE_NGRAMS.
+void FuseSuperinstructions(Parser *parser)
+{
+    Chunk *chunk = CurrentChunk(parser);
+    int last = RecentInstruction(parser, 0);
+    if (last == -1)
+        return;
+
+    switch (chunk->code[last])
+    {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    {
+        // OP_GET_LOCAL a; OP_CONSTANT k  -> OP_GET_LOCAL_CONSTANT a k
+        // OP_GET_LOCAL a; OP_GET_LOCAL b -> OP_GET_LOCAL_LOCAL a b
+        int first = RecentInstruction(parser, 1);
+        if (first == -1 || chunk->code[first] != OP_GET_LOCAL)
+            return;
+
+        uint8_t fused = chunk->code[last] == OP_CONSTANT ? OP_GET_LOCAL_CONSTANT : OP_GET_LOCAL_LOCAL;
+        uint8_t a = chunk->code[first + 1];
+        uint8_t b = chunk->code[last + 1];
+        TruncateRecent(parser, 2);
+        EmitBytes(parser, fused, a);
+        EmitByte(parser, b);
+        return;
+    }
+    case OP_POP:
+    {
+        // OP_GET_LOCAL_CONSTANT a k; OP_ADD; OP_SET_LOCAL a; OP_POP -> OP_INCREMENT_LOCAL a k
+        // This is what 'a = a + k;' compiles to.
+        int first = RecentInstruction(parser, 3);
+        if (first == -1 || chunk->code[first] != OP_GET_LOCAL_CONSTANT)
+            return;
+
+        int add = RecentInstruction(parser, 2);
+        int set = RecentInstruction(parser, 1);
+        if (chunk->code[add] != OP_ADD || chunk->code[set] != OP_SET_LOCAL ||
+            chunk->code[set + 1] != chunk->code[first + 1])
+            return;
+
+        uint8_t a = chunk->code[first + 1];
+        uint8_t k = chunk->code[first + 2];
+        TruncateRecent(parser, 4);
+        EmitBytes(parser, OP_INCREMENT_LOCAL, a);
+        EmitByte(parser, k);
+        return;
+    }
+    default:
+        return;
+    }
 }
 
-void PatchJump(int offset)
+/// @brief Finds a recently emitted instruction that can be fused with the instructions following it.
+/// @param distance from the newest instruction, which is 0.
+/// @return offset of the instruction, or -1 if it's no longer remembered or the sequence it starts
+///         contains a jump target.
+int RecentInstruction(Parser *parser, int distance)
 {
-    int jump = CurrentChunk()->count - offset - 2;
+    if (distance >= parser->compiler->recent_count)
+        return -1;
+
+    int offset = parser->compiler->recent[parser->compiler->recent_count - 1 - distance];
+    if (parser->compiler->last_jump_target > offset)
+        return -1;
+
+    return offset;
+}
+
+/// @brief Removes the 'count' newest instructions from the parser->compiler chunk.
+/// @param count of instructions to remove.
+void TruncateRecent(Parser *parser, int count)
+{
+    parser->compiler->recent_count -= count;
+    CurrentChunk(parser)->count = parser->compiler->recent[parser->compiler->recent_count];
+    parser->compiler->pending_operands = 0;
+}
+
+/// @brief Marks the next instruction as the target of a jump.
+/// @return offset of the next instruction.
+int MarkJumpTarget(Parser *parser)
+{
+    parser->compiler->last_jump_target = CurrentChunk(parser)->count;
+    return CurrentChunk(parser)->count;
+}
+
+void PatchJump(Parser *parser, int offset)
+{
+    int jump = CurrentChunk(parser)->count - offset - 2;
+    MarkJumpTarget(parser);
 
     if (jump > UINT16_MAX)
     {
-        Error("Max offset length of jump-instruction exceeded");
+        Error(parser, "Max offset length of jump-instruction exceeded");
     }
 
     // Sets the jump-offset so that it points to the instruction following the then-statement.
-    CurrentChunk()->code[offset] = (jump >> 8) & 0xFF;
-    CurrentChunk()->code[offset + 1] = jump & 0xFF;
+    CurrentChunk(parser)->code[offset] = (jump >> 8) & 0xFF;
+    CurrentChunk(parser)->code[offset + 1] = jump & 0xFF;
 }
 
-void EmitLoop(int loop_start)
+void EmitLoop(Parser *parser, int loop_start)
 {
-    EmitByte(OP_LOOP);
+    EmitByte(parser, OP_LOOP);
 
     // Calculate the offset to the start of the loop and add 2 to account for operands of OP_LOOP.
-    int offset = CurrentChunk()->count - loop_start + 2;
+    int offset = CurrentChunk(parser)->count - loop_start + 2;
     if (offset > UINT16_MAX)
     {
-        Error("Size of loop-body exceeds max range of OP_LOOP.");
+        Error(parser, "Size of loop-body exceeds max range of OP_LOOP.");
     }
 
     // Emit 16-bit offset value in two bytes.
-    EmitByte((offset >> 8) & 0xFF);
-    EmitByte(offset & 0xFF);
+    EmitByte(parser, (offset >> 8) & 0xFF);
+    EmitByte(parser, offset & 0xFF);
 }
 
-uint8_t MakeConstant(Value value)
+uint8_t MakeConstant(Parser *parser, Value value)
 {
-    int constant = lox_AddConstant(CurrentChunk(), value);
+    int constant = lox_AddConstant(parser->vm, CurrentChunk(parser), value);
     if (constant > UINT8_MAX)
     {
-        Error("Too many constants in one chunk.");
+        Error(parser, "Too many constants in one chunk.");
         return 0;
     }
 
     return (uint8_t)constant;
 }
 
-Chunk *CurrentChunk()
+Chunk *CurrentChunk(Parser *parser)
 {
-    return &current->function->chunk;
+    return &parser->compiler->function->chunk;
 }
 
-ObjFunction *EndCompiler()
+ObjFunction *EndCompiler(Parser *parser)
 {
-    EmitReturn();
+    EmitReturn(parser);
 
-    ObjFunction *function = current->function;
+    ObjFunction *function = parser->compiler->function;
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.had_error)
+    if (!parser->had_error)
     {
-        lox_DisassembleChunk(CurrentChunk(), function->name != NULL ? function->name->chars : "<script>");
+        lox_DisassembleChunk(parser->vm, CurrentChunk(parser), function->name != NULL ? function->name->chars : "<script>");
     }
 #endif
 
-    current = current->enclosing;
+    parser->compiler = parser->compiler->enclosing;
     return function;
 }
 
-bool Match(TokenType type)
+bool Match(Parser *parser, TokenType type)
 {
-    if (!Check(type))
+    if (!Check(parser, type))
         return false;
-    Advance();
+    Advance(parser);
     return true;
 }
 
-bool Check(TokenType type)
+bool Check(Parser *parser, TokenType type)
 {
-    return parser.current.type == type;
+    return parser->current.type == type;
 }
 
-void AddLocal(Token name)
+void AddLocal(Parser *parser, Token name)
 {
-    if (current->local_count == UINT8_COUNT)
+    if (parser->compiler->local_count == UINT8_COUNT)
     {
-        Error("Too many local variables in function.");
+        Error(parser, "Too many local variables in function.");
         return;
     }
 
-    Local *local = &current->locals[current->local_count++];
+    Local *local = &parser->compiler->locals[parser->compiler->local_count++];
     local->name = name;
     local->depth = -1;
 }
 
-void Synchronize()
+void Synchronize(Parser *parser)
 {
-    parser.panic_mode = false;
+    parser->panic_mode = false;
 
-    while (parser.current.type != TOKEN_EOF)
+    while (parser->current.type != TOKEN_EOF)
     {
-        if (parser.previous.type == TOKEN_SEMICOLON)
+        if (parser->previous.type == TOKEN_SEMICOLON)
             return;
-        switch (parser.current.type)
+        switch (parser->current.type)
         {
         case TOKEN_CLASS:
         case TOKEN_FUN:
@@ -793,20 +960,20 @@ void Synchronize()
         default:; // Do nothing.
         }
 
-        Advance();
+        Advance(parser);
     }
 }
 
-void ErrorAtCurrent(const char *message)
+void ErrorAtCurrent(Parser *parser, const char *message)
 {
-    ErrorAt(&parser.current, message);
+    ErrorAt(parser, &parser->current, message);
 }
 
-void ErrorAt(Token *token, const char *message)
+void ErrorAt(Parser *parser, Token *token, const char *message)
 {
-    if (parser.panic_mode)
+    if (parser->panic_mode)
         return;
-    parser.panic_mode = true;
+    parser->panic_mode = true;
 
     fprintf(stderr, "[line %d] Error", token->line);
 
@@ -824,12 +991,12 @@ void ErrorAt(Token *token, const char *message)
     }
 
     fprintf(stderr, ": %s\n", message);
-    parser.had_error = true;
+    parser->had_error = true;
 }
 
-void Error(const char *message)
+void Error(Parser *parser, const char *message)
 {
-    ErrorAt(&parser.previous, message);
+    ErrorAt(parser, &parser->previous, message);
 }
 
 ParseRule rules[] = {
@@ -880,9 +1047,16 @@ ParseRule *GetRule(TokenType type)
     return &rules[type];
 }
 
-static uint8_t IdentifierConstant(Token *name)
+static uint16_t GlobalSlot(Parser *parser, Token *name)
 {
-    return MakeConstant(OBJ_VAL(lox_CopyString(name->start, name->length)));
+    int slot = lox_ResolveGlobalSlot(parser->vm, lox_CopyString(parser->vm, name->start, name->length));
+    if (slot > UINT16_MAX)
+    {
+        Error(parser, "Too many global variables.");
+        return 0;
+    }
+
+    return (uint16_t)slot;
 }
 
 static bool IdentifiersEqual(Token *a, Token *b)
@@ -892,7 +1066,7 @@ static bool IdentifiersEqual(Token *a, Token *b)
     return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static int ResolveLocal(Compiler *compiler, Token *name)
+static int ResolveLocal(Parser *parser, Compiler *compiler, Token *name)
 {
     for (int i = compiler->local_count - 1; i >= 0; i--)
     {
@@ -901,7 +1075,7 @@ static int ResolveLocal(Compiler *compiler, Token *name)
         {
             if (local->depth == -1)
             {
-                Error("Can't read local variable in its own initializer.");
+                Error(parser, "Can't read local variable in its own initializer.");
             }
             return i;
         }
@@ -910,148 +1084,151 @@ static int ResolveLocal(Compiler *compiler, Token *name)
     return -1;
 }
 
-void MarkInitialized()
+void MarkInitialized(Parser *parser)
 {
-    if (current->scope_depth == 0)
+    if (parser->compiler->scope_depth == 0)
         return;
-    current->locals[current->local_count - 1].depth = current->scope_depth;
+    parser->compiler->locals[parser->compiler->local_count - 1].depth = parser->compiler->scope_depth;
 }
 
-uint8_t ParseVariable(const char *err_msg)
+uint16_t ParseVariable(Parser *parser, const char *err_msg)
 {
-    Consume(TOKEN_IDENTIFIER, err_msg);
+    Consume(parser, TOKEN_IDENTIFIER, err_msg);
 
-    DeclareVariable();
-    if (current->scope_depth > 0)
+    DeclareVariable(parser);
+    if (parser->compiler->scope_depth > 0)
         return 0;
 
-    return IdentifierConstant(&parser.previous);
+    return GlobalSlot(parser, &parser->previous);
 }
 
-void DeclareVariable()
+void DeclareVariable(Parser *parser)
 {
-    if (current->scope_depth == 0)
+    if (parser->compiler->scope_depth == 0)
         return;
 
-    Token *name = &parser.previous;
+    Token *name = &parser->previous;
 
-    for (int i = current->local_count - 1; i >= 0; i--)
+    for (int i = parser->compiler->local_count - 1; i >= 0; i--)
     {
-        Local *local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scope_depth)
+        Local *local = &parser->compiler->locals[i];
+        if (local->depth != -1 && local->depth < parser->compiler->scope_depth)
         {
             break;
         }
 
         if (IdentifiersEqual(name, &local->name))
         {
-            Error("Already a variable with this name in this scope.");
+            Error(parser, "Already a variable with this name in this scope.");
         }
     }
 
-    AddLocal(*name);
+    AddLocal(parser, *name);
 }
 
-void DefineVariable(uint8_t global)
+void DefineVariable(Parser *parser, uint16_t global)
 {
-    if (current->scope_depth > 0)
+    if (parser->compiler->scope_depth > 0)
     {
-        MarkInitialized();
+        MarkInitialized(parser);
         return;
     }
 
-    EmitBytes(OP_DEFINE_GLOBAL, global);
+    EmitGlobal(parser, OP_DEFINE_GLOBAL_SLOT, global);
 }
 
-void NamedVariable(Token name, bool can_assign)
+void NamedVariable(Parser *parser, Token name, bool can_assign)
 {
-    uint8_t get_op, set_op;
-    int arg = ResolveLocal(current, &name);
+    int arg = ResolveLocal(parser, parser->compiler, &name);
     if (arg != -1)
     {
-        get_op = OP_GET_LOCAL;
-        set_op = OP_SET_LOCAL;
-    }
-    else
-    {
-        arg = IdentifierConstant(&name);
-        get_op = OP_GET_GLOBAL;
-        set_op = OP_SET_GLOBAL;
+        if (can_assign && Match(parser, TOKEN_EQUAL))
+        {
+            Expression(parser);
+            EmitBytes(parser, OP_SET_LOCAL, (uint8_t)arg);
+        }
+        else
+        {
+            EmitBytes(parser, OP_GET_LOCAL, (uint8_t)arg);
+        }
+        return;
     }
 
-    if (can_assign && Match(TOKEN_EQUAL))
+    // Globals are resolved to a slot at compile-time, so the VM never has to look them up by name.
+    uint16_t slot = GlobalSlot(parser, &name);
+    if (can_assign && Match(parser, TOKEN_EQUAL))
     {
-        Expression();
-        EmitBytes(set_op, (uint8_t)arg);
+        Expression(parser);
+        EmitGlobal(parser, OP_SET_GLOBAL_SLOT, slot);
     }
     else
     {
-        EmitBytes(get_op, (uint8_t)arg);
+        EmitGlobal(parser, OP_GET_GLOBAL_SLOT, slot);
     }
 }
 
-void BeginScope()
+void BeginScope(Parser *parser)
 {
-    current->scope_depth++;
+    parser->compiler->scope_depth++;
 }
 
-void EndScope()
+void EndScope(Parser *parser)
 {
-    current->scope_depth--;
+    parser->compiler->scope_depth--;
 
     // Pop all locals on stack within ended scope.
-    while (current->local_count > 0 &&
-           current->locals[current->local_count - 1].depth >
-               current->scope_depth)
+    while (parser->compiler->local_count > 0 &&
+           parser->compiler->locals[parser->compiler->local_count - 1].depth >
+               parser->compiler->scope_depth)
     {
-        EmitByte(OP_POP);
-        current->local_count--;
+        EmitByte(parser, OP_POP);
+        parser->compiler->local_count--;
     }
 }
 
-void Function(FunctionType type)
+void Function(Parser *parser, FunctionType type)
 {
     Compiler compiler;
-    InitCompiler(&compiler, type);
-    BeginScope();
+    InitCompiler(parser, &compiler, type);
+    BeginScope(parser);
 
-    Consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
-    if (!Check(TOKEN_RIGHT_PAREN))
+    Consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (!Check(parser, TOKEN_RIGHT_PAREN))
     {
         do
         {
-            current->function->arity++;
-            if (current->function->arity > 255)
+            parser->compiler->function->arity++;
+            if (parser->compiler->function->arity > 255)
             {
-                ErrorAtCurrent("Can't have more than 255 parameters.");
+                ErrorAtCurrent(parser, "Can't have more than 255 parameters.");
             }
-            uint8_t constant = ParseVariable("Expect parameter name.");
-            DefineVariable(constant);
-        } while (Match(TOKEN_COMMA));
+            uint16_t constant = ParseVariable(parser, "Expect parameter name.");
+            DefineVariable(parser, constant);
+        } while (Match(parser, TOKEN_COMMA));
     }
-    Consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
-    Consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-    Block();
+    Consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    Consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    Block(parser);
 
-    ObjFunction *function = EndCompiler();
-    EmitBytes(OP_CLOSURE, MakeConstant(OBJ_VAL(function)));
+    ObjFunction *function = EndCompiler(parser);
+    EmitBytes(parser, OP_CLOSURE, MakeConstant(parser, OBJ_VAL(function)));
 }
 
-uint8_t ArgumentList()
+uint8_t ArgumentList(Parser *parser)
 {
     uint8_t arg_count = 0;
-    if (!Check(TOKEN_RIGHT_PAREN))
+    if (!Check(parser, TOKEN_RIGHT_PAREN))
     {
         do
         {
-            Expression();
+            Expression(parser);
             if (arg_count == 255)
             {
-                Error("Can't have more than 255 arguments.");
+                Error(parser, "Can't have more than 255 arguments.");
             }
             arg_count++;
-        } while (Match(TOKEN_COMMA));
+        } while (Match(parser, TOKEN_COMMA));
     }
-    Consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    Consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
     return arg_count;
 }
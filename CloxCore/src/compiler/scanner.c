@@ -4,160 +4,151 @@
 #include "compiler/scanner.h"
 #include "common/string_helper.h"
 
-typedef struct
+static bool IsAtEnd(Scanner *scanner);
+static Token MakeToken(Scanner *scanner, TokenType type);
+static Token ErrorToken(Scanner *scanner, const char *message);
+static char Advance(Scanner *scanner);
+static bool Match(Scanner *scanner, char expected);
+static void SkipWhitespace(Scanner *scanner);
+static char Peek(Scanner *scanner);
+static char PeekNext(Scanner *scanner);
+static Token String(Scanner *scanner);
+static Token Number(Scanner *scanner);
+static Token Identifier(Scanner *scanner);
+static TokenType IdentifierType(Scanner *scanner);
+static TokenType CheckKeyword(Scanner *scanner, int start, int length, const char *rest, TokenType type);
+
+void lox_InitScanner(Scanner *scanner, const char *source)
 {
-    const char *start;
-    const char *current;
-    int line;
-} Scanner;
-
-Scanner scanner;
-
-static bool IsAtEnd();
-static Token MakeToken(TokenType type);
-static Token ErrorToken(const char *message);
-static char Advance();
-static bool Match(char expected);
-static void SkipWhitespace();
-static char Peek();
-static char PeekNext();
-static Token String();
-static Token Number();
-static Token Identifier();
-static TokenType IdentifierType();
-static TokenType CheckKeyword(int start, int length, const char *rest, TokenType type);
-
-void lox_InitScanner(const char *source)
-{
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+    scanner->start = source;
+    scanner->current = source;
+    scanner->line = 1;
 }
 
-Token lox_ScanToken()
+Token lox_ScanToken(Scanner *scanner)
 {
-    SkipWhitespace();
-    scanner.start = scanner.current;
+    SkipWhitespace(scanner);
+    scanner->start = scanner->current;
 
-    if (IsAtEnd())
-        return MakeToken(TOKEN_EOF);
+    if (IsAtEnd(scanner))
+        return MakeToken(scanner, TOKEN_EOF);
 
-    char c = Advance();
+    char c = Advance(scanner);
 
     if (lox_IsDigit(c))
-        return Number();
+        return Number(scanner);
 
     if (lox_IsAlpha(c))
-        return Identifier();
+        return Identifier(scanner);
 
     switch (c)
     {
     case '(':
-        return MakeToken(TOKEN_LEFT_PAREN);
+        return MakeToken(scanner, TOKEN_LEFT_PAREN);
     case ')':
-        return MakeToken(TOKEN_RIGHT_PAREN);
+        return MakeToken(scanner, TOKEN_RIGHT_PAREN);
     case '{':
-        return MakeToken(TOKEN_LEFT_BRACE);
+        return MakeToken(scanner, TOKEN_LEFT_BRACE);
     case '}':
-        return MakeToken(TOKEN_RIGHT_BRACE);
+        return MakeToken(scanner, TOKEN_RIGHT_BRACE);
     case ';':
-        return MakeToken(TOKEN_SEMICOLON);
+        return MakeToken(scanner, TOKEN_SEMICOLON);
     case ',':
-        return MakeToken(TOKEN_COMMA);
+        return MakeToken(scanner, TOKEN_COMMA);
     case '.':
-        return MakeToken(TOKEN_DOT);
+        return MakeToken(scanner, TOKEN_DOT);
     case '-':
-        return MakeToken(TOKEN_MINUS);
+        return MakeToken(scanner, TOKEN_MINUS);
     case '+':
-        return MakeToken(TOKEN_PLUS);
+        return MakeToken(scanner, TOKEN_PLUS);
     case '/':
-        return MakeToken(TOKEN_SLASH);
+        return MakeToken(scanner, TOKEN_SLASH);
     case '*':
-        return MakeToken(TOKEN_STAR);
+        return MakeToken(scanner, TOKEN_STAR);
     case '!':
-        return MakeToken(
-            Match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+        return MakeToken(scanner,
+            Match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
     case '=':
-        return MakeToken(
-            Match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+        return MakeToken(scanner,
+            Match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
     case '<':
-        return MakeToken(
-            Match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+        return MakeToken(scanner,
+            Match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
     case '>':
-        return MakeToken(
-            Match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+        return MakeToken(scanner,
+            Match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
     case '"':
-        return String();
+        return String(scanner);
     }
 
-    return ErrorToken("Unexpected character.");
+    return ErrorToken(scanner, "Unexpected character.");
 }
 
-bool IsAtEnd()
+bool IsAtEnd(Scanner *scanner)
 {
-    return *scanner.current == '\0';
+    return *scanner->current == '\0';
 }
 
-Token MakeToken(TokenType type)
+Token MakeToken(Scanner *scanner, TokenType type)
 {
     Token token = {
         .type = type,
-        .start = scanner.start,
-        .length = (int)(scanner.current - scanner.start),
-        .line = scanner.line,
+        .start = scanner->start,
+        .length = (int)(scanner->current - scanner->start),
+        .line = scanner->line,
     };
     return token;
 }
 
-Token ErrorToken(const char *message)
+Token ErrorToken(Scanner *scanner, const char *message)
 {
     Token token = {
         .type = TOKEN_ERROR,
         .start = message,
         .length = (int)strlen(message),
-        .line = scanner.line,
+        .line = scanner->line,
     };
     return token;
 }
 
-char Advance()
+char Advance(Scanner *scanner)
 {
-    scanner.current++;
-    return scanner.current[-1];
+    scanner->current++;
+    return scanner->current[-1];
 }
 
-bool Match(char expected)
+bool Match(Scanner *scanner, char expected)
 {
-    if (IsAtEnd())
+    if (IsAtEnd(scanner))
         return false;
-    if (*scanner.current != expected)
+    if (*scanner->current != expected)
         return false;
-    scanner.current++;
+    scanner->current++;
     return true;
 }
 
-void SkipWhitespace()
+void SkipWhitespace(Scanner *scanner)
 {
     for (;;)
     {
-        char c = Peek();
+        char c = Peek(scanner);
         switch (c)
         {
         case ' ':
         case '\r':
         case '\t':
-            Advance();
+            Advance(scanner);
             break;
         case '\n':
-            scanner.line++;
-            Advance();
+            scanner->line++;
+            Advance(scanner);
             break;
         case '/':
-            if (PeekNext() == '/')
+            if (PeekNext(scanner) == '/')
             {
                 // A comment goes until the end of the line.
-                while (Peek() != '\n' && !IsAtEnd())
-                    Advance();
+                while (Peek(scanner) != '\n' && !IsAtEnd(scanner))
+                    Advance(scanner);
             }
             else
             {
@@ -170,121 +161,121 @@ void SkipWhitespace()
     }
 }
 
-char Peek()
+char Peek(Scanner *scanner)
 {
-    return *scanner.current;
+    return *scanner->current;
 }
 
-char PeekNext()
+char PeekNext(Scanner *scanner)
 {
-    if (IsAtEnd())
+    if (IsAtEnd(scanner))
         return '\0';
-    return scanner.current[1];
+    return scanner->current[1];
 }
 
-Token String()
+Token String(Scanner *scanner)
 {
-    while (Peek() != '"' && !IsAtEnd())
+    while (Peek(scanner) != '"' && !IsAtEnd(scanner))
     {
-        if (Peek() == '\n')
-            scanner.line++;
-        Advance();
+        if (Peek(scanner) == '\n')
+            scanner->line++;
+        Advance(scanner);
     }
 
-    if (IsAtEnd())
-        return ErrorToken("Unterminated string.");
+    if (IsAtEnd(scanner))
+        return ErrorToken(scanner, "Unterminated string.");
 
     // The closing quote.
-    Advance();
-    return MakeToken(TOKEN_STRING);
+    Advance(scanner);
+    return MakeToken(scanner, TOKEN_STRING);
 }
 
-Token Number()
+Token Number(Scanner *scanner)
 {
-    while (lox_IsDigit(Peek()))
-        Advance();
+    while (lox_IsDigit(Peek(scanner)))
+        Advance(scanner);
 
     // Look for a fractional part.
-    if (Peek() == '.' && lox_IsDigit(PeekNext()))
+    if (Peek(scanner) == '.' && lox_IsDigit(PeekNext(scanner)))
     {
         // Consume the ".".
-        Advance();
+        Advance(scanner);
 
-        while (lox_IsDigit(Peek()))
-            Advance();
+        while (lox_IsDigit(Peek(scanner)))
+            Advance(scanner);
     }
 
-    return MakeToken(TOKEN_NUMBER);
+    return MakeToken(scanner, TOKEN_NUMBER);
 }
 
-Token Identifier()
+Token Identifier(Scanner *scanner)
 {
-    while (lox_IsAlpha(Peek()) || lox_IsDigit(Peek()))
-        Advance();
-    return MakeToken(IdentifierType());
+    while (lox_IsAlpha(Peek(scanner)) || lox_IsDigit(Peek(scanner)))
+        Advance(scanner);
+    return MakeToken(scanner, IdentifierType(scanner));
 }
 
-TokenType IdentifierType()
+TokenType IdentifierType(Scanner *scanner)
 {
-    switch (scanner.start[0])
+    switch (scanner->start[0])
     {
     case 'a':
-        return CheckKeyword(1, 2, "nd", TOKEN_AND);
+        return CheckKeyword(scanner, 1, 2, "nd", TOKEN_AND);
     case 'c':
-        return CheckKeyword(1, 4, "lass", TOKEN_CLASS);
+        return CheckKeyword(scanner, 1, 4, "lass", TOKEN_CLASS);
     case 'e':
-        return CheckKeyword(1, 3, "lse", TOKEN_ELSE);
+        return CheckKeyword(scanner, 1, 3, "lse", TOKEN_ELSE);
     case 'f':
-        if (scanner.current - scanner.start > 1)
+        if (scanner->current - scanner->start > 1)
         {
-            switch (scanner.start[1])
+            switch (scanner->start[1])
             {
             case 'a':
-                return CheckKeyword(2, 3, "lse", TOKEN_FALSE);
+                return CheckKeyword(scanner, 2, 3, "lse", TOKEN_FALSE);
             case 'o':
-                return CheckKeyword(2, 1, "r", TOKEN_FOR);
+                return CheckKeyword(scanner, 2, 1, "r", TOKEN_FOR);
             case 'u':
-                return CheckKeyword(2, 1, "n", TOKEN_FUN);
+                return CheckKeyword(scanner, 2, 1, "n", TOKEN_FUN);
             }
         }
         break;
     case 'i':
-        return CheckKeyword(1, 1, "f", TOKEN_IF);
+        return CheckKeyword(scanner, 1, 1, "f", TOKEN_IF);
     case 'n':
-        return CheckKeyword(1, 2, "il", TOKEN_NIL);
+        return CheckKeyword(scanner, 1, 2, "il", TOKEN_NIL);
     case 'o':
-        return CheckKeyword(1, 1, "r", TOKEN_OR);
+        return CheckKeyword(scanner, 1, 1, "r", TOKEN_OR);
     case 'p':
-        return CheckKeyword(1, 4, "rint", TOKEN_PRINT);
+        return CheckKeyword(scanner, 1, 4, "rint", TOKEN_PRINT);
     case 'r':
-        return CheckKeyword(1, 5, "eturn", TOKEN_RETURN);
+        return CheckKeyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
     case 's':
-        return CheckKeyword(1, 4, "uper", TOKEN_SUPER);
+        return CheckKeyword(scanner, 1, 4, "uper", TOKEN_SUPER);
     case 't':
-        if (scanner.current - scanner.start > 1)
+        if (scanner->current - scanner->start > 1)
         {
-            switch (scanner.start[1])
+            switch (scanner->start[1])
             {
             case 'h':
-                return CheckKeyword(2, 2, "is", TOKEN_THIS);
+                return CheckKeyword(scanner, 2, 2, "is", TOKEN_THIS);
             case 'r':
-                return CheckKeyword(2, 2, "ue", TOKEN_TRUE);
+                return CheckKeyword(scanner, 2, 2, "ue", TOKEN_TRUE);
             }
         }
         break;
     case 'v':
-        return CheckKeyword(1, 2, "ar", TOKEN_VAR);
+        return CheckKeyword(scanner, 1, 2, "ar", TOKEN_VAR);
     case 'w':
-        return CheckKeyword(1, 4, "hile", TOKEN_WHILE);
+        return CheckKeyword(scanner, 1, 4, "hile", TOKEN_WHILE);
     }
 
     return TOKEN_IDENTIFIER;
 }
 
-TokenType CheckKeyword(int start, int length, const char *rest, TokenType type)
+TokenType CheckKeyword(Scanner *scanner, int start, int length, const char *rest, TokenType type)
 {
-    if (scanner.current - scanner.start == start + length &&
-        memcmp(scanner.start + start, rest, length) == 0)
+    if (scanner->current - scanner->start == start + length &&
+        memcmp(scanner->start + start, rest, length) == 0)
     {
         return type;
     }
@@ -12,14 +12,14 @@ void lox_InitChunk(Chunk *chunk)
     lox_InitValueArray(&chunk->constants);
 }
 
-void lox_WriteChunk(Chunk *chunk, uint8_t byte, int line)
+void lox_WriteChunk(VM *vm, Chunk *chunk, uint8_t byte, int line)
 {
     if (chunk->capacity < chunk->count + 1)
     {
         size_t old_capacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(old_capacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, old_capacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, old_capacity, chunk->capacity);
+        chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code, old_capacity, chunk->capacity);
+        chunk->lines = GROW_ARRAY(vm, int, chunk->lines, old_capacity, chunk->capacity);
     }
 
     chunk->code[chunk->count] = byte;
@@ -27,16 +27,46 @@ void lox_WriteChunk(Chunk *chunk, uint8_t byte, int line)
     chunk->count++;
 }
 
-int lox_AddConstant(Chunk *chunk, Value value)
+int lox_AddConstant(VM *vm, Chunk *chunk, Value value)
 {
-    lox_WriteValueArray(&chunk->constants, value);
+    lox_WriteValueArray(vm, &chunk->constants, value);
     return chunk->constants.count - 1;
 }
 
-void lox_FreeChunk(Chunk *chunk)
+/// @brief Finds the length of an instruction, including operands.
+/// @param opcode of the instruction.
+/// @return length in bytes.
+int lox_InstructionLength(uint8_t opcode)
 {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
-    lox_FreeValueArray(&chunk->constants);
+    switch (opcode)
+    {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_CLOSURE:
+        return 2;
+    case OP_GET_LOCAL_CONSTANT:
+    case OP_GET_LOCAL_LOCAL:
+    case OP_INCREMENT_LOCAL:
+    case OP_LESS_JUMP_IF_FALSE:
+    case OP_DEFINE_GLOBAL_SLOT:
+    case OP_GET_GLOBAL_SLOT:
+    case OP_SET_GLOBAL_SLOT:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP:
+    case OP_LOOP:
+        return 3;
+    default:
+        return 1;
+    }
+}
+
+void lox_FreeChunk(VM *vm, Chunk *chunk)
+{
+    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(vm, int, chunk->lines, chunk->capacity);
+    lox_FreeValueArray(vm, &chunk->constants);
     lox_InitChunk(chunk);
 }
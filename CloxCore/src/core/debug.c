@@ -2,22 +2,68 @@
 
 #include "core/debug.h"
 #include "core/value.h"
+#include "core/object.h"
+#include "vm/vm.h"
 
 static int SimpleInstruction(const char *name, int offset);
 static int ConstantInstruction(const char *name, Chunk *chunk, int offset);
 static int ByteInstruction(const char *name, Chunk *chunk, int offset);
 static int JumpInstruction(const char *name, int sign, Chunk *chunk, int offset);
+static int GlobalInstruction(VM *vm, const char *name, Chunk *chunk, int offset);
+static int LocalConstantInstruction(const char *name, Chunk *chunk, int offset);
+static int TwoByteInstruction(const char *name, Chunk *chunk, int offset);
 
-void lox_DisassembleChunk(Chunk *chunk, const char *name)
+static const char *opcode_names[UINT8_COUNT] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_NOT] = "OP_NOT",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_POP] = "OP_POP",
+    [OP_DEFINE_GLOBAL_SLOT] = "OP_DEFINE_GLOBAL_SLOT",
+    [OP_GET_GLOBAL_SLOT] = "OP_GET_GLOBAL_SLOT",
+    [OP_SET_GLOBAL_SLOT] = "OP_SET_GLOBAL_SLOT",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CALL] = "OP_CALL",
+    [OP_TAIL_CALL] = "OP_TAIL_CALL",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_GET_LOCAL_CONSTANT] = "OP_GET_LOCAL_CONSTANT",
+    [OP_GET_LOCAL_LOCAL] = "OP_GET_LOCAL_LOCAL",
+    [OP_INCREMENT_LOCAL] = "OP_INCREMENT_LOCAL",
+    [OP_LESS_JUMP_IF_FALSE] = "OP_LESS_JUMP_IF_FALSE",
+    [OP_ADD_NUMBER] = "OP_ADD_NUMBER",
+    [OP_ADD_STRING] = "OP_ADD_STRING",
+    [OP_SUBTRACT_NUMBER] = "OP_SUBTRACT_NUMBER",
+    [OP_MULTIPLY_NUMBER] = "OP_MULTIPLY_NUMBER",
+    [OP_DIVIDE_NUMBER] = "OP_DIVIDE_NUMBER",
+    [OP_GREATER_NUMBER] = "OP_GREATER_NUMBER",
+    [OP_LESS_NUMBER] = "OP_LESS_NUMBER",
+};
+
+void lox_DisassembleChunk(VM *vm, Chunk *chunk, const char *name)
 {
     printf("== %s ==\n", name);
     for (size_t offset = 0; offset < chunk->count;)
     {
-        offset = lox_DisassembleInstruction(chunk, offset);
+        offset = lox_DisassembleInstruction(vm, chunk, offset);
     }
 }
 
-int lox_DisassembleInstruction(Chunk *chunk, int offset)
+int lox_DisassembleInstruction(VM *vm, Chunk *chunk, int offset)
 {
     printf("%04d ", offset);
     if (offset > 0 &&
@@ -65,12 +111,12 @@ int lox_DisassembleInstruction(Chunk *chunk, int offset)
         return SimpleInstruction("OP_PRINT", offset);
     case OP_POP:
         return SimpleInstruction("OP_POP", offset);
-    case OP_DEFINE_GLOBAL:
-        return ConstantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
-    case OP_GET_GLOBAL:
-        return ConstantInstruction("OP_GET_GLOBAL", chunk, offset);
-    case OP_SET_GLOBAL:
-        return ConstantInstruction("OP_SET_GLOBAL", chunk, offset);
+    case OP_DEFINE_GLOBAL_SLOT:
+        return GlobalInstruction(vm, "OP_DEFINE_GLOBAL_SLOT", chunk, offset);
+    case OP_GET_GLOBAL_SLOT:
+        return GlobalInstruction(vm, "OP_GET_GLOBAL_SLOT", chunk, offset);
+    case OP_SET_GLOBAL_SLOT:
+        return GlobalInstruction(vm, "OP_SET_GLOBAL_SLOT", chunk, offset);
     case OP_GET_LOCAL:
         return ByteInstruction("OP_GET_LOCAL", chunk, offset);
     case OP_SET_LOCAL:
@@ -83,6 +129,30 @@ int lox_DisassembleInstruction(Chunk *chunk, int offset)
         return JumpInstruction("OP_LOOP", -1, chunk, offset);
     case OP_CALL:
         return ByteInstruction("OP_CALL", chunk, offset);
+    case OP_TAIL_CALL:
+        return ByteInstruction("OP_TAIL_CALL", chunk, offset);
+    case OP_GET_LOCAL_CONSTANT:
+        return LocalConstantInstruction("OP_GET_LOCAL_CONSTANT", chunk, offset);
+    case OP_GET_LOCAL_LOCAL:
+        return TwoByteInstruction("OP_GET_LOCAL_LOCAL", chunk, offset);
+    case OP_INCREMENT_LOCAL:
+        return LocalConstantInstruction("OP_INCREMENT_LOCAL", chunk, offset);
+    case OP_LESS_JUMP_IF_FALSE:
+        return JumpInstruction("OP_LESS_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_ADD_NUMBER:
+        return SimpleInstruction("OP_ADD_NUMBER", offset);
+    case OP_ADD_STRING:
+        return SimpleInstruction("OP_ADD_STRING", offset);
+    case OP_SUBTRACT_NUMBER:
+        return SimpleInstruction("OP_SUBTRACT_NUMBER", offset);
+    case OP_MULTIPLY_NUMBER:
+        return SimpleInstruction("OP_MULTIPLY_NUMBER", offset);
+    case OP_DIVIDE_NUMBER:
+        return SimpleInstruction("OP_DIVIDE_NUMBER", offset);
+    case OP_GREATER_NUMBER:
+        return SimpleInstruction("OP_GREATER_NUMBER", offset);
+    case OP_LESS_NUMBER:
+        return SimpleInstruction("OP_LESS_NUMBER", offset);
     case OP_CLOSURE:
     {
         offset++;
@@ -99,6 +169,11 @@ int lox_DisassembleInstruction(Chunk *chunk, int offset)
     return 0;
 }
 
+const char *lox_OpcodeName(uint8_t opcode)
+{
+    return opcode_names[opcode] != NULL ? opcode_names[opcode] : "OP_UNKNOWN";
+}
+
 int SimpleInstruction(const char *name, int offset)
 {
     printf("%s\n", name);
@@ -129,3 +204,32 @@ int JumpInstruction(const char *name, int sign, Chunk *chunk, int offset)
            offset + 3 + sign * jump);
     return offset + 3;
 }
+
+int GlobalInstruction(VM *vm, const char *name, Chunk *chunk, int offset)
+{
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    printf("%-16s %4d '", name, slot);
+    if (slot < vm->global_names.count)
+        lox_PrintValue(vm->global_names.values[slot]);
+    printf("'\n");
+    return offset + 3;
+}
+
+int LocalConstantInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    lox_PrintValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+int TwoByteInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint8_t a = chunk->code[offset + 1];
+    uint8_t b = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, a, b);
+    return offset + 3;
+}
@@ -1,10 +1,98 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "core/memory.h"
+#include "core/slab.h"
 #include "vm/vm.h"
+#include "vm/jit.h"
+#include "vm/trace.h"
+#include "vm/io.h"
+#include "vm/scheduler.h"
 
-void *lox_Reallocate(void *pointer, size_t old_size, size_t new_size)
+// The state of an incremental collection, and the pause statistics.
+typedef struct Collector
 {
+    // The objects left to sweep. Those that survive are moved back to vm->objects.
+    Obj *unswept;
+    // The marker thread, while marking concurrently. It owns the gray stack and the marks until
+    // it's done. What the mutator shades meanwhile waits in 'pending'.
+    pthread_t marker;
+    bool marker_running;
+    atomic_bool marker_done;
+    Obj **pending;
+    int pending_count;
+    int pending_capacity;
+    // The fibers and ropes the marker thread reached. The stacks of fibers change as they run,
+    // and ropes may refer to young strings, which the mutator moves. They're traced once it's done.
+    Obj **deferred;
+    int deferred_count;
+    int deferred_capacity;
+    GcStats stats;
+} Collector;
+
+static void freeObject(VM *vm, Obj *object);
+static Collector *GetCollector(VM *vm);
+static void PushObject(Obj ***objects, int *count, int *capacity, Obj *object);
+static void *ReallocateWith(VM *vm, void *pointer, size_t old_size, size_t new_size);
+#ifdef USE_SLABS
+static void *ReallocateSmall(VM *vm, void *pointer, size_t old_size, size_t new_size);
+#endif
+static void OutOfMemory(void);
+static void CheckHeapGrowth(VM *vm);
+static bool IsCollectionDue(VM *vm);
+static bool IsYoung(VM *vm, Obj *object);
+static size_t YoungSize(Obj *object);
+static void ForwardStack(VM *vm, Value *stack, Value *stack_top);
+static void ForwardReferences(VM *vm, Obj *object);
+static void UpdateInternedStrings(VM *vm);
+static void CollectAll(VM *vm);
+static void StartCycle(VM *vm);
+static void Step(VM *vm);
+static void CompleteCycle(VM *vm);
+static void FinishMarking(VM *vm);
+static void FinishCycle(VM *vm);
+static void *RunMarker(void *arg);
+static void JoinMarker(VM *vm);
+static void TakeOverMarking(VM *vm);
+static void MarkRoots(VM *vm);
+static void MarkArray(VM *vm, ValueArray *array);
+static void MarkStacks(VM *vm, CallFrame *frames, int frame_count, Value *stack, Value *stack_top);
+static bool TraceReferences(VM *vm, size_t budget);
+static void BlackenObject(VM *vm, Obj *object);
+static void RemoveUnmarkedStrings(VM *vm);
+static bool Sweep(VM *vm, size_t budget);
+static uint64_t Now(void);
+static void RecordPause(VM *vm, uint64_t start);
+
+/// @brief Allocates, resizes or frees memory of the heap of 'vm', and counts it against the
+///        memory limit. Runs out of memory only if the system, or the VM's allocator, does, and
+///        exits then.
+/// @param pointer to the memory, or NULL to allocate.
+/// @param old_size is the size 'pointer' was allocated with, or 0.
+/// @param new_size is the size to allocate, or 0 to free.
+/// @return the memory, which may have moved, or NULL if it was freed.
+void *lox_Reallocate(VM *vm, void *pointer, size_t old_size, size_t new_size)
+{
+    vm->bytes_allocated += new_size - old_size;
+    if (new_size > old_size)
+    {
+        if (vm->bytes_allocated > vm->peak_bytes)
+            vm->peak_bytes = vm->bytes_allocated;
+        CheckHeapGrowth(vm);
+    }
+
+    if (vm->allocator.allocate != NULL)
+        return ReallocateWith(vm, pointer, old_size, new_size);
+#ifdef USE_SLABS
+    if (old_size <= SLAB_MAX_SIZE || new_size <= SLAB_MAX_SIZE)
+        return ReallocateSmall(vm, pointer, old_size, new_size);
+#endif
+
     if (new_size == 0)
     {
         free(pointer);
@@ -13,49 +101,853 @@ void *lox_Reallocate(void *pointer, size_t old_size, size_t new_size)
 
     void *result = realloc(pointer, new_size);
     if (result == NULL)
-        exit(1);
+        OutOfMemory();
 
     return result;
 }
 
-static void freeObject(Obj *object)
+/// @brief Reallocates through the VM's allocator, which can't resize a block, so it moves unless
+///        the size stays the same.
+void *ReallocateWith(VM *vm, void *pointer, size_t old_size, size_t new_size)
+{
+    if (pointer != NULL && new_size == old_size)
+        return pointer;
+
+    Allocator *allocator = &vm->allocator;
+    void *result = NULL;
+    if (new_size > 0)
+    {
+        result = allocator->allocate(allocator->user_data, new_size);
+        if (result == NULL)
+            OutOfMemory();
+    }
+    if (pointer != NULL)
+    {
+        if (result != NULL)
+            memcpy(result, pointer, old_size < new_size ? old_size : new_size);
+        allocator->free(allocator->user_data, pointer, old_size);
+    }
+    return result;
+}
+
+#ifdef USE_SLABS
+/// @brief Reallocates when the old or the new size is small enough for a slab. The block moves
+///        unless both sizes are in the same class.
+void *ReallocateSmall(VM *vm, void *pointer, size_t old_size, size_t new_size)
+{
+    if (pointer != NULL && new_size > 0 && new_size <= SLAB_MAX_SIZE &&
+        (old_size - 1) / SLAB_GRANULE == (new_size - 1) / SLAB_GRANULE)
+        return pointer;
+
+    void *result = NULL;
+    if (new_size > 0)
+    {
+        result = new_size <= SLAB_MAX_SIZE ? lox_AllocateSlab(vm, new_size) : malloc(new_size);
+        if (result == NULL)
+            OutOfMemory();
+    }
+    if (pointer != NULL)
+    {
+        memcpy(result, pointer, old_size < new_size ? old_size : new_size);
+        if (old_size <= SLAB_MAX_SIZE)
+            lox_FreeSlab(vm, pointer, old_size);
+        else
+            free(pointer);
+    }
+    return result;
+}
+#endif
+
+/// @brief Bump-allocates 'size' bytes in the nursery. The caller initializes the object, which
+///        isn't on vm->objects.
+/// @return NULL if the object is too large for the nursery, or the nursery is full. A full
+///         nursery requests a safepoint to empty it, and the caller allocates in the old space
+///         until then.
+void *lox_AllocateYoung(VM *vm, size_t size)
+{
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if (size > NURSERY_MAX_OBJECT)
+        return NULL;
+    if (vm->nursery == NULL)
+    {
+        // Not through lox_Reallocate. Only the part in use counts as allocated.
+        if (vm->allocator.allocate != NULL)
+            vm->nursery = vm->allocator.allocate(vm->allocator.user_data, NURSERY_SIZE);
+        else
+            vm->nursery = malloc(NURSERY_SIZE);
+        if (vm->nursery == NULL)
+            OutOfMemory();
+        vm->nursery_top = vm->nursery;
+        vm->nursery_end = vm->nursery + NURSERY_SIZE;
+    }
+    if (size > (size_t)(vm->nursery_end - vm->nursery_top))
+    {
+        lox_RequestSafepoint(vm);
+        return NULL;
+    }
+
+    void *object = vm->nursery_top;
+    vm->nursery_top += size;
+    vm->bytes_allocated += size;
+    if (vm->bytes_allocated > vm->peak_bytes)
+        vm->peak_bytes = vm->bytes_allocated;
+    CheckHeapGrowth(vm);
+    return object;
+}
+
+/// @brief Frees the object allocated last, before anything refers to it.
+void lox_DiscardObject(VM *vm, Obj *object)
+{
+    if (IsYoung(vm, object))
+    {
+        vm->bytes_allocated -= vm->nursery_top - (char *)object;
+        vm->nursery_top = (char *)object;
+        vm->objects_freed[object->type]++;
+        return;
+    }
+
+    // It was shaded last, if marking is in progress.
+    Collector *collector = vm->collector;
+    if (vm->gc_phase == GC_MARKING && collector->marker_running)
+    {
+        if (collector->pending_count > 0 && collector->pending[collector->pending_count - 1] == object)
+            collector->pending_count--;
+    }
+    else if (vm->gc_phase == GC_MARKING)
+    {
+        if (vm->gray_count > 0 && vm->gray_stack[vm->gray_count - 1] == object)
+            vm->gray_count--;
+    }
+
+    vm->objects = object->next;
+    freeObject(vm, object);
+}
+
+/// @brief The write barrier. Call it after storing values in 'object', unless it's a root.
+///        The next minor collection updates the values that are young, and marking in progress
+///        traces 'object' again, so it doesn't miss the new values(the tri-color invariant).
+void lox_RememberObject(VM *vm, Obj *object)
+{
+    if (vm->gc_phase == GC_MARKING && !(vm->shared_code && !object->worker_owned))
+    {
+        Collector *collector = vm->collector;
+        if (collector->marker_running)
+            PushObject(&collector->pending, &collector->pending_count, &collector->pending_capacity, object);
+        else if (object->is_marked)
+            PushObject(&vm->gray_stack, &vm->gray_count, &vm->gray_capacity, object);
+    }
+
+    // Nothing refers to a young object while the nursery is empty.
+    if (object->is_remembered || vm->nursery_top == vm->nursery || IsYoung(vm, object))
+        return;
+
+    object->is_remembered = true;
+    PushObject(&vm->remembered, &vm->remembered_count, &vm->remembered_capacity, object);
+}
+
+/// @brief Keeps 'object' alive through the marking in progress, and has its references traced.
+///        Called for objects created while marking, and for interned strings handed out again,
+///        which the mutator may store where marking has already been.
+void lox_ShadeObject(VM *vm, Obj *object)
+{
+    if (vm->gc_phase != GC_MARKING || (vm->shared_code && !object->worker_owned))
+        return;
+    // A young object is reachable from the roots or a remembered object until the next minor
+    // collection, which shades its copy. Marking it would look like it had been copied already.
+    if (IsYoung(vm, object))
+        return;
+
+    Collector *collector = vm->collector;
+    if (collector->marker_running)
+    {
+        // The marker thread owns the marks until it's done.
+        PushObject(&collector->pending, &collector->pending_count, &collector->pending_capacity, object);
+        return;
+    }
+    if (object->is_marked)
+        return;
+    object->is_marked = true;
+    PushObject(&vm->gray_stack, &vm->gray_count, &vm->gray_capacity, object);
+}
+
+/// @brief A minor collection: copies the young objects that are still reachable to the old space,
+///        and empties the nursery. Only strings are young, and they refer to nothing, so only the
+///        roots and the remembered objects are visited. The old space isn't traced.
+///        Call it where lox_CollectGarbage can be called.
+void lox_CollectNursery(VM *vm)
+{
+    if (vm->nursery_top != vm->nursery)
+    {
+#ifdef DEBUG_LOG_GC
+        printf("-- minor gc begin\n");
+        size_t before = vm->bytes_allocated;
+#endif
+
+        ForwardStack(vm, vm->stack, vm->stack_top);
+        for (size_t i = 0; i < vm->global_values.count; i++)
+            lox_ForwardValue(vm, &vm->global_values.values[i]);
+        for (int i = 0; i < vm->remembered_count; i++)
+            ForwardReferences(vm, vm->remembered[i]);
+#ifdef USE_EPOLL
+        lox_ForwardIoRoots(vm);
+#endif
+        UpdateInternedStrings(vm);
+
+        vm->bytes_allocated -= vm->nursery_top - vm->nursery;
+        vm->nursery_top = vm->nursery;
+        GetCollector(vm)->stats.minor_count++;
+
+#ifdef DEBUG_LOG_GC
+        printf("-- minor gc end\n");
+        printf("   collected %zu bytes (from %zu to %zu)\n",
+               before - vm->bytes_allocated, before, vm->bytes_allocated);
+#endif
+    }
+
+    for (int i = 0; i < vm->remembered_count; i++)
+        vm->remembered[i]->is_remembered = false;
+    vm->remembered_count = 0;
+}
+
+/// @brief Copies a young object out of the nursery the first time it's reached.
+/// @return where 'object' lives from now on.
+Obj *lox_ForwardObject(VM *vm, Obj *object)
+{
+    if (object == NULL || !IsYoung(vm, object))
+        return object;
+    if (object->is_marked)
+        return object->next;
+
+    // Only strings are young.
+    ObjString *string = (ObjString *)object;
+    ObjString *copy = lox_Reallocate(vm, NULL, 0, STRING_SIZE(string->length));
+    memcpy(copy, string, STRING_SIZE(string->length));
+    copy->obj.next = vm->objects;
+    vm->objects = (Obj *)copy;
+    lox_ShadeObject(vm, (Obj *)copy);
+
+#ifdef DEBUG_LOG_GC
+    printf("%p promote to %p ", (void *)object, (void *)copy);
+    lox_PrintValue(OBJ_VAL(object));
+    printf("\n");
+#endif
+
+    object->is_marked = true;
+    object->next = (Obj *)copy;
+    return (Obj *)copy;
+}
+
+void lox_ForwardValue(VM *vm, Value *slot)
+{
+    if (IS_OBJ(*slot))
+        *slot = OBJ_VAL(lox_ForwardObject(vm, AS_OBJ(*slot)));
+}
+
+/// @brief Does the collection work that is due at a safepoint: empties the nursery, and starts,
+///        advances or finishes a collection of the old space. A call that does any is one pause.
+void lox_CollectAtSafepoint(VM *vm)
+{
+    if (vm->nursery_top == vm->nursery && vm->gc_phase == GC_IDLE &&
+        !IsCollectionDue(vm) && vm->bytes_allocated <= vm->memory_limit)
+        return;
+
+    uint64_t start = Now();
+    lox_CollectNursery(vm);
+    if (vm->bytes_allocated > vm->memory_limit)
+        CollectAll(vm);
+    else if (vm->gc_phase != GC_IDLE)
+        Step(vm);
+    else if (IsCollectionDue(vm))
+        StartCycle(vm);
+    RecordPause(vm, start);
+}
+
+/// @brief Frees the objects that can't be reached from the roots of 'vm' at once, finishing the
+///        collection in progress first. Only call it where the state of the running frame has
+///        been stored, like at a safepoint(see lox_Safepoint).
+///        A VM running shared code only collects the objects it allocated.
+void lox_CollectGarbage(VM *vm)
+{
+    uint64_t start = Now();
+    CollectAll(vm);
+    RecordPause(vm, start);
+}
+
+/// @brief Marks 'object' as reachable, and queues it to have its references marked.
+void lox_MarkObject(VM *vm, Obj *object)
+{
+    if (object == NULL || object->is_marked)
+        return;
+    if (vm->shared_code && !object->worker_owned)
+        return;
+
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void *)object);
+    lox_PrintValue(OBJ_VAL(object));
+    printf("\n");
+#endif
+
+    object->is_marked = true;
+    PushObject(&vm->gray_stack, &vm->gray_count, &vm->gray_capacity, object);
+}
+
+void lox_MarkValue(VM *vm, Value value)
+{
+    if (IS_OBJ(value))
+        lox_MarkObject(vm, AS_OBJ(value));
+}
+
+/// @brief Copies the pause statistics of 'vm' to 'stats'.
+void lox_GetGcStats(VM *vm, GcStats *stats)
+{
+    *stats = GetCollector(vm)->stats;
+}
+
+void lox_PrintGcStats(VM *vm)
+{
+    GcStats *stats = &GetCollector(vm)->stats;
+    fprintf(stderr, "Collections minor: %llu, major: %llu\n",
+            (unsigned long long)stats->minor_count, (unsigned long long)stats->major_count);
+    fprintf(stderr, "Pauses: %llu, total: %.3fms, longest: %.3fms\n", (unsigned long long)stats->pause_count,
+            stats->total_pause_ns / 1e6, stats->longest_pause_ns / 1e6);
+
+    uint64_t seen = 0;
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++)
+    {
+        if (stats->pauses[i] == 0)
+            continue;
+        seen += stats->pauses[i];
+        if (i == GC_PAUSE_BUCKETS - 1)
+            fprintf(stderr, "  >= %8lluus: %llu", 1ull << (i - 1), (unsigned long long)stats->pauses[i]);
+        else
+            fprintf(stderr, "  < %9lluus: %llu", 1ull << i, (unsigned long long)stats->pauses[i]);
+        fprintf(stderr, "(%.1f%%)\n", 100.0 * seen / stats->pause_count);
+    }
+}
+
+/// @brief Copies the memory usage of 'vm' to 'stats'.
+void lox_GetMemoryStats(VM *vm, MemoryStats *stats)
 {
+    stats->bytes_allocated = vm->bytes_allocated;
+    stats->peak_bytes = vm->peak_bytes;
+    stats->memory_limit = vm->memory_limit;
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++)
+    {
+        stats->objects_allocated[i] = vm->objects_allocated[i];
+        stats->objects_live[i] = vm->objects_allocated[i] - vm->objects_freed[i];
+    }
+}
+
+void lox_PrintMemoryStats(VM *vm)
+{
+    static const char *type_names[OBJ_TYPE_COUNT] = {
+        [OBJ_STRING] = "string",
+        [OBJ_FUNCTION] = "function",
+        [OBJ_CLOSURE] = "closure",
+        [OBJ_NATIVE] = "native",
+        [OBJ_FIBER] = "fiber",
+        [OBJ_ROPE] = "rope",
+    };
+
+    MemoryStats stats;
+    lox_GetMemoryStats(vm, &stats);
+    fprintf(stderr, "Memory: %zu bytes, peak: %zu bytes", stats.bytes_allocated, stats.peak_bytes);
+    if (stats.memory_limit != SIZE_MAX)
+        fprintf(stderr, ", limit: %zu bytes", stats.memory_limit);
+    fprintf(stderr, "\n");
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++)
+    {
+        if (stats.objects_allocated[i] == 0)
+            continue;
+        fprintf(stderr, "  %-8s allocated: %llu, live: %llu\n", type_names[i],
+                (unsigned long long)stats.objects_allocated[i], (unsigned long long)stats.objects_live[i]);
+    }
+}
+
+void lox_FreeObjects(VM *vm)
+{
+    JoinMarker(vm);
+    Collector *collector = vm->collector;
+    Obj *lists[] = {vm->objects, collector != NULL ? collector->unswept : NULL};
+    for (int i = 0; i < 2; i++)
+    {
+        Obj *object = lists[i];
+        while (object != NULL)
+        {
+            Obj *next = object->next;
+            freeObject(vm, object);
+            object = next;
+        }
+    }
+    free(vm->gray_stack);
+    if (vm->allocator.free != NULL && vm->nursery != NULL)
+        vm->allocator.free(vm->allocator.user_data, vm->nursery, NURSERY_SIZE);
+    else
+        free(vm->nursery);
+    free(vm->remembered);
+    if (collector != NULL)
+    {
+        free(collector->pending);
+        free(collector->deferred);
+        free(collector);
+    }
+}
+
+void freeObject(VM *vm, Obj *object)
+{
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void *)object, object->type);
+#endif
+    vm->objects_freed[object->type]++;
+
     switch (object->type)
     {
     case OBJ_STRING:
     {
-        ObjString *string = (ObjString *)object;
-        FREE_ARRAY(char, string->chars, string->length + 1);
-        FREE(ObjString, object);
+        lox_Reallocate(vm, object, STRING_SIZE(((ObjString *)object)->length), 0);
         break;
     }
     case OBJ_FUNCTION:
     {
         ObjFunction *function = (ObjFunction *)object;
-        lox_FreeChunk(&function->chunk);
-        FREE(ObjFunction, object);
+#ifdef USE_JIT
+        lox_JitFree(function);
+        lox_FreeTraces(vm, function);
+#endif
+        lox_FreeChunk(vm, &function->chunk);
+        FREE(vm, ObjFunction, object);
         break;
     }
     case OBJ_CLOSURE:
     {
-        FREE(ObjClosure, object);
+        FREE(vm, ObjClosure, object);
+        break;
+    }
+    case OBJ_NATIVE:
+    {
+        FREE(vm, ObjNative, object);
+        break;
+    }
+    case OBJ_FIBER:
+    {
+        ObjFiber *fiber = (ObjFiber *)object;
+        FREE_ARRAY(vm, CallFrame, fiber->frames, fiber->frame_capacity);
+        FREE_ARRAY(vm, Value, fiber->stack, fiber->stack_capacity);
+        FREE(vm, ObjFiber, object);
+        break;
+    }
+    case OBJ_ROPE:
+    {
+        FREE(vm, ObjRope, object);
+        break;
+    }
+    }
+}
+
+Collector *GetCollector(VM *vm)
+{
+    if (vm->collector == NULL)
+    {
+        vm->collector = calloc(1, sizeof(Collector));
+        if (vm->collector == NULL)
+            exit(1);
+    }
+    return vm->collector;
+}
+
+/// @brief Appends to an array of objects. Not through lox_Reallocate, which could start another
+///        collection.
+void PushObject(Obj ***objects, int *count, int *capacity, Obj *object)
+{
+    if (*count + 1 > *capacity)
+    {
+        *capacity = GROW_CAPACITY(*capacity);
+        *objects = realloc(*objects, sizeof(Obj *) * *capacity);
+        if (*objects == NULL)
+            OutOfMemory();
+    }
+    (*objects)[(*count)++] = object;
+}
+
+/// @brief Gives up. The heap can't be left half-updated, and there's no way to unwind to the
+///        caller from inside the interpreter, so this isn't a runtime error. The memory limit is.
+void OutOfMemory(void)
+{
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+}
+
+/// @brief Requests a safepoint if a collection is due. Collections only happen at safepoints,
+///        where everything in use is reachable from the roots. The next back-edge or call is one.
+void CheckHeapGrowth(VM *vm)
+{
+    // A collection in progress takes a step after every allocation.
+    if (IsCollectionDue(vm) || vm->gc_phase != GC_IDLE || vm->bytes_allocated > vm->memory_limit)
+        lox_RequestSafepoint(vm);
+}
+
+bool IsCollectionDue(VM *vm)
+{
+#ifdef DEBUG_STRESS_GC
+    return true;
+#else
+    return vm->bytes_allocated > vm->next_gc;
+#endif
+}
+
+bool IsYoung(VM *vm, Obj *object)
+{
+    return (char *)object >= vm->nursery && (char *)object < vm->nursery_top;
+}
+
+/// @return the bytes 'object' takes up in the nursery, including its characters.
+size_t YoungSize(Obj *object)
+{
+    size_t size = STRING_SIZE(((ObjString *)object)->length);
+    return (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+}
+
+void ForwardStack(VM *vm, Value *stack, Value *stack_top)
+{
+    for (Value *slot = stack; slot < stack_top; slot++)
+        lox_ForwardValue(vm, slot);
+}
+
+/// @brief Updates the references of a remembered object to young objects.
+void ForwardReferences(VM *vm, Obj *object)
+{
+    switch (object->type)
+    {
+    case OBJ_FIBER:
+    {
+        // The running fiber's stacks are the VM's, which have been visited.
+        ObjFiber *fiber = (ObjFiber *)object;
+        if (fiber != vm->fiber)
+            ForwardStack(vm, fiber->stack, fiber->stack_top);
+        break;
+    }
+    case OBJ_ROPE:
+    {
+        ObjRope *rope = (ObjRope *)object;
+        rope->left = lox_ForwardObject(vm, rope->left);
+        rope->right = lox_ForwardObject(vm, rope->right);
         break;
     }
+    case OBJ_STRING:
+    case OBJ_FUNCTION:
+    case OBJ_CLOSURE:
     case OBJ_NATIVE:
+        break;
+    }
+}
+
+/// @brief The intern table holds young strings weakly, like the rest(see RemoveUnmarkedStrings).
+///        Copied strings replace their originals, and the others are dropped.
+void UpdateInternedStrings(VM *vm)
+{
+    HashTable *table = &vm->strings;
+    size_t removed = 0;
+    for (char *young = vm->nursery; young < vm->nursery_top; young += YoungSize((Obj *)young))
+    {
+        ObjString *string = (ObjString *)young;
+        if (string->obj.is_marked)
+        {
+            lox_ReplaceKeyHashTable(table, string, (ObjString *)string->obj.next);
+        }
+        else
+        {
+            lox_RemoveEntryHashTable(table, string);
+            removed++;
+        }
+    }
+    // Nothing else refers to young strings, so the ones dropped are freed with the nursery.
+    vm->objects_freed[OBJ_STRING] += removed;
+    // The table decides itself whether it's worth shrinking or rebuilding.
+    if (removed > 0)
+        lox_CompactHashTable(vm, table);
+}
+
+/// @brief Collects everything unreachable at once. A collection in progress is finished first,
+///        but it can't free what died while it was running. A fresh one follows.
+void CollectAll(VM *vm)
+{
+    if (vm->gc_phase != GC_IDLE)
+        CompleteCycle(vm);
+    vm->gc_phase = GC_MARKING;
+    CompleteCycle(vm);
+}
+
+/// @brief Starts collecting the old space by marking the roots. The rest is done in steps at the
+///        following safepoints, or by the marker thread. Without either, it's done right away.
+void StartCycle(VM *vm)
+{
+    if (vm->gc_quantum <= 0 && !vm->gc_concurrent)
+    {
+        CollectAll(vm);
+        return;
+    }
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc start\n");
+#endif
+    Collector *collector = GetCollector(vm);
+    lox_CollectNursery(vm);
+    MarkRoots(vm);
+    vm->gc_phase = GC_MARKING;
+    if (vm->gc_concurrent)
+    {
+        atomic_store(&collector->marker_done, false);
+        // If it can't be started, the mutator does the marking in steps.
+        collector->marker_running = pthread_create(&collector->marker, NULL, RunMarker, vm) == 0;
+    }
+}
+
+/// @brief Traces or sweeps up to vm->gc_quantum objects. Or, while the marker thread runs, checks
+///        whether it's done.
+void Step(VM *vm)
+{
+    Collector *collector = GetCollector(vm);
+    size_t budget = vm->gc_quantum > 0 ? (size_t)vm->gc_quantum : SIZE_MAX;
+    if (vm->gc_phase == GC_MARKING)
+    {
+        if (collector->marker_running && !atomic_load(&collector->marker_done))
+            return;
+        TakeOverMarking(vm);
+        if (TraceReferences(vm, budget))
+            FinishMarking(vm);
+        return;
+    }
+
+    if (Sweep(vm, budget))
+        FinishCycle(vm);
+}
+
+/// @brief Finishes the collection in progress without stopping.
+void CompleteCycle(VM *vm)
+{
+    if (vm->gc_phase == GC_MARKING)
+        FinishMarking(vm);
+    Sweep(vm, SIZE_MAX);
+    FinishCycle(vm);
+}
+
+/// @brief Marks what changed while marking was spread out, and hands the unmarked objects to the
+///        sweeper. The roots are marked again, since stores to them aren't shaded.
+void FinishMarking(VM *vm)
+{
+    Collector *collector = GetCollector(vm);
+    TakeOverMarking(vm);
+    lox_CollectNursery(vm);
+    MarkRoots(vm);
+    TraceReferences(vm, SIZE_MAX);
+    RemoveUnmarkedStrings(vm);
+
+    collector->unswept = vm->objects;
+    vm->objects = NULL;
+    vm->gc_phase = GC_SWEEPING;
+}
+
+void FinishCycle(VM *vm)
+{
+    vm->gc_phase = GC_IDLE;
+    vm->next_gc = vm->bytes_allocated * GC_HEAP_GROW_FACTOR;
+    if (vm->next_gc < GC_INITIAL_THRESHOLD)
+        vm->next_gc = GC_INITIAL_THRESHOLD;
+    GetCollector(vm)->stats.major_count++;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf("   %zu bytes allocated, next at %zu\n", vm->bytes_allocated, vm->next_gc);
+#endif
+}
+
+/// @brief Traces the gray stack on a background thread. Objects other than fibers and ropes don't
+///        change once they're made, and the mutator leaves the gray stack and the marks alone
+///        meanwhile.
+void *RunMarker(void *arg)
+{
+    VM *vm = arg;
+    Collector *collector = vm->collector;
+    while (vm->gray_count > 0)
+    {
+        Obj *object = vm->gray_stack[--vm->gray_count];
+        if (object->type == OBJ_FIBER || object->type == OBJ_ROPE)
+            PushObject(&collector->deferred, &collector->deferred_count, &collector->deferred_capacity, object);
+        else
+            BlackenObject(vm, object);
+    }
+    atomic_store(&collector->marker_done, true);
+    return NULL;
+}
+
+void JoinMarker(VM *vm)
+{
+    Collector *collector = vm->collector;
+    if (collector == NULL || !collector->marker_running)
+        return;
+    pthread_join(collector->marker, NULL);
+    collector->marker_running = false;
+}
+
+/// @brief Waits for the marker thread, and continues its marking on the mutator: the objects shaded
+///        while it ran and the fibers and ropes it left are queued to be traced.
+void TakeOverMarking(VM *vm)
+{
+    Collector *collector = vm->collector;
+    if (collector == NULL || !collector->marker_running)
+        return;
+
+    JoinMarker(vm);
+    for (int i = 0; i < collector->pending_count; i++)
+    {
+        Obj *object = collector->pending[i];
+        object->is_marked = true;
+        PushObject(&vm->gray_stack, &vm->gray_count, &vm->gray_capacity, object);
+    }
+    collector->pending_count = 0;
+    for (int i = 0; i < collector->deferred_count; i++)
+        PushObject(&vm->gray_stack, &vm->gray_count, &vm->gray_capacity, collector->deferred[i]);
+    collector->deferred_count = 0;
+}
+
+/// @brief Marks what the VM refers to directly: the stacks of the running fiber, the fibers
+///        waiting to run or resume, globals, compiled scripts, and what the event loop and the
+///        scheduler have parked.
+void MarkRoots(VM *vm)
+{
+    MarkStacks(vm, vm->frames, vm->frame_count, vm->stack, vm->stack_top);
+    // The running fiber's own stacks are out of date, so it's marked like any other object and
+    // its stacks are skipped while tracing. Its resumers are marked through it.
+    lox_MarkObject(vm, (Obj *)vm->fiber);
+    // The main fiber isn't on the objects list. It's always marked(see InitState) and traced here.
+    BlackenObject(vm, &vm->main_fiber.obj);
+
+    MarkArray(vm, &vm->global_names);
+    MarkArray(vm, &vm->global_values);
+    MarkArray(vm, &vm->handles);
+#ifdef USE_EPOLL
+    lox_MarkIoRoots(vm);
+#endif
+    lox_MarkTaskRoots(vm);
+}
+
+void MarkArray(VM *vm, ValueArray *array)
+{
+    for (size_t i = 0; i < array->count; i++)
+        lox_MarkValue(vm, array->values[i]);
+}
+
+void MarkStacks(VM *vm, CallFrame *frames, int frame_count, Value *stack, Value *stack_top)
+{
+    for (Value *slot = stack; slot < stack_top; slot++)
+        lox_MarkValue(vm, *slot);
+    // A tail call may leave a frame running a function that isn't in its slots.
+    for (int i = 0; i < frame_count; i++)
+        lox_MarkObject(vm, (Obj *)frames[i].function);
+}
+
+/// @return true once the gray stack is empty.
+bool TraceReferences(VM *vm, size_t budget)
+{
+    for (; vm->gray_count > 0 && budget > 0; budget--)
     {
-        FREE(ObjNative, object);
+        Obj *object = vm->gray_stack[--vm->gray_count];
+        BlackenObject(vm, object);
+    }
+    return vm->gray_count == 0;
+}
+
+/// @brief Marks the objects 'object' refers to.
+void BlackenObject(VM *vm, Obj *object)
+{
+    switch (object->type)
+    {
+    case OBJ_FUNCTION:
+    {
+        ObjFunction *function = (ObjFunction *)object;
+        lox_MarkObject(vm, (Obj *)function->name);
+        MarkArray(vm, &function->chunk.constants);
         break;
     }
+    case OBJ_CLOSURE:
+        lox_MarkObject(vm, (Obj *)((ObjClosure *)object)->function);
+        break;
+    case OBJ_FIBER:
+    {
+        ObjFiber *fiber = (ObjFiber *)object;
+        if (fiber != vm->fiber)
+            MarkStacks(vm, fiber->frames, fiber->frame_count, fiber->stack, fiber->stack_top);
+        lox_MarkObject(vm, (Obj *)fiber->resumer);
+        break;
     }
+    case OBJ_ROPE:
+        lox_MarkObject(vm, ((ObjRope *)object)->left);
+        lox_MarkObject(vm, ((ObjRope *)object)->right);
+        break;
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+        break;
+    }
+}
+
+/// @brief Interned strings don't keep themselves alive. Those that weren't marked are dropped
+///        from the table before they're freed.
+void RemoveUnmarkedStrings(VM *vm)
+{
+    HashTable *table = &vm->strings;
+    bool removed = false;
+    for (size_t i = 0; i < table->capacity; i++)
+    {
+        ObjString *key = table->entries[i].key;
+        if (key == NULL || key->obj.is_marked)
+            continue;
+        if (vm->shared_code && !key->obj.worker_owned)
+            continue;
+        lox_RemoveEntryHashTable(table, key);
+        removed = true;
+    }
+    if (removed)
+        lox_CompactHashTable(vm, table);
 }
 
-void lox_FreeObjects()
+/// @brief Frees up to 'budget' unmarked objects of those left to sweep, and unmarks the others.
+/// @return true once every object has been swept.
+bool Sweep(VM *vm, size_t budget)
 {
-    Obj *object = vm.objects;
-    while (object != NULL)
+    Collector *collector = GetCollector(vm);
+    for (; collector->unswept != NULL && budget > 0; budget--)
     {
-        Obj *next = object->next;
-        freeObject(object);
-        object = next;
+        Obj *object = collector->unswept;
+        collector->unswept = object->next;
+        if (!object->is_marked)
+        {
+            freeObject(vm, object);
+            continue;
+        }
+        object->is_marked = false;
+        object->next = vm->objects;
+        vm->objects = object;
     }
+    return collector->unswept == NULL;
+}
+
+uint64_t Now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void RecordPause(VM *vm, uint64_t start)
+{
+    GcStats *stats = &GetCollector(vm)->stats;
+    uint64_t length = Now() - start;
+    int bucket = 0;
+    while (bucket < GC_PAUSE_BUCKETS - 1 && length / 1000 >= (1ull << bucket))
+        bucket++;
+    stats->pauses[bucket]++;
+    stats->pause_count++;
+    stats->total_pause_ns += length;
+    if (length > stats->longest_pause_ns)
+        stats->longest_pause_ns = length;
 }
@@ -1,99 +1,279 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "common/hash.h"
 #include "core/memory.h"
 #include "core/object.h"
 #include "core/value.h"
 #include "vm/vm.h"
 
-#define ALLOCATE_OBJ(type, objectType) \
-    (type *)AllocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType) \
+    (type *)AllocateObject(vm, sizeof(type), objectType)
 
-static Obj *AllocateObject(size_t size, ObjType type)
+static Obj *AllocateObject(VM *vm, size_t size, ObjType type)
 {
-    Obj *object = (Obj *)lox_Reallocate(NULL, 0, size);
+    Obj *object = (Obj *)lox_Reallocate(vm, NULL, 0, size);
     object->type = type;
-    object->next = vm.objects;
-    vm.objects = object;
+    object->is_marked = false;
+    object->worker_owned = vm->shared_code;
+    object->is_remembered = false;
+    object->next = vm->objects;
+    vm->objects = object;
+    vm->objects_allocated[type]++;
+    // Marking may already have been through whatever the new object gets stored in.
+    lox_ShadeObject(vm, object);
+#ifdef DEBUG_LOG_GC
+    printf("%p allocate %zu for %d\n", (void *)object, size, type);
+#endif
     return object;
 }
 
-static ObjString *AllocateString(char *chars, int length, uint32_t hash)
+static ObjString *AllocateString(VM *vm, const char *chars, int length, uint32_t hash)
 {
-    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    ObjString *string = (ObjString *)AllocateObject(vm, STRING_SIZE(length), OBJ_STRING);
     string->length = length;
-    string->chars = chars;
     string->hash = hash;
-    lox_AddEntryHashTable(&vm.strings, string, NIL_VAL);
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
+    lox_AddEntryHashTable(vm, &vm->strings, string, NIL_VAL);
     return string;
 }
 
-/// @brief Hashes a string using FNV-1a.
-/// @param string to hash.
-/// @param length of string to hash.
-/// @return the hash.
-static uint32_t HashString(const char *string, int length)
+ObjClosure *lox_CreateClosure(VM *vm, ObjFunction *function)
 {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++)
-    {
-        hash ^= (uint8_t)string[i];
-        hash *= 16777619;
-    }
-    return hash;
+    ObjClosure *closure = ALLOCATE_OBJ(vm, ObjClosure, OBJ_CLOSURE);
+    closure->function = function;
+    return closure;
 }
 
-ObjClosure *lox_CreateClosure(ObjFunction *function)
+/// @brief Creates a fiber that calls 'function' when it's first resumed.
+/// @param function is a function or closure taking at most one argument.
+ObjFiber *lox_CreateFiber(VM *vm, Value function)
 {
-    ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
-    closure->function = function;
-    return closure;
+    ObjFiber *fiber = ALLOCATE_OBJ(vm, ObjFiber, OBJ_FIBER);
+    fiber->state = FIBER_NEW;
+    fiber->frames = ALLOCATE(vm, CallFrame, FRAMES_INITIAL);
+    fiber->frame_count = 0;
+    fiber->frame_capacity = FRAMES_INITIAL;
+    fiber->stack = ALLOCATE(vm, Value, STACK_INITIAL);
+    fiber->stack_capacity = STACK_INITIAL;
+    fiber->stack[0] = function;
+    fiber->stack_top = fiber->stack + 1;
+    fiber->resumer = NULL;
+    fiber->spawned = false;
+    return fiber;
 }
 
-ObjFunction *lox_CreateFunction()
+ObjFunction *lox_CreateFunction(VM *vm)
 {
-    ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+    ObjFunction *function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->name = NULL;
+    function->call_count = 0;
+    function->native = NULL;
+    function->native_size = 0;
+    function->traces = NULL;
     lox_InitChunk(&function->chunk);
     return function;
 }
 
-ObjNative *lox_CreateNative(NativeFn function)
+ObjNative *lox_CreateNative(VM *vm, NativeFn function)
 {
-    ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+    ObjNative *native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
     native->function = function;
     return native;
 }
 
-ObjString *lox_CopyString(const char *chars, int length)
+ObjString *lox_CopyString(VM *vm, const char *chars, int length)
 {
-    uint32_t hash = HashString(chars, length);
+    uint32_t hash = lox_HashString(chars, length);
 
     // Check if string is interned.
-    ObjString *interned = lox_FindStringHashTable(&vm.strings, chars, length, hash);
+    ObjString *interned = lox_FindStringHashTable(&vm->strings, chars, length, hash);
     if (interned != NULL)
+    {
+        // The table holds its strings weakly, so this one may not have been marked yet.
+        lox_ShadeObject(vm, (Obj *)interned);
         return interned;
+    }
 
-    char *heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return AllocateString(heapChars, length, hash);
+    return AllocateString(vm, chars, length, hash);
 }
 
-ObjString *lox_TakeString(char *chars, int length)
+/// @brief Allocates a string of 'length' characters for the caller to fill in, and then pass to
+///        lox_InternString before allocating anything else. It's young if it fits in the nursery.
+ObjString *lox_ReserveString(VM *vm, int length)
 {
-    uint32_t hash = HashString(chars, length);
+    ObjString *string = lox_AllocateYoung(vm, STRING_SIZE(length));
+    if (string != NULL)
+    {
+        string->obj.type = OBJ_STRING;
+        string->obj.is_marked = false;
+        string->obj.worker_owned = vm->shared_code;
+        string->obj.is_remembered = false;
+        string->obj.next = NULL;
+        vm->objects_allocated[OBJ_STRING]++;
+    }
+    else
+    {
+        string = (ObjString *)AllocateObject(vm, STRING_SIZE(length), OBJ_STRING);
+    }
+    string->length = length;
+    string->chars[length] = '\0';
+    string->hash = 0;
+    return string;
+}
 
-    // Check if string is interned.
-    ObjString *interned = lox_FindStringHashTable(&vm.strings, chars, length, hash);
+/// @brief Interns a string from lox_ReserveString.
+/// @return the string, or the equal string that was already interned. 'string' is freed then.
+ObjString *lox_InternString(VM *vm, ObjString *string)
+{
+    string->hash = lox_HashString(string->chars, string->length);
+    ObjString *interned = lox_FindStringHashTable(&vm->strings, string->chars, string->length, string->hash);
     if (interned != NULL)
     {
-        FREE_ARRAY(char, chars, length + 1);
+        lox_DiscardObject(vm, (Obj *)string);
+        lox_ShadeObject(vm, (Obj *)interned);
         return interned;
     }
 
-    return AllocateString(chars, length, hash);
+    lox_AddEntryHashTable(vm, &vm->strings, string, NIL_VAL);
+    return string;
+}
+
+static ObjString *JoinStrings(VM *vm, ObjString *left, ObjString *right)
+{
+    ObjString *result = lox_ReserveString(vm, left->length + right->length);
+    memcpy(result->chars, left->chars, left->length);
+    memcpy(result->chars + left->length, right->chars, right->length);
+    return lox_InternString(vm, result);
+}
+
+static ObjRope *CreateRope(VM *vm, Obj *left, Obj *right)
+{
+    ObjRope *rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_ROPE);
+    rope->length = TextLength(left) + TextLength(right);
+    rope->left = left;
+    rope->right = right;
+    // Ropes are old, and their strings may be young.
+    lox_RememberObject(vm, &rope->obj);
+    return rope;
+}
+
+/// @brief Joins two strings or ropes, whose lengths add up to at most INT_MAX. Results shorter
+///        than ROPE_MIN_LENGTH are interned strings, and longer ones are ropes.
+Obj *lox_ConcatenateText(VM *vm, Obj *left, Obj *right)
+{
+    int length = TextLength(left) + TextLength(right);
+    // Ropes are never shorter than that, so both are strings.
+    if (length < ROPE_MIN_LENGTH)
+        return (Obj *)JoinStrings(vm, (ObjString *)left, (ObjString *)right);
+
+    if (left->type == OBJ_ROPE && right->type == OBJ_STRING)
+    {
+        ObjRope *rope = (ObjRope *)left;
+        if (rope->right->type == OBJ_STRING && TextLength(rope->right) + TextLength(right) <= ROPE_LEAF_LENGTH)
+        {
+            ObjString *leaf = JoinStrings(vm, (ObjString *)rope->right, (ObjString *)right);
+            return (Obj *)CreateRope(vm, rope->left, (Obj *)leaf);
+        }
+    }
+    return (Obj *)CreateRope(vm, left, right);
+}
+
+/// @brief Copies the characters of a string or a rope to 'dest', without a terminator.
+void lox_CopyText(Obj *text, char *dest)
+{
+    // Ropes can be as deep as they're long. They're filled in from the end, following the right
+    // side and stacking the left, so the usual rope built by appending needs no stack at all.
+    Obj *fixed[32];
+    Obj **pending = fixed;
+    int count = 0;
+    int capacity = 32;
+    char *end = dest + TextLength(text);
+    for (;;)
+    {
+        while (text->type == OBJ_ROPE)
+        {
+            if (count == capacity)
+            {
+                capacity *= 2;
+                Obj **grown = malloc(sizeof(Obj *) * capacity);
+                if (grown == NULL)
+                    exit(1);
+                memcpy(grown, pending, sizeof(Obj *) * count);
+                if (pending != fixed)
+                    free(pending);
+                pending = grown;
+            }
+            pending[count++] = ((ObjRope *)text)->left;
+            text = ((ObjRope *)text)->right;
+        }
+
+        ObjString *string = (ObjString *)text;
+        end -= string->length;
+        memcpy(end, string->chars, string->length);
+        if (count == 0)
+            break;
+        text = pending[--count];
+    }
+    if (pending != fixed)
+        free(pending);
+}
+
+/// @brief Gets the characters of a string or a rope in one place, for natives that need them.
+/// @return the string itself, or the interned string with the characters of the rope.
+ObjString *lox_FlattenText(VM *vm, Value value)
+{
+    if (IS_STRING(value))
+        return AS_STRING(value);
+
+    ObjRope *rope = AS_ROPE(value);
+    ObjString *string = lox_ReserveString(vm, rope->length);
+    lox_CopyText(&rope->obj, string->chars);
+    return lox_InternString(vm, string);
+}
+
+/// @brief Compares strings and ropes by their characters. Interned strings are equal only if
+///        they're the same object, so the characters are only compared when one is a rope.
+///        Any other object is only equal to itself.
+bool lox_TextsEqual(Obj *a, Obj *b)
+{
+    if (a == b)
+        return true;
+    if ((a->type != OBJ_STRING && a->type != OBJ_ROPE) || (b->type != OBJ_STRING && b->type != OBJ_ROPE))
+        return false;
+    if ((a->type == OBJ_STRING && b->type == OBJ_STRING) || TextLength(a) != TextLength(b))
+        return false;
+
+    int length = TextLength(a);
+    char *a_chars = a->type == OBJ_STRING ? ((ObjString *)a)->chars : malloc(length);
+    char *b_chars = b->type == OBJ_STRING ? ((ObjString *)b)->chars : malloc(length);
+    if (a_chars == NULL || b_chars == NULL)
+        exit(1);
+    if (a->type == OBJ_ROPE)
+        lox_CopyText(a, a_chars);
+    if (b->type == OBJ_ROPE)
+        lox_CopyText(b, b_chars);
+
+    bool equal = memcmp(a_chars, b_chars, length) == 0;
+    if (a->type == OBJ_ROPE)
+        free(a_chars);
+    if (b->type == OBJ_ROPE)
+        free(b_chars);
+    return equal;
+}
+
+static void PrintRope(ObjRope *rope)
+{
+    char *chars = malloc(rope->length + 1);
+    if (chars == NULL)
+        exit(1);
+    lox_CopyText(&rope->obj, chars);
+    chars[rope->length] = '\0';
+    printf("%s", chars);
+    free(chars);
 }
 
 static void PrintFunction(ObjFunction *function)
@@ -123,5 +303,11 @@ void lox_PrintObject(Value value)
     case OBJ_NATIVE:
         printf("<native fn>");
         break;
+    case OBJ_FIBER:
+        printf("<fiber>");
+        break;
+    case OBJ_ROPE:
+        PrintRope(AS_ROPE(value));
+        break;
     }
 }
@@ -0,0 +1,138 @@
+#include "core/slab.h"
+
+#ifdef USE_SLABS
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "vm/vm.h"
+
+// The free lists and the mapped regions of a VM(see vm->slabs). Nothing is shared between VMs,
+// so a block must be freed by the VM that allocated it.
+typedef struct SlabHeap
+{
+    // Freed blocks of each class, linked through their first word.
+    void *free[SLAB_CLASSES];
+    // The part of each class's current run that hasn't been handed out yet.
+    char *run_top[SLAB_CLASSES];
+    char *run_end[SLAB_CLASSES];
+    // The part of the newest region that isn't a run yet.
+    char *region_top;
+    char *region_end;
+    // Every region, unmapped when the VM is freed.
+    char **regions;
+    int region_count;
+    int region_capacity;
+} SlabHeap;
+
+static SlabHeap *GetSlabHeap(VM *vm);
+static void *AllocateRun(SlabHeap *heap, int size_class);
+static char *MapRegion(void);
+
+/// @brief Allocates 'size' bytes, at most SLAB_MAX_SIZE, from the free list of its class.
+///        Blocks are aligned to SLAB_GRANULE.
+void *lox_AllocateSlab(VM *vm, size_t size)
+{
+    SlabHeap *heap = GetSlabHeap(vm);
+    int size_class = (int)((size - 1) / SLAB_GRANULE);
+    void *block = heap->free[size_class];
+    if (block != NULL)
+    {
+        heap->free[size_class] = *(void **)block;
+        return block;
+    }
+
+    size_t block_size = (size_t)(size_class + 1) * SLAB_GRANULE;
+    if (block_size > (size_t)(heap->run_end[size_class] - heap->run_top[size_class]))
+        return AllocateRun(heap, size_class);
+    block = heap->run_top[size_class];
+    heap->run_top[size_class] += block_size;
+    return block;
+}
+
+/// @brief Returns a block from lox_AllocateSlab to the free list of its class.
+/// @param size the block was allocated with.
+void lox_FreeSlab(VM *vm, void *pointer, size_t size)
+{
+    SlabHeap *heap = vm->slabs;
+    int size_class = (int)((size - 1) / SLAB_GRANULE);
+    *(void **)pointer = heap->free[size_class];
+    heap->free[size_class] = pointer;
+}
+
+/// @brief Unmaps every region. Called last when freeing the VM, since nothing allocated from
+///        them may be used afterwards.
+void lox_FreeSlabs(VM *vm)
+{
+    SlabHeap *heap = vm->slabs;
+    if (heap == NULL)
+        return;
+
+    for (int i = 0; i < heap->region_count; i++)
+        munmap(heap->regions[i], SLAB_REGION_SIZE);
+    free(heap->regions);
+    free(heap);
+    vm->slabs = NULL;
+}
+
+SlabHeap *GetSlabHeap(VM *vm)
+{
+    if (vm->slabs == NULL)
+    {
+        vm->slabs = calloc(1, sizeof(SlabHeap));
+        if (vm->slabs == NULL)
+            exit(1);
+    }
+    return vm->slabs;
+}
+
+/// @brief Starts a new run for a class whose free list and run are both empty, and allocates
+///        the first block from it. The rest of the old run, smaller than a block, is dropped.
+void *AllocateRun(SlabHeap *heap, int size_class)
+{
+    if (heap->region_top == heap->region_end)
+    {
+        if (heap->region_count == heap->region_capacity)
+        {
+            heap->region_capacity = heap->region_capacity < 8 ? 8 : heap->region_capacity * 2;
+            heap->regions = realloc(heap->regions, sizeof(char *) * heap->region_capacity);
+            if (heap->regions == NULL)
+                exit(1);
+        }
+        char *region = MapRegion();
+        heap->regions[heap->region_count++] = region;
+        heap->region_top = region;
+        heap->region_end = region + SLAB_REGION_SIZE;
+    }
+
+    char *run = heap->region_top;
+    heap->region_top += SLAB_RUN_SIZE;
+    size_t block_size = (size_t)(size_class + 1) * SLAB_GRANULE;
+    heap->run_top[size_class] = run + block_size;
+    heap->run_end[size_class] = run + SLAB_RUN_SIZE;
+    return run;
+}
+
+/// @brief Maps a region aligned to SLAB_REGION_SIZE, by mapping twice as much and unmapping
+///        what's around it. Pages are only backed by memory once they're touched.
+char *MapRegion(void)
+{
+    size_t length = 2 * SLAB_REGION_SIZE;
+    char *mapping = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+        exit(1);
+
+    char *region = (char *)(((uintptr_t)mapping + SLAB_REGION_SIZE - 1) & ~(uintptr_t)(SLAB_REGION_SIZE - 1));
+    if (region > mapping)
+        munmap(mapping, region - mapping);
+    char *end = mapping + length;
+    if (end > region + SLAB_REGION_SIZE)
+        munmap(region + SLAB_REGION_SIZE, end - (region + SLAB_REGION_SIZE));
+#if defined(SLAB_HUGE_PAGES) && defined(MADV_HUGEPAGE)
+    madvise(region, SLAB_REGION_SIZE, MADV_HUGEPAGE);
+#endif
+    return region;
+}
+
+#endif
@@ -13,46 +13,57 @@ void lox_InitValueArray(ValueArray *array)
     array->values = NULL;
 }
 
-void lox_WriteValueArray(ValueArray *array, Value value)
+void lox_WriteValueArray(VM *vm, ValueArray *array, Value value)
 {
     if (array->capacity < array->count + 1)
     {
         size_t old_capacity = array->capacity;
         array->capacity = GROW_CAPACITY(old_capacity);
-        array->values = GROW_ARRAY(Value, array->values, old_capacity, array->capacity);
+        array->values = GROW_ARRAY(vm, Value, array->values, old_capacity, array->capacity);
     }
 
     array->values[array->count] = value;
     array->count++;
 }
 
-void lox_FreeValueArray(ValueArray *array)
+void lox_FreeValueArray(VM *vm, ValueArray *array)
 {
-    FREE_ARRAY(Value, array->values, array->capacity);
+    FREE_ARRAY(vm, Value, array->values, array->capacity);
     lox_InitValueArray(array);
 }
 
 void lox_PrintValue(Value value)
 {
-    switch (value.type)
+    if (IS_BOOL(value))
     {
-    case VAL_BOOL:
         printf(AS_BOOL(value) ? "true" : "false");
-        break;
-    case VAL_NIL:
+    }
+    else if (IS_NIL(value))
+    {
         printf("nil");
-        break;
-    case VAL_NUMBER:
+    }
+    else if (IS_NUMBER(value))
+    {
         printf("%g", AS_NUMBER(value));
-        break;
-    case VAL_OBJ:
+    }
+    else if (IS_OBJ(value))
+    {
         lox_PrintObject(value);
-        break;
     }
 }
 
 bool lox_ValuesEqual(Value a, Value b)
 {
+#ifdef NAN_BOXING
+    // Compare numbers as doubles so that NaN != NaN and 0 == -0. Everything else is
+    // equal only if the bits are.
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    if (a == b)
+        return true;
+    // Strings are interned, but ropes aren't(see ObjRope).
+    return IS_OBJ(a) && IS_OBJ(b) && lox_TextsEqual(AS_OBJ(a), AS_OBJ(b));
+#else
     if (a.type != b.type)
         return false;
     switch (a.type)
@@ -64,8 +75,9 @@ bool lox_ValuesEqual(Value a, Value b)
     case VAL_NUMBER:
         return AS_NUMBER(a) == AS_NUMBER(b);
     case VAL_OBJ:
-        return AS_OBJ(a) == AS_OBJ(b);
+        return lox_TextsEqual(AS_OBJ(a), AS_OBJ(b));
     default:
         return false; // Unreachable.
     }
+#endif
 }
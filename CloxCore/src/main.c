@@ -6,74 +6,186 @@
 #include "core/chunk.h"
 #include "core/debug.h"
 #include "vm/vm.h"
+#include "core/memory.h"
+#include "vm/pool.h"
+#include "vm/scheduler.h"
+#include "vm/profiler.h"
+#include "vm/trace.h"
 #include "common/string_helper.h"
 
-static int Run(const char *source);
-static int RunFile(const char *path);
-static int RunInteractively();
+static int Run(VM *vm, const char *source);
+static int RunFile(VM *vm, const char *path);
+static int RunInteractively(VM *vm);
+static int RunPool(VM *vm, const char *path, const char **input_paths, int input_count, int worker_count);
+static int RunTasks(VM *vm, const char *path, int thread_count);
+static char *ReadFile(const char *path);
 static void ResetTerminal();
 static void DisplayHelp();
 static void DisplayHeader();
-static void TryParseConsoleCommand(const char *input);
-static int TryParseFileCommand(const char *input);
+static void TryParseConsoleCommand(VM *vm, const char *input);
+static int TryParseFileCommand(VM *vm, const char *input);
 static char *GetFileName(const char *input);
 
 int main(int argc, const char **argv)
 {
-    lox_InitVM();
+    VM vm;
+    lox_InitVM(&vm);
 
-    if (argc == 1)
+    // Options come before the path.
+    int worker_count = 0;
+    int thread_count = 0;
+    long long max_instructions = 0;
+    long long max_memory = 0;
+    bool gc_stats = false;
+    bool memory_stats = false;
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++)
     {
-        RunInteractively();
+        if (strcmp(argv[arg], "--trace-loops") == 0)
+        {
+#ifdef USE_JIT
+            vm.trace_loops = true;
+#else
+            fprintf(stderr, "Warning: --trace-loops needs the JIT, which isn't available in this build.\n");
+#endif
+        }
+        else if (strncmp(argv[arg], "--max-frames=", 13) == 0)
+        {
+            int frames_max = atoi(argv[arg] + 13);
+            if (frames_max <= 0)
+            {
+                fprintf(stderr, "Invalid frame limit '%s'.\n", argv[arg] + 13);
+                exit(64);
+            }
+            vm.frames_max = frames_max;
+        }
+        else if (strncmp(argv[arg], "--max-instructions=", 19) == 0)
+        {
+            max_instructions = atoll(argv[arg] + 19);
+            if (max_instructions <= 0)
+            {
+                fprintf(stderr, "Invalid instruction limit '%s'.\n", argv[arg] + 19);
+                exit(64);
+            }
+        }
+        else if (strncmp(argv[arg], "--max-memory=", 13) == 0)
+        {
+            max_memory = atoll(argv[arg] + 13);
+            if (max_memory <= 0)
+            {
+                fprintf(stderr, "Invalid memory limit '%s'.\n", argv[arg] + 13);
+                exit(64);
+            }
+        }
+        else if (strncmp(argv[arg], "--gc-quantum=", 13) == 0)
+        {
+            vm.gc_quantum = atoi(argv[arg] + 13);
+            if (vm.gc_quantum <= 0)
+            {
+                fprintf(stderr, "Invalid collection quantum '%s'.\n", argv[arg] + 13);
+                exit(64);
+            }
+        }
+        else if (strcmp(argv[arg], "--gc-concurrent") == 0)
+        {
+            vm.gc_concurrent = true;
+        }
+        else if (strcmp(argv[arg], "--gc-stats") == 0)
+        {
+            gc_stats = true;
+        }
+        else if (strcmp(argv[arg], "--memory-stats") == 0)
+        {
+            memory_stats = true;
+        }
+        else if (strncmp(argv[arg], "--workers=", 10) == 0)
+        {
+            worker_count = atoi(argv[arg] + 10);
+            if (worker_count <= 0 || worker_count > POOL_MAX_WORKERS)
+            {
+                fprintf(stderr, "Invalid worker count '%s'.\n", argv[arg] + 10);
+                exit(64);
+            }
+        }
+        else if (strncmp(argv[arg], "--threads=", 10) == 0)
+        {
+            thread_count = atoi(argv[arg] + 10);
+            if (thread_count <= 0 || thread_count > SCHEDULER_MAX_THREADS)
+            {
+                fprintf(stderr, "Invalid thread count '%s'.\n", argv[arg] + 10);
+                exit(64);
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option '%s'.\n", argv[arg]);
+            exit(64);
+        }
     }
-    else if (argc == 2)
+
+    lox_SetLimits(&vm, max_instructions, (size_t)max_memory);
+
+    if (arg == argc)
+    {
+        RunInteractively(&vm);
+    }
+    else if (arg == argc - 1 && worker_count == 0 && thread_count == 0)
+    {
+        RunFile(&vm, argv[arg]);
+    }
+    else if (arg == argc - 1 && worker_count == 0)
     {
-        RunFile(argv[1]);
+        RunTasks(&vm, argv[arg], thread_count);
+    }
+    else if (worker_count > 0 && thread_count == 0)
+    {
+        RunPool(&vm, argv[arg], argv + arg + 1, argc - arg - 1, worker_count);
     }
     else
     {
-        fprintf(stderr, "Usage: lox [path]\n");
+        fprintf(stderr, "Usage: lox [--trace-loops] [--max-frames=N] [--max-instructions=N] [--max-memory=N]\n");
+        fprintf(stderr, "           [--gc-quantum=N] [--gc-concurrent] [--gc-stats] [--memory-stats] [path]\n");
+        fprintf(stderr, "       lox --workers=N [--max-frames=N] path [inputs...]\n");
+        fprintf(stderr, "       lox --threads=N [--max-frames=N] path\n");
         exit(64);
     }
 
-    lox_FreeVM();
+#ifdef DEBUG_PROFILE_NGRAMS
+    lox_PrintProfile();
+#endif
+#ifdef USE_JIT
+    if (vm.trace_loops)
+        lox_PrintTraceStats(&vm);
+#endif
+    if (gc_stats)
+        lox_PrintGcStats(&vm);
+    if (memory_stats)
+        lox_PrintMemoryStats(&vm);
+
+    lox_FreeVM(&vm);
     return 0;
 }
 
-int Run(const char *source)
+int Run(VM *vm, const char *source)
 {
-    lox_InterpretSource(source);
+    lox_InterpretSource(vm, source);
     return LOX_EXIT_SUCCESS;
 }
 
-int RunFile(const char *path)
+int RunFile(VM *vm, const char *path)
 {
-    FILE *fp;
-    if ((fp = fopen(path, "r")) == NULL)
-    {
-        printf("Error: Can't open file '%s'.\n", path);
+    char *source = ReadFile(path);
+    if (source == NULL)
         return LOX_EXIT_FAILURE;
-    }
-
-    // find size.
-    fseek(fp, 0, SEEK_END);
-    size_t size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    // read file into char-buffer.
-    // Add 1 to allow null-terminating character.
-    char fb[size + 1];
-    memset(fb, 0, size + 1);
-    fread(fb, sizeof(fb), 1, fp);
 
     // interpret file.
-    Run(fb);
+    Run(vm, source);
 
-    fclose(fp);
+    free(source);
     return LOX_EXIT_SUCCESS;
 }
 
-int RunInteractively()
+int RunInteractively(VM *vm)
 {
     char *input = calloc(1, 1), buffer[100];
     ResetTerminal();
@@ -96,17 +208,103 @@ int RunInteractively()
         }
         else if (input[0] == '.')
         {
-            TryParseConsoleCommand(input);
+            TryParseConsoleCommand(vm, input);
         }
         else
         {
-            Run(input);
+            Run(vm, input);
             printf("> ");
         }
     }
     return LOX_EXIT_SUCCESS;
 }
 
+/// @brief Compiles the script at 'path' once and runs its function 'main' on every input file,
+///        spread over 'worker_count' threads. 'main' is called with the contents of the file.
+int RunPool(VM *vm, const char *path, const char **input_paths, int input_count, int worker_count)
+{
+    char *source = ReadFile(path);
+    if (source == NULL)
+        return LOX_EXIT_FAILURE;
+
+    ObjFunction *script = lox_CompileSource(vm, source);
+    free(source);
+    if (script == NULL)
+        return LOX_EXIT_FAILURE;
+
+    const char **inputs = calloc(input_count + 1, sizeof(char *));
+    int result = LOX_EXIT_SUCCESS;
+    for (int i = 0; i < input_count && result == LOX_EXIT_SUCCESS; i++)
+    {
+        if ((inputs[i] = ReadFile(input_paths[i])) == NULL)
+            result = LOX_EXIT_FAILURE;
+    }
+
+    if (result == LOX_EXIT_SUCCESS)
+    {
+        int failed = lox_RunPool(vm, script, "main", inputs, input_count, worker_count);
+        if (failed != 0)
+        {
+            fprintf(stderr, failed < 0 ? "Error: Can't start workers.\n" : "%d input(s) failed.\n", failed);
+            result = LOX_EXIT_FAILURE;
+        }
+    }
+
+    for (int i = 0; i < input_count; i++)
+        free((char *)inputs[i]);
+    free(inputs);
+    return result;
+}
+
+/// @brief Runs the script at 'path', and then calls its function 'main' as the root task of a
+///        scheduler with 'thread_count' threads(see vm/scheduler.h).
+int RunTasks(VM *vm, const char *path, int thread_count)
+{
+    char *source = ReadFile(path);
+    if (source == NULL)
+        return LOX_EXIT_FAILURE;
+
+    ObjFunction *script = lox_CompileSource(vm, source);
+    free(source);
+    if (script == NULL || lox_CallFunction(vm, OBJ_VAL(script), 0, NULL, NULL) != INTERPRET_OK)
+        return LOX_EXIT_FAILURE;
+
+    Value entry;
+    if (!lox_GetGlobal(vm, "main", &entry))
+    {
+        fprintf(stderr, "Entry function 'main' is not defined.\n");
+        return LOX_EXIT_FAILURE;
+    }
+    if (lox_RunTasks(vm, entry, thread_count, NULL) != INTERPRET_OK)
+        return LOX_EXIT_FAILURE;
+    return LOX_EXIT_SUCCESS;
+}
+
+/// @brief Reads the file at 'path' into a null-terminated buffer, which the caller frees.
+/// @return the contents, or NULL if the file can't be opened.
+char *ReadFile(const char *path)
+{
+    FILE *fp;
+    if ((fp = fopen(path, "r")) == NULL)
+    {
+        printf("Error: Can't open file '%s'.\n", path);
+        return NULL;
+    }
+
+    // find size.
+    fseek(fp, 0, SEEK_END);
+    size_t size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    // read file into char-buffer.
+    // Add 1 to allow null-terminating character.
+    char *fb = calloc(size + 1, 1);
+    fread(fb, size, 1, fp);
+
+    fclose(fp);
+    return fb;
+}
+
 void ResetTerminal()
 {
     DisplayHeader();
@@ -133,11 +331,11 @@ void DisplayHeader()
     printf("Enter '.help' to see a list of commands.\n\n");
 }
 
-void TryParseConsoleCommand(const char *input)
+void TryParseConsoleCommand(VM *vm, const char *input)
 {
     if (strstr(input, ".file"))
     {
-        if (TryParseFileCommand(input))
+        if (TryParseFileCommand(vm, input))
         {
             printf("Invalid .file command. Type '.help' for a list of commands.\n");
         }
@@ -151,14 +349,14 @@ void TryParseConsoleCommand(const char *input)
     printf("> ");
 }
 
-int TryParseFileCommand(const char *input)
+int TryParseFileCommand(VM *vm, const char *input)
 {
     const char *filename = GetFileName(input);
     if (filename == NULL)
     {
         return LOX_EXIT_FAILURE;
     }
-    RunFile(filename);
+    RunFile(vm, filename);
     return LOX_EXIT_SUCCESS;
 }
 
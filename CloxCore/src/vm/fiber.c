@@ -0,0 +1,209 @@
+#include "vm/fiber.h"
+#include "core/memory.h"
+#include "vm/io.h"
+#include "vm/jit.h"
+#include "vm/trace.h"
+
+static void SaveStacks(VM *vm, ObjFiber *fiber);
+static void LoadStacks(VM *vm, ObjFiber *fiber);
+static void FreeStacks(VM *vm, ObjFiber *fiber);
+
+bool lox_FiberNative(VM *vm, int arg_count, Value *args, Value *result)
+{
+    ObjFunction *function = NULL;
+    if (arg_count == 1 && IS_CLOSURE(args[0]))
+        function = AS_CLOSURE(args[0])->function;
+    else if (arg_count == 1 && IS_FUNCTION(args[0]))
+        function = AS_FUNCTION(args[0]);
+
+    if (function == NULL || function->arity > 1)
+    {
+        lox_RuntimeError(vm, "Expected a function taking at most one argument.");
+        return false;
+    }
+
+    *result = OBJ_VAL(lox_CreateFiber(vm, args[0]));
+    return true;
+}
+
+bool lox_ResumeNative(VM *vm, int arg_count, Value *args, Value *result)
+{
+    if ((arg_count != 1 && arg_count != 2) || !IS_FIBER(args[0]))
+    {
+        lox_RuntimeError(vm, "Expected a fiber and an optional value.");
+        return false;
+    }
+
+    ObjFiber *fiber = AS_FIBER(args[0]);
+    if (fiber->spawned)
+    {
+        lox_RuntimeError(vm, "Can't resume a spawned fiber.");
+        return false;
+    }
+    if (fiber->state != FIBER_NEW && fiber->state != FIBER_SUSPENDED)
+    {
+        lox_RuntimeError(vm, fiber->state == FIBER_DONE ? "Can't resume a finished fiber."
+                                                        : "Can't resume a running fiber.");
+        return false;
+    }
+
+    fiber->resumer = vm->fiber;
+    vm->transfer_to = fiber;
+    *result = arg_count == 2 ? args[1] : NIL_VAL;
+    return true;
+}
+
+bool lox_YieldNative(VM *vm, int arg_count, Value *args, Value *result)
+{
+    if (arg_count > 1)
+    {
+        lox_RuntimeError(vm, "Expected an optional value.");
+        return false;
+    }
+
+    ObjFiber *fiber = vm->fiber;
+    if (fiber == &vm->main_fiber)
+    {
+        lox_RuntimeError(vm, "Can't yield from the main fiber.");
+        return false;
+    }
+    if (fiber->spawned)
+    {
+        lox_RuntimeError(vm, "Can't yield from a spawned fiber.");
+        return false;
+    }
+
+    fiber->state = FIBER_SUSPENDED;
+    vm->transfer_to = fiber->resumer;
+    fiber->resumer = NULL;
+    *result = arg_count == 1 ? args[0] : NIL_VAL;
+    return true;
+}
+
+bool lox_IsDoneNative(VM *vm, int arg_count, Value *args, Value *result)
+{
+    if (arg_count != 1 || !IS_FIBER(args[0]))
+    {
+        lox_RuntimeError(vm, "Expected a fiber.");
+        return false;
+    }
+
+    *result = BOOL_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
+    return true;
+}
+
+/// @brief Switches to vm->transfer_to, after a native resumed or yielded. The native's call has
+///        been popped, so the fiber switched from continues right after it when it's resumed.
+/// @param value is passed to the fiber's function when it starts, and otherwise pushed as the
+///        result of the call that switched away from it.
+/// @return false on a runtime error.
+bool lox_TransferFiber(VM *vm, Value value)
+{
+    ObjFiber *from = vm->fiber;
+    ObjFiber *to = vm->transfer_to;
+    vm->transfer_to = NULL;
+
+    SaveStacks(vm, from);
+    LoadStacks(vm, to);
+    vm->fiber = to;
+    if (from->state == FIBER_DONE)
+        FreeStacks(vm, from);
+#ifdef USE_JIT
+    // Traces are recorded in a single frame, which the switch has left.
+    lox_TraceAbort(vm);
+#endif
+
+    if (to->state != FIBER_NEW)
+    {
+        to->state = FIBER_RUNNING;
+        lox_PushStack(vm, value);
+        return true;
+    }
+
+    to->state = FIBER_RUNNING;
+    Value function = vm->stack[0];
+    int arity = IS_CLOSURE(function) ? AS_CLOSURE(function)->function->arity
+                                     : AS_FUNCTION(function)->arity;
+    if (arity == 1)
+        lox_PushStack(vm, value);
+    return lox_CallValue(vm, function, arity);
+}
+
+/// @brief Ends the running fiber after its function returned, and returns 'result' from the
+///        resume that ran it. A spawned fiber switches to the next fiber the event loop runs.
+bool lox_FinishFiber(VM *vm, Value result)
+{
+    ObjFiber *fiber = vm->fiber;
+    fiber->state = FIBER_DONE;
+#ifdef USE_EPOLL
+    // Fibers spawned for the event loop have no resumer to return to. Tasks do(see vm/scheduler.h).
+    if (fiber->spawned && fiber->resumer == NULL)
+        return lox_FinishSpawnedFiber(vm);
+#endif
+    vm->transfer_to = fiber->resumer;
+    fiber->resumer = NULL;
+    return lox_TransferFiber(vm, result);
+}
+
+/// @brief Ends every fiber waiting on the running one and switches back to the main fiber.
+///        Fibers parked on I/O or waiting to be run by the event loop end too.
+///        Called when a runtime error unwinds the stacks.
+void lox_UnwindFibers(VM *vm)
+{
+    vm->transfer_to = NULL;
+#ifdef USE_EPOLL
+    lox_CancelIo(vm);
+#endif
+    vm->main_fiber.state = FIBER_RUNNING;
+    ObjFiber *fiber = vm->fiber;
+    if (fiber == &vm->main_fiber)
+        return;
+
+    SaveStacks(vm, fiber);
+    // The chain of resumers ends at the main fiber, or at a spawned fiber.
+    while (fiber != NULL && fiber != &vm->main_fiber)
+    {
+        ObjFiber *resumer = fiber->resumer;
+        fiber->state = FIBER_DONE;
+        fiber->resumer = NULL;
+        FreeStacks(vm, fiber);
+        fiber = resumer;
+    }
+    LoadStacks(vm, &vm->main_fiber);
+    vm->fiber = &vm->main_fiber;
+}
+
+void SaveStacks(VM *vm, ObjFiber *fiber)
+{
+    fiber->frames = vm->frames;
+    fiber->frame_count = vm->frame_count;
+    fiber->frame_capacity = vm->frame_capacity;
+    fiber->stack = vm->stack;
+    fiber->stack_top = vm->stack_top;
+    fiber->stack_capacity = vm->stack_capacity;
+    // The stacks leave the roots, and may hold young objects.
+    lox_RememberObject(vm, &fiber->obj);
+}
+
+void LoadStacks(VM *vm, ObjFiber *fiber)
+{
+    vm->frames = fiber->frames;
+    vm->frame_count = fiber->frame_count;
+    vm->frame_capacity = fiber->frame_capacity;
+    vm->stack = fiber->stack;
+    vm->stack_top = fiber->stack_top;
+    vm->stack_capacity = fiber->stack_capacity;
+}
+
+/// @brief Releases the stacks of a finished fiber. It can't run again.
+void FreeStacks(VM *vm, ObjFiber *fiber)
+{
+    FREE_ARRAY(vm, CallFrame, fiber->frames, fiber->frame_capacity);
+    FREE_ARRAY(vm, Value, fiber->stack, fiber->stack_capacity);
+    fiber->frames = NULL;
+    fiber->frame_count = 0;
+    fiber->frame_capacity = 0;
+    fiber->stack = NULL;
+    fiber->stack_top = NULL;
+    fiber->stack_capacity = 0;
+}
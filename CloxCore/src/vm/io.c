@@ -0,0 +1,699 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm/io.h"
+
+#ifdef USE_EPOLL
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "core/memory.h"
+#include "vm/fiber.h"
+
+typedef enum
+{
+    IO_READ,
+    IO_WRITE,
+    IO_ACCEPT,
+    IO_CONNECT,
+} IoKind;
+
+typedef enum
+{
+    IO_DONE,
+    // The descriptor isn't ready. Nothing was lost, the operation can be tried again.
+    IO_BLOCKED,
+    // Failed with errno.
+    IO_FAILED,
+} IoStatus;
+
+// An operation on a descriptor, and the fiber it's parked for.
+typedef struct
+{
+    ObjFiber *fiber;
+    IoKind kind;
+    int fd;
+    // Bytes to read, or bytes of 'data' written so far.
+    int count;
+    // The string being written, or the path being connected to.
+    ObjString *data;
+} IoWait;
+
+typedef struct
+{
+    ObjFiber *fiber;
+    // Passed to the fiber's function when it starts, and otherwise returned from the native it
+    // waited in.
+    Value value;
+} ReadyFiber;
+
+struct IoLoop
+{
+    int epoll_fd;
+    // Parked operations, indexed by descriptor. A descriptor has at most one.
+    IoWait **waits;
+    int wait_capacity;
+    int wait_count;
+    // Write ends of pipes plus one, indexed by read end. Zero if there's none.
+    int *writers;
+    int writer_capacity;
+    // Fibers that can run, in the order they became ready.
+    ReadyFiber *ready;
+    int ready_start;
+    int ready_count;
+    int ready_capacity;
+    // Spawned fibers that haven't finished, and the fiber waiting for them to.
+    int spawned;
+    ObjFiber *joiner;
+};
+
+static IoLoop *GetLoop(VM *vm);
+static bool GetDescriptor(Value value, int *fd);
+static bool Start(VM *vm, IoWait *wait, uint32_t events, Value *result);
+static IoStatus Perform(VM *vm, IoWait *wait, Value *result);
+static bool Park(VM *vm, IoLoop *io, IoWait *wait, uint32_t events, Value *result);
+static bool Schedule(VM *vm, IoLoop *io, Value *result);
+static bool Poll(VM *vm, IoLoop *io);
+static void MakeReady(IoLoop *io, ObjFiber *fiber, Value value);
+static bool MakeAddress(VM *vm, ObjString *path, struct sockaddr_un *address);
+static void *GrowTable(void *table, int *capacity, int index, size_t size);
+
+bool lox_SpawnNative(VM *vm, int arg_count, Value *args, Value *result)
+{
+    ObjFunction *function = NULL;
+    if ((arg_count == 1 || arg_count == 2) && IS_CLOSURE(args[0]))
+        function = AS_CLOSURE(args[0])->function;
+    else if ((arg_count == 1 || arg_count == 2) && IS_FUNCTION(args[0]))
+        function = AS_FUNCTION(args[0]);
+
+    if (function == NULL || function->arity > 1)
+    {
+        lox_RuntimeError(vm, "Expected a function taking at most one argument, and an optional value.");
+        return false;
+    }
+
+    IoLoop *io = GetLoop(vm);
+    ObjFiber *fiber = lox_CreateFiber(vm, args[0]);
+    fiber->spawned = true;
+    io->spawned++;
+    MakeReady(io, fiber, arg_count == 2 ? args[1] : NIL_VAL);
+    *result = OBJ_VAL(fiber);
+    return true;
+}
+
+bool lox_WaitNative(VM *vm, int arg_count, Value *args, Value *result)
+{
+    if (arg_count != 0)
+    {
+        lox_RuntimeError(vm, "Expected no arguments.");
+        return false;
+    }
+
+    IoLoop *io = GetLoop(vm);
+    *result = NIL_VAL;
+    if (io->spawned == 0)
+        return true;
+
+    // A spawned fiber, or one resumed by it, would wait for itself.
+    ObjFiber *root = vm->fiber;
+    while (root->resumer != NULL)
+        root = root->resumer;
+    if (root->spawned)
+    {
+        lox_RuntimeError(vm, "Can't wait for spawned fibers from inside one.");
+        return false;
+    }
+
+    vm->fiber->state = FIBER_WAITING;
+    io->joiner = vm->fiber;
+    return Schedule(vm, io, result);
+}
+
+bool lox_PipeNative(VM *vm, int arg_count, Value *args, Value *result)
+{
+    if (arg_count != 0)
+    {
+        lox_RuntimeError(vm, "Expected no arguments.");
+        return false;
+    }
+
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1)
+    {
+        lox_RuntimeError(vm, "Can't create a pipe: %s.", strerror(errno));
+        return false;
+    }
+
+    IoLoop *io = GetLoop(vm);
+    io->writers = GrowTable(io->writers, &io->writer_capacity, fds[0], sizeof(int));
+    io->writers[fds[0]] = fds[1] + 1;
+    *result = NUMBER_VAL(fds[0]);
+    return true;
+}
+
+bool lox_PipeWriterNative(VM *vm, int arg_count, Value *args, Value *result)
+{
+    int fd;
+    if (arg_count != 1 || !GetDescriptor(args[0], &fd))
+    {
+        lox_RuntimeError(vm, "Expected a descriptor.");
+        return false;
+    }
+
+    IoLoop *io = GetLoop(vm);
+    if (fd >= io->writer_capacity || io->writers[fd] == 0)
+    {
+        lox_RuntimeError(vm, "Descriptor %d isn't the read end of a pipe.", fd);
+        return false;
+    }
+
+    *result = NUMBER_VAL(io->writers[fd] - 1);
+    return true;
+}
+
+bool lox_OpenNative(VM *vm, int arg_count, Value *args, Value *result)
+{
+    if (arg_count != 2 || !IS_TEXT(args[0]) || !IS_TEXT(args[1]))
+    {
+        lox_RuntimeError(vm, "Expected a path and a mode.");
+        return false;
+    }
+
+    const char *path = lox_FlattenText(vm, args[0])->chars;
+    const char *mode = lox_FlattenText(vm, args[1])->chars;
+    int flags;
+    if (strcmp(mode, "r") == 0)
+        flags = O_RDONLY;
+    else if (strcmp(mode, "w") == 0)
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    else if (strcmp(mode, "a") == 0)
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    else
+    {
+        lox_RuntimeError(vm, "Mode must be \"r\", \"w\" or \"a\".");
+        return false;
+    }
+
+    int fd = open(path, flags | O_NONBLOCK | O_CLOEXEC, 0666);
+    if (fd == -1)
+    {
+        lox_RuntimeError(vm, "Can't open '%s': %s.", path, strerror(errno));
+        return false;
+    }
+
+    *result = NUMBER_VAL(fd);
+    return true;
+}
+
+bool lox_ListenNative(VM *vm, int arg_count, Value *args, Value *result)
+{
+    struct sockaddr_un address;
+    if (arg_count != 1 || !IS_TEXT(args[0]))
+    {
+        lox_RuntimeError(vm, "Expected a path.");
+        return false;
+    }
+    ObjString *path = lox_FlattenText(vm, args[0]);
+    if (!MakeAddress(vm, path, &address))
+        return false;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        lox_RuntimeError(vm, "Can't create a socket: %s.", strerror(errno));
+        return false;
+    }
+
+    // A socket left behind by an earlier run would make bind fail.
+    unlink(address.sun_path);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(fd, SOMAXCONN) == -1)
+    {
+        lox_RuntimeError(vm, "Can't listen at '%s': %s.", address.sun_path, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    *result = NUMBER_VAL(fd);
+    return true;
+}
+
+bool lox_AcceptNative(VM *vm, int arg_count, Value *args, Value *result)
+{
+    int fd;
+    if (arg_count != 1 || !GetDescriptor(args[0], &fd))
+    {
+        lox_RuntimeError(vm, "Expected a descriptor.");
+        return false;
+    }
+
+    IoWait wait = {.kind = IO_ACCEPT, .fd = fd};
+    return Start(vm, &wait, EPOLLIN, result);
+}
+
+bool lox_ConnectNative(VM *vm, int arg_count, Value *args, Value *result)
+{
+    struct sockaddr_un address;
+    if (arg_count != 1 || !IS_TEXT(args[0]))
+    {
+        lox_RuntimeError(vm, "Expected a path.");
+        return false;
+    }
+    ObjString *path = lox_FlattenText(vm, args[0]);
+    if (!MakeAddress(vm, path, &address))
+        return false;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        lox_RuntimeError(vm, "Can't create a socket: %s.", strerror(errno));
+        return false;
+    }
+
+    IoWait wait = {.kind = IO_CONNECT, .fd = fd, .data = path};
+    if (!Start(vm, &wait, EPOLLOUT, result))
+    {
+        close(fd);
+        return false;
+    }
+    return true;
+}
+
+bool lox_ReadNative(VM *vm, int arg_count, Value *args, Value *result)
+{
+    int fd;
+    if (arg_count != 2 || !GetDescriptor(args[0], &fd) || !IS_NUMBER(args[1]) ||
+        AS_NUMBER(args[1]) < 1 || AS_NUMBER(args[1]) > INT32_MAX)
+    {
+        lox_RuntimeError(vm, "Expected a descriptor and a positive byte count.");
+        return false;
+    }
+
+    IoWait wait = {.kind = IO_READ, .fd = fd, .count = (int)AS_NUMBER(args[1])};
+    return Start(vm, &wait, EPOLLIN, result);
+}
+
+bool lox_WriteNative(VM *vm, int arg_count, Value *args, Value *result)
+{
+    int fd;
+    if (arg_count != 2 || !GetDescriptor(args[0], &fd) || !IS_TEXT(args[1]))
+    {
+        lox_RuntimeError(vm, "Expected a descriptor and a string.");
+        return false;
+    }
+
+    // A report built up by appending is a rope, which is flattened once to be written.
+    IoWait wait = {.kind = IO_WRITE, .fd = fd, .data = lox_FlattenText(vm, args[1])};
+    return Start(vm, &wait, EPOLLOUT, result);
+}
+
+bool lox_CloseNative(VM *vm, int arg_count, Value *args, Value *result)
+{
+    int fd;
+    if (arg_count != 1 || !GetDescriptor(args[0], &fd))
+    {
+        lox_RuntimeError(vm, "Expected a descriptor.");
+        return false;
+    }
+
+    IoLoop *io = GetLoop(vm);
+    if (fd < io->wait_capacity && io->waits[fd] != NULL)
+    {
+        lox_RuntimeError(vm, "Can't close descriptor %d while a fiber is waiting on it.", fd);
+        return false;
+    }
+    if (close(fd) == -1)
+    {
+        lox_RuntimeError(vm, "Can't close descriptor %d: %s.", fd, strerror(errno));
+        return false;
+    }
+
+    if (fd < io->writer_capacity)
+        io->writers[fd] = 0;
+    *result = NIL_VAL;
+    return true;
+}
+
+/// @brief Ends the running spawned fiber after its function returned, and switches to the next
+///        fiber that can run. Its result is dropped.
+/// @return false on a runtime error.
+bool lox_FinishSpawnedFiber(VM *vm)
+{
+    IoLoop *io = GetLoop(vm);
+    if (--io->spawned == 0 && io->joiner != NULL)
+    {
+        MakeReady(io, io->joiner, NIL_VAL);
+        io->joiner = NULL;
+    }
+
+    Value value;
+    if (!Schedule(vm, io, &value))
+        return false;
+    return lox_TransferFiber(vm, value);
+}
+
+/// @brief Drops every parked operation and every fiber waiting to run. Called when a runtime error
+///        unwinds the stacks. The descriptors stay open.
+void lox_CancelIo(VM *vm)
+{
+    IoLoop *io = vm->io_loop;
+    if (io == NULL)
+        return;
+
+    for (int fd = 0; fd < io->wait_capacity; fd++)
+    {
+        IoWait *wait = io->waits[fd];
+        if (wait == NULL)
+            continue;
+        epoll_ctl(io->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        if (wait->fiber != &vm->main_fiber)
+            wait->fiber->state = FIBER_DONE;
+        free(wait);
+        io->waits[fd] = NULL;
+    }
+    for (int i = io->ready_start; i < io->ready_count; i++)
+    {
+        if (io->ready[i].fiber != &vm->main_fiber)
+            io->ready[i].fiber->state = FIBER_DONE;
+    }
+
+    io->wait_count = 0;
+    io->ready_start = 0;
+    io->ready_count = 0;
+    io->spawned = 0;
+    io->joiner = NULL;
+}
+
+/// @brief Marks the fibers parked on I/O or waiting to run, and the values they hold on to.
+void lox_MarkIoRoots(VM *vm)
+{
+    IoLoop *io = vm->io_loop;
+    if (io == NULL)
+        return;
+
+    for (int fd = 0; fd < io->wait_capacity; fd++)
+    {
+        IoWait *wait = io->waits[fd];
+        if (wait == NULL)
+            continue;
+        lox_MarkObject(vm, (Obj *)wait->fiber);
+        lox_MarkObject(vm, (Obj *)wait->data);
+    }
+    for (int i = io->ready_start; i < io->ready_count; i++)
+    {
+        lox_MarkObject(vm, (Obj *)io->ready[i].fiber);
+        lox_MarkValue(vm, io->ready[i].value);
+    }
+    lox_MarkObject(vm, (Obj *)io->joiner);
+}
+
+/// @brief Updates the values held for parked fibers that may have been moved out of the nursery.
+void lox_ForwardIoRoots(VM *vm)
+{
+    IoLoop *io = vm->io_loop;
+    if (io == NULL)
+        return;
+
+    for (int fd = 0; fd < io->wait_capacity; fd++)
+    {
+        IoWait *wait = io->waits[fd];
+        if (wait != NULL)
+            wait->data = (ObjString *)lox_ForwardObject(vm, (Obj *)wait->data);
+    }
+    for (int i = io->ready_start; i < io->ready_count; i++)
+        lox_ForwardValue(vm, &io->ready[i].value);
+}
+
+void lox_FreeIoLoop(VM *vm)
+{
+    IoLoop *io = vm->io_loop;
+    if (io == NULL)
+        return;
+
+    lox_CancelIo(vm);
+    if (io->epoll_fd != -1)
+        close(io->epoll_fd);
+    free(io->waits);
+    free(io->writers);
+    free(io->ready);
+    free(io);
+    vm->io_loop = NULL;
+}
+
+IoLoop *GetLoop(VM *vm)
+{
+    if (vm->io_loop == NULL)
+    {
+        // Writing to a closed pipe or socket should fail the write, not end the process.
+        signal(SIGPIPE, SIG_IGN);
+        vm->io_loop = calloc(1, sizeof(IoLoop));
+        // If this fails, so does registering a descriptor, which reports the error.
+        vm->io_loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    }
+    return vm->io_loop;
+}
+
+bool GetDescriptor(Value value, int *fd)
+{
+    if (!IS_NUMBER(value) || AS_NUMBER(value) < 0 || AS_NUMBER(value) > INT32_MAX ||
+        AS_NUMBER(value) != (int)AS_NUMBER(value))
+        return false;
+
+    *fd = (int)AS_NUMBER(value);
+    return true;
+}
+
+/// @brief Tries an operation, and parks the running fiber on it if the descriptor isn't ready.
+/// @param events to wait for.
+/// @param result receives the operation's result, or the value to continue with when it parked.
+/// @return false on a runtime error.
+bool Start(VM *vm, IoWait *wait, uint32_t events, Value *result)
+{
+    IoLoop *io = GetLoop(vm);
+    switch (Perform(vm, wait, result))
+    {
+    case IO_DONE:
+        return true;
+    case IO_BLOCKED:
+        return Park(vm, io, wait, events, result);
+    default:
+        if (wait->kind == IO_CONNECT)
+            lox_RuntimeError(vm, "Can't connect to '%s': %s.", wait->data->chars, strerror(errno));
+        else
+            lox_RuntimeError(vm, "I/O on descriptor %d failed: %s.", wait->fd, strerror(errno));
+        return false;
+    }
+}
+
+/// @brief Performs as much of an operation as the descriptor allows without blocking.
+/// @param result receives the result, once the operation is done or failed.
+IoStatus Perform(VM *vm, IoWait *wait, Value *result)
+{
+    switch (wait->kind)
+    {
+    case IO_READ:
+    {
+        char *buffer = malloc(wait->count);
+        ssize_t length = read(wait->fd, buffer, wait->count);
+        if (length > 0)
+        {
+            ObjString *string = lox_ReserveString(vm, (int)length);
+            memcpy(string->chars, buffer, length);
+            *result = OBJ_VAL(lox_InternString(vm, string));
+        }
+        free(buffer);
+        if (length == -1)
+        {
+            *result = NIL_VAL;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? IO_BLOCKED : IO_FAILED;
+        }
+        if (length == 0)
+            *result = NIL_VAL;
+        return IO_DONE;
+    }
+    case IO_WRITE:
+    {
+        ObjString *data = wait->data;
+        while (wait->count < data->length)
+        {
+            ssize_t written = write(wait->fd, data->chars + wait->count, data->length - wait->count);
+            if (written == -1)
+            {
+                *result = NUMBER_VAL(wait->count);
+                return errno == EAGAIN || errno == EWOULDBLOCK ? IO_BLOCKED : IO_FAILED;
+            }
+            wait->count += (int)written;
+        }
+        *result = NUMBER_VAL(wait->count);
+        return IO_DONE;
+    }
+    case IO_ACCEPT:
+    {
+        int fd = accept4(wait->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1)
+        {
+            *result = NIL_VAL;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? IO_BLOCKED : IO_FAILED;
+        }
+        *result = NUMBER_VAL(fd);
+        return IO_DONE;
+    }
+    case IO_CONNECT:
+    {
+        struct sockaddr_un address;
+        MakeAddress(vm, wait->data, &address);
+        // A Unix socket's connect fails with EAGAIN while the listener's backlog is full, and has to
+        // be tried again. Connecting a socket that has already connected fails with EISCONN.
+        if (connect(wait->fd, (struct sockaddr *)&address, sizeof(address)) == 0 || errno == EISCONN)
+        {
+            *result = NUMBER_VAL(wait->fd);
+            return IO_DONE;
+        }
+        *result = NIL_VAL;
+        return errno == EAGAIN || errno == EINPROGRESS || errno == EALREADY ? IO_BLOCKED : IO_FAILED;
+    }
+    }
+    return IO_FAILED;
+}
+
+/// @brief Registers an operation that would block, marks the running fiber as waiting and picks
+///        the fiber to run next.
+bool Park(VM *vm, IoLoop *io, IoWait *wait, uint32_t events, Value *result)
+{
+    int fd = wait->fd;
+    if (fd < io->wait_capacity && io->waits[fd] != NULL)
+    {
+        lox_RuntimeError(vm, "Another fiber is already waiting on descriptor %d.", fd);
+        return false;
+    }
+
+    IoWait *parked = malloc(sizeof(IoWait));
+    *parked = *wait;
+    parked->fiber = vm->fiber;
+    struct epoll_event event = {.events = events, .data.ptr = parked};
+    if (epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+    {
+        free(parked);
+        lox_RuntimeError(vm, "Can't wait on descriptor %d: %s.", fd, strerror(errno));
+        return false;
+    }
+
+    io->waits = GrowTable(io->waits, &io->wait_capacity, fd, sizeof(IoWait *));
+    io->waits[fd] = parked;
+    io->wait_count++;
+    vm->fiber->state = FIBER_WAITING;
+    return Schedule(vm, io, result);
+}
+
+/// @brief Picks the fiber that runs next, waiting for a parked operation to complete if no fiber
+///        is ready. Sets vm->transfer_to to it, unless it's the running fiber.
+/// @param result receives the value it continues with.
+/// @return false on a runtime error, like when no fiber will ever be ready.
+bool Schedule(VM *vm, IoLoop *io, Value *result)
+{
+    while (io->ready_start == io->ready_count)
+    {
+        if (io->wait_count == 0)
+        {
+            lox_RuntimeError(vm, "Deadlock: every fiber is waiting.");
+            return false;
+        }
+        if (!Poll(vm, io))
+            return false;
+    }
+
+    ReadyFiber next = io->ready[io->ready_start++];
+    if (io->ready_start == io->ready_count)
+    {
+        io->ready_start = 0;
+        io->ready_count = 0;
+    }
+
+    *result = next.value;
+    if (next.fiber == vm->fiber)
+        next.fiber->state = FIBER_RUNNING;
+    else
+        vm->transfer_to = next.fiber;
+    return true;
+}
+
+/// @brief Waits until at least one descriptor is ready, and completes the operations parked on
+///        the ready descriptors.
+bool Poll(VM *vm, IoLoop *io)
+{
+    struct epoll_event events[IO_MAX_EVENTS];
+    int count = epoll_wait(io->epoll_fd, events, IO_MAX_EVENTS, -1);
+    if (count == -1)
+    {
+        if (errno == EINTR)
+            return true;
+        lox_RuntimeError(vm, "Can't wait for I/O: %s.", strerror(errno));
+        return false;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        IoWait *wait = events[i].data.ptr;
+        Value value;
+        // Readiness can be spurious.
+        if (Perform(vm, wait, &value) == IO_BLOCKED)
+            continue;
+
+        epoll_ctl(io->epoll_fd, EPOLL_CTL_DEL, wait->fd, NULL);
+        // The script only gets the socket of a connection that succeeded.
+        if (wait->kind == IO_CONNECT && IS_NIL(value))
+            close(wait->fd);
+        io->waits[wait->fd] = NULL;
+        io->wait_count--;
+        MakeReady(io, wait->fiber, value);
+        free(wait);
+    }
+    return true;
+}
+
+void MakeReady(IoLoop *io, ObjFiber *fiber, Value value)
+{
+    if (io->ready_count == io->ready_capacity)
+    {
+        io->ready_capacity = io->ready_capacity < 8 ? 8 : io->ready_capacity * 2;
+        io->ready = realloc(io->ready, sizeof(ReadyFiber) * io->ready_capacity);
+    }
+    io->ready[io->ready_count++] = (ReadyFiber){.fiber = fiber, .value = value};
+}
+
+bool MakeAddress(VM *vm, ObjString *path, struct sockaddr_un *address)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (path->length >= (int)sizeof(address->sun_path))
+    {
+        lox_RuntimeError(vm, "Socket path '%s' is too long.", path->chars);
+        return false;
+    }
+    memcpy(address->sun_path, path->chars, path->length + 1);
+    return true;
+}
+
+/// @brief Grows a table indexed by descriptor to hold 'index'. New entries are zeroed.
+void *GrowTable(void *table, int *capacity, int index, size_t size)
+{
+    if (index < *capacity)
+        return table;
+
+    int new_capacity = *capacity < 16 ? 16 : *capacity;
+    while (new_capacity <= index)
+        new_capacity *= 2;
+    table = realloc(table, size * new_capacity);
+    memset((char *)table + size * *capacity, 0, size * (new_capacity - *capacity));
+    *capacity = new_capacity;
+    return table;
+}
+
+#endif
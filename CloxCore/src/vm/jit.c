@@ -0,0 +1,1299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm/jit.h"
+
+#ifdef USE_JIT
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+#include "core/chunk.h"
+#include "core/object.h"
+#include "core/value.h"
+#include "vm/trace.h"
+
+// General purpose registers, numbered as in the instruction encoding.
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSP 4
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R8 8
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+
+// While native code runs, the frame state lives in callee-saved registers, so it survives calls
+// into C helpers.
+#define REG_SLOTS RBX
+#define REG_STACK_TOP R12
+#define REG_FRAME R13
+#define REG_CONSTANTS R14
+#define REG_QNAN R15
+// The VM is kept in the stack slot that aligns the native frame, at [rsp].
+#define VM_SLOT 0
+
+// Condition codes for Jcc/SETcc.
+#define CC_BELOW 0x2
+#define CC_EQUAL 0x4
+#define CC_NOT_EQUAL 0x5
+#define CC_BELOW_EQUAL 0x6
+#define CC_ABOVE 0x7
+#define CC_NOT_SIGN 0x9
+
+// Jump targets that aren't bytecode offsets.
+#define TARGET_ERROR_EXIT -1
+#define TARGET_OK_EXIT -2
+#define TARGET_TAIL_CALL_EXIT -3
+
+// Native code returns one of these to lox_JitRunFrame.
+#define NATIVE_OK 0
+#define NATIVE_ERROR 1
+// The frame now runs another function after a tail call.
+#define NATIVE_TAIL_CALL 2
+
+// Returned by TailCallHelper when the callee took over the frame.
+#define TAIL_CALLED ((Value *)1)
+
+typedef int (*NativeEntry)(VM *vm, CallFrame *frame, Value *stack_top, Value *constants);
+
+// Slow paths are C helpers with a common signature. They sync the frame and the VM with
+// 'stack_top' and 'ip', and return the new stack top, or NULL after a runtime error.
+typedef Value *(*JitHelper)(VM *vm, CallFrame *frame, Value *stack_top, int operand, uint8_t *ip);
+
+typedef struct
+{
+    // Offset of the rel32 to patch.
+    size_t at;
+    // Bytecode offset of the target, or TARGET_ERROR_EXIT.
+    int target;
+} JumpFixup;
+
+// A guard failing in a trace leaves native code and resumes the interpreter at 'ip'.
+typedef struct
+{
+    // Offset of the rel32 of the guard's jump.
+    size_t at;
+    uint8_t *ip;
+} SideExit;
+
+typedef struct
+{
+    ObjFunction *function;
+    uint8_t *code;
+    size_t count;
+    size_t capacity;
+    // Native offset of each bytecode offset that starts an instruction, -1 otherwise.
+    int32_t *labels;
+    JumpFixup *fixups;
+    int fixup_count;
+    int fixup_capacity;
+    SideExit *exits;
+    int exit_count;
+    int exit_capacity;
+    // Offsets of the exits emitted by EmitEpilogue.
+    size_t ok_exit;
+    size_t tail_call_exit;
+    size_t error_exit;
+    bool failed;
+} Assembler;
+
+static void Byte(Assembler *as, uint8_t byte);
+static void Int32(Assembler *as, int32_t value);
+static void Int64(Assembler *as, uint64_t value);
+static void Rex(Assembler *as, int reg, int base);
+static void MemoryOperand(Assembler *as, int reg, int base, int32_t disp);
+static void Load(Assembler *as, int reg, int base, int32_t disp);
+static void Store(Assembler *as, int base, int32_t disp, int reg);
+static void MoveImmediate(Assembler *as, int reg, uint64_t value);
+static void MoveRegister(Assembler *as, int dest, int src);
+static void AddImmediate(Assembler *as, int reg, int32_t value);
+static void LoadAddress(Assembler *as, int reg, int base, int32_t disp);
+static void Alu(Assembler *as, uint8_t opcode, int dest, int src);
+static void MoveToXmm(Assembler *as, int xmm, int reg);
+static void MoveFromXmm(Assembler *as, int reg, int xmm);
+static void Sse(Assembler *as, uint8_t prefix, uint8_t opcode, int dest, int src);
+static void SetConditionAsBool(Assembler *as, uint8_t condition);
+static size_t JumpIf(Assembler *as, uint8_t condition);
+static size_t Jump(Assembler *as);
+static void JumpToTarget(Assembler *as, size_t at, int target);
+static void PatchHere(Assembler *as, size_t at);
+static void CallFunction(Assembler *as, void *function);
+static void CallHelper(Assembler *as, JitHelper helper, int operand, uint8_t *ip);
+static size_t CheckNumber(Assembler *as, int reg);
+static void Push(Assembler *as, int reg);
+static void PushImmediate(Assembler *as, uint64_t value);
+static void JumpBack(Assembler *as, size_t target);
+static void ReloadFrame(Assembler *as);
+static void GuardNumber(Assembler *as, int reg, uint8_t *ip);
+static void GuardText(Assembler *as, int reg, uint8_t *ip);
+static void ExitIf(Assembler *as, uint8_t condition, uint8_t *ip);
+static bool Install(Assembler *as, void **native, size_t *native_size);
+static void FreeAssembler(Assembler *as);
+
+static void EmitPrologue(Assembler *as);
+static void EmitEpilogue(Assembler *as);
+static void EmitInstruction(Assembler *as, int offset);
+static void EmitArithmetic(Assembler *as, uint8_t opcode, uint8_t sse_opcode, uint8_t *ip);
+static void EmitComparison(Assembler *as, uint8_t opcode, bool less, uint8_t *ip);
+static void EmitTraceStep(Assembler *as, TraceStep *step, size_t loop_start);
+static void EmitNumberOperands(Assembler *as, uint8_t *ip);
+static void EmitFuelCheck(Assembler *as, int32_t charge, uint8_t *ip);
+static void EmitSideExits(Assembler *as);
+
+static Value *ArithmeticHelper(VM *vm, CallFrame *frame, Value *stack_top, int opcode, uint8_t *ip);
+static Value *IncrementLocalHelper(VM *vm, CallFrame *frame, Value *stack_top, int operand, uint8_t *ip);
+static Value *UndefinedGlobalHelper(VM *vm, CallFrame *frame, Value *stack_top, int slot, uint8_t *ip);
+static Value *PrintHelper(VM *vm, CallFrame *frame, Value *stack_top, int operand, uint8_t *ip);
+static Value *ClosureHelper(VM *vm, CallFrame *frame, Value *stack_top, int constant, uint8_t *ip);
+static Value *CallHelperFunction(VM *vm, CallFrame *frame, Value *stack_top, int arg_count, uint8_t *ip);
+static Value *TailCallHelper(VM *vm, CallFrame *frame, Value *stack_top, int arg_count, uint8_t *ip);
+static Value *ReturnHelper(VM *vm, CallFrame *frame, Value *stack_top, int operand, uint8_t *ip);
+static Value *SafepointHelper(VM *vm, CallFrame *frame, Value *stack_top, int operand, uint8_t *ip);
+static Value *WaitForFiber(VM *vm, ObjFiber *fiber, int frame_count);
+
+/// @brief Compiles the chunk of 'function' to machine code.
+///        Each instruction is expanded from a template. The value stack stays in memory, and
+///        slow paths call back into C.
+/// @param function to compile.
+/// @return true if compiled, false if the chunk contains an instruction the JIT doesn't support.
+bool lox_JitCompile(ObjFunction *function)
+{
+    if (function->native != NULL)
+        return true;
+
+    Chunk *chunk = &function->chunk;
+    Assembler as = {0};
+    as.function = function;
+    as.labels = malloc(sizeof(int32_t) * (chunk->count + 1));
+    for (size_t i = 0; i <= chunk->count; i++)
+        as.labels[i] = -1;
+
+    EmitPrologue(&as);
+    for (size_t offset = 0; offset < chunk->count && !as.failed;)
+    {
+        as.labels[offset] = (int32_t)as.count;
+        EmitInstruction(&as, (int)offset);
+        offset += lox_InstructionLength(chunk->code[offset]);
+    }
+    EmitEpilogue(&as);
+
+    bool compiled = !as.failed && Install(&as, &function->native, &function->native_size);
+    FreeAssembler(&as);
+    return compiled;
+}
+
+/// @brief Runs 'frame' natively if its function has been compiled. Native code returns
+///        like OP_RETURN does: the frame is popped and the result is pushed for the caller.
+///        Tail calls made by native code return here first, so they don't grow the C stack.
+/// @param frame is the newest frame.
+/// @return JIT_NOT_COMPILED if the frame must be run by the interpreter.
+JitResult lox_JitRunFrame(VM *vm, CallFrame *frame)
+{
+    // Native frames can't be suspended, so fibers other than the main one are interpreted.
+    // Shared code is always interpreted, even if its owner compiled it.
+    if (frame->function->native == NULL || vm->native_depth >= JIT_MAX_DEPTH ||
+        vm->fiber != &vm->main_fiber || vm->shared_code)
+        return JIT_NOT_COMPILED;
+
+    // Calls made by native code may move the frames.
+    int frame_index = (int)(frame - vm->frames);
+    vm->native_depth++;
+    int status;
+    do
+    {
+        frame = &vm->frames[frame_index];
+        ObjFunction *function = frame->function;
+        if (function->native == NULL)
+        {
+            // The frame was taken over by a function that hasn't been compiled.
+            status = lox_RunFrames(vm, vm->fiber, frame_index) == INTERPRET_OK ? NATIVE_OK : NATIVE_ERROR;
+            break;
+        }
+        NativeEntry entry = (NativeEntry)function->native;
+        status = entry(vm, frame, vm->stack_top, function->chunk.constants.values);
+    } while (status == NATIVE_TAIL_CALL);
+    vm->native_depth--;
+    return status == NATIVE_OK ? JIT_OK : JIT_ERROR;
+}
+
+void lox_JitFree(ObjFunction *function)
+{
+    if (function->native == NULL)
+        return;
+
+    munmap(function->native, function->native_size);
+    function->native = NULL;
+    function->native_size = 0;
+}
+
+/// @brief Compiles a recorded loop trace to machine code. The trace is linear: every branch the
+///        recording took is a guard, and so is every operand type it saw. A failing guard exits to
+///        the interpreter at the guarded instruction, with the stack as the interpreter expects it.
+///        The last step jumps back to the start, so native code runs until a guard fails.
+/// @param trace to compile.
+/// @return true if compiled.
+bool lox_JitCompileTrace(Trace *trace)
+{
+    if (trace->native != NULL)
+        return true;
+
+    Assembler as = {0};
+    as.function = trace->function;
+
+    EmitPrologue(&as);
+    size_t loop_start = as.count;
+    for (int i = 0; i < trace->step_count && !as.failed; i++)
+        EmitTraceStep(&as, &trace->steps[i], loop_start);
+    EmitSideExits(&as);
+    EmitEpilogue(&as);
+
+    bool compiled = !as.failed && Install(&as, &trace->native, &trace->native_size);
+    FreeAssembler(&as);
+    return compiled;
+}
+
+/// @brief Runs the trace in 'frame' until it exits. On a side exit, the frame's ip and the stack
+///        top are left where the interpreter resumes.
+/// @param trace has been compiled.
+/// @param frame is the newest frame, running the loop.
+/// @return JIT_OK on a side exit, JIT_ERROR on a runtime error.
+JitResult lox_JitRunTrace(VM *vm, Trace *trace, CallFrame *frame)
+{
+    NativeEntry entry = (NativeEntry)trace->native;
+    int status = entry(vm, frame, vm->stack_top, frame->function->chunk.constants.values);
+    return status == NATIVE_OK ? JIT_OK : JIT_ERROR;
+}
+
+void lox_JitFreeTrace(Trace *trace)
+{
+    if (trace->native == NULL)
+        return;
+
+    munmap(trace->native, trace->native_size);
+    trace->native = NULL;
+    trace->native_size = 0;
+}
+
+void Byte(Assembler *as, uint8_t byte)
+{
+    if (as->count + 1 > as->capacity)
+    {
+        as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+        as->code = realloc(as->code, as->capacity);
+    }
+    as->code[as->count++] = byte;
+}
+
+void Int32(Assembler *as, int32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        Byte(as, (uint8_t)((uint32_t)value >> (8 * i)));
+}
+
+void Int64(Assembler *as, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+        Byte(as, (uint8_t)(value >> (8 * i)));
+}
+
+/// @brief Emits a REX prefix with W set for a 64-bit operation.
+void Rex(Assembler *as, int reg, int base)
+{
+    Byte(as, 0x48 | ((reg >> 3) << 2) | (base >> 3));
+}
+
+/// @brief Emits a ModRM(and SIB) for [base + disp32].
+void MemoryOperand(Assembler *as, int reg, int base, int32_t disp)
+{
+    Byte(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP)
+        Byte(as, 0x24);
+    Int32(as, disp);
+}
+
+/// @brief mov reg, [base + disp]
+void Load(Assembler *as, int reg, int base, int32_t disp)
+{
+    Rex(as, reg, base);
+    Byte(as, 0x8B);
+    MemoryOperand(as, reg, base, disp);
+}
+
+/// @brief mov [base + disp], reg
+void Store(Assembler *as, int base, int32_t disp, int reg)
+{
+    Rex(as, reg, base);
+    Byte(as, 0x89);
+    MemoryOperand(as, reg, base, disp);
+}
+
+/// @brief mov reg, imm64
+void MoveImmediate(Assembler *as, int reg, uint64_t value)
+{
+    Rex(as, 0, reg);
+    Byte(as, 0xB8 | (reg & 7));
+    Int64(as, value);
+}
+
+/// @brief mov dest, src
+void MoveRegister(Assembler *as, int dest, int src)
+{
+    Alu(as, 0x89, dest, src);
+}
+
+/// @brief add reg, imm32
+void AddImmediate(Assembler *as, int reg, int32_t value)
+{
+    Rex(as, 0, reg);
+    Byte(as, 0x81);
+    Byte(as, 0xC0 | (reg & 7));
+    Int32(as, value);
+}
+
+/// @brief lea reg, [base + disp]. Unlike add, it leaves the flags alone.
+void LoadAddress(Assembler *as, int reg, int base, int32_t disp)
+{
+    Rex(as, reg, base);
+    Byte(as, 0x8D);
+    MemoryOperand(as, reg, base, disp);
+}
+
+/// @brief Emits a register-to-register 'op dest, src' for the r/m64, r64 form of 'opcode'.
+void Alu(Assembler *as, uint8_t opcode, int dest, int src)
+{
+    Rex(as, src, dest);
+    Byte(as, opcode);
+    Byte(as, 0xC0 | ((src & 7) << 3) | (dest & 7));
+}
+
+/// @brief movq xmm, reg
+void MoveToXmm(Assembler *as, int xmm, int reg)
+{
+    Byte(as, 0x66);
+    Rex(as, xmm, reg);
+    Byte(as, 0x0F);
+    Byte(as, 0x6E);
+    Byte(as, 0xC0 | ((xmm & 7) << 3) | (reg & 7));
+}
+
+/// @brief movq reg, xmm
+void MoveFromXmm(Assembler *as, int reg, int xmm)
+{
+    Byte(as, 0x66);
+    Rex(as, xmm, reg);
+    Byte(as, 0x0F);
+    Byte(as, 0x7E);
+    Byte(as, 0xC0 | ((xmm & 7) << 3) | (reg & 7));
+}
+
+/// @brief Emits a scalar SSE2 operation between xmm0-xmm7.
+void Sse(Assembler *as, uint8_t prefix, uint8_t opcode, int dest, int src)
+{
+    if (prefix != 0)
+        Byte(as, prefix);
+    Byte(as, 0x0F);
+    Byte(as, opcode);
+    Byte(as, 0xC0 | (dest << 3) | src);
+}
+
+/// @brief Sets rax to TRUE_VAL if 'condition' holds, FALSE_VAL otherwise.
+void SetConditionAsBool(Assembler *as, uint8_t condition)
+{
+    // setcc al; movzx eax, al
+    Byte(as, 0x0F);
+    Byte(as, 0x90 | condition);
+    Byte(as, 0xC0);
+    Byte(as, 0x0F);
+    Byte(as, 0xB6);
+    Byte(as, 0xC0);
+    // FALSE_VAL | 1 == TRUE_VAL.
+    MoveImmediate(as, RCX, FALSE_VAL);
+    Alu(as, 0x09, RAX, RCX);
+}
+
+/// @brief Emits a conditional jump with an unresolved rel32.
+/// @return offset of the rel32.
+size_t JumpIf(Assembler *as, uint8_t condition)
+{
+    Byte(as, 0x0F);
+    Byte(as, 0x80 | condition);
+    Int32(as, 0);
+    return as->count - 4;
+}
+
+/// @brief Emits an unconditional jump with an unresolved rel32.
+/// @return offset of the rel32.
+size_t Jump(Assembler *as)
+{
+    Byte(as, 0xE9);
+    Int32(as, 0);
+    return as->count - 4;
+}
+
+/// @brief Resolves the rel32 at 'at' to the bytecode offset 'target' once all labels are known.
+void JumpToTarget(Assembler *as, size_t at, int target)
+{
+    if (as->fixup_count + 1 > as->fixup_capacity)
+    {
+        as->fixup_capacity = as->fixup_capacity < 16 ? 16 : as->fixup_capacity * 2;
+        as->fixups = realloc(as->fixups, sizeof(JumpFixup) * as->fixup_capacity);
+    }
+    as->fixups[as->fixup_count++] = (JumpFixup){.at = at, .target = target};
+}
+
+/// @brief Resolves the rel32 at 'at' to the current position.
+void PatchHere(Assembler *as, size_t at)
+{
+    int32_t rel = (int32_t)(as->count - (at + 4));
+    memcpy(as->code + at, &rel, sizeof(int32_t));
+}
+
+void CallFunction(Assembler *as, void *function)
+{
+    MoveImmediate(as, RAX, (uint64_t)(uintptr_t)function);
+    // call rax
+    Byte(as, 0xFF);
+    Byte(as, 0xD0);
+}
+
+/// @brief Calls a slow path helper and takes the error exit if it returns NULL.
+void CallHelper(Assembler *as, JitHelper helper, int operand, uint8_t *ip)
+{
+    Load(as, RDI, RSP, VM_SLOT);
+    MoveRegister(as, RSI, REG_FRAME);
+    MoveRegister(as, RDX, REG_STACK_TOP);
+    MoveImmediate(as, RCX, (uint64_t)(int64_t)operand);
+    MoveImmediate(as, R8, (uint64_t)(uintptr_t)ip);
+    CallFunction(as, (void *)helper);
+    // test rax, rax
+    Alu(as, 0x85, RAX, RAX);
+    JumpToTarget(as, JumpIf(as, CC_EQUAL), TARGET_ERROR_EXIT);
+    MoveRegister(as, REG_STACK_TOP, RAX);
+}
+
+/// @brief Emits a check that the value in 'reg' is a number. Clobbers rcx.
+/// @return offset of the rel32 of the jump taken if it isn't.
+size_t CheckNumber(Assembler *as, int reg)
+{
+    MoveRegister(as, RCX, reg);
+    Alu(as, 0x21, RCX, REG_QNAN);
+    Alu(as, 0x39, RCX, REG_QNAN);
+    return JumpIf(as, CC_EQUAL);
+}
+
+void Push(Assembler *as, int reg)
+{
+    Store(as, REG_STACK_TOP, 0, reg);
+    AddImmediate(as, REG_STACK_TOP, sizeof(Value));
+}
+
+void PushImmediate(Assembler *as, uint64_t value)
+{
+    MoveImmediate(as, RAX, value);
+    Push(as, RAX);
+}
+
+/// @brief Emits a jump to code that has already been emitted.
+void JumpBack(Assembler *as, size_t target)
+{
+    Byte(as, 0xE9);
+    Int32(as, (int32_t)(target - (as->count + 4)));
+}
+
+/// @brief Reloads the frame and slot registers after a call, which may have moved the stacks.
+///        The frame running native code is the newest one again.
+void ReloadFrame(Assembler *as)
+{
+    // movsxd rcx, dword [rax + offsetof(VM, frame_count)]
+    Load(as, RAX, RSP, VM_SLOT);
+    Byte(as, 0x48);
+    Byte(as, 0x63);
+    MemoryOperand(as, RCX, RAX, offsetof(VM, frame_count));
+    // imul rcx, rcx, sizeof(CallFrame)
+    Byte(as, 0x48);
+    Byte(as, 0x69);
+    Byte(as, 0xC9);
+    Int32(as, sizeof(CallFrame));
+    Load(as, RAX, RAX, offsetof(VM, frames));
+    Alu(as, 0x01, RAX, RCX);
+    LoadAddress(as, REG_FRAME, RAX, -(int32_t)sizeof(CallFrame));
+    Load(as, REG_SLOTS, REG_FRAME, offsetof(CallFrame, slots));
+}
+
+/// @brief Emits a guard that leaves the trace at 'ip' unless the value in 'reg' is a number.
+///        Clobbers rcx.
+void GuardNumber(Assembler *as, int reg, uint8_t *ip)
+{
+    MoveRegister(as, RCX, reg);
+    Alu(as, 0x21, RCX, REG_QNAN);
+    Alu(as, 0x39, RCX, REG_QNAN);
+    ExitIf(as, CC_EQUAL, ip);
+}
+
+/// @brief Emits a guard that leaves the trace at 'ip' unless the value in 'reg' is a string or a
+///        rope. Clobbers rcx and rdx.
+void GuardText(Assembler *as, int reg, uint8_t *ip)
+{
+    MoveImmediate(as, RDX, SIGN_BIT | QNAN);
+    MoveRegister(as, RCX, reg);
+    Alu(as, 0x21, RCX, RDX);
+    Alu(as, 0x39, RCX, RDX);
+    ExitIf(as, CC_NOT_EQUAL, ip);
+    // The tag bits are all set, so clearing them with xor leaves the pointer.
+    MoveRegister(as, RCX, reg);
+    Alu(as, 0x31, RCX, RDX);
+    // cmp dword [rcx + offsetof(Obj, type)], type
+    Byte(as, 0x81);
+    MemoryOperand(as, 7, RCX, offsetof(Obj, type));
+    Int32(as, OBJ_STRING);
+    size_t is_string = JumpIf(as, CC_EQUAL);
+    Byte(as, 0x81);
+    MemoryOperand(as, 7, RCX, offsetof(Obj, type));
+    Int32(as, OBJ_ROPE);
+    ExitIf(as, CC_NOT_EQUAL, ip);
+    PatchHere(as, is_string);
+}
+
+/// @brief Emits a guard that leaves the trace for the interpreter at 'ip' if 'condition' holds.
+void ExitIf(Assembler *as, uint8_t condition, uint8_t *ip)
+{
+    if (as->exit_count + 1 > as->exit_capacity)
+    {
+        as->exit_capacity = as->exit_capacity < 16 ? 16 : as->exit_capacity * 2;
+        as->exits = realloc(as->exits, sizeof(SideExit) * as->exit_capacity);
+    }
+    as->exits[as->exit_count++] = (SideExit){.at = JumpIf(as, condition), .ip = ip};
+}
+
+/// @brief Resolves the jumps to the exits and copies the code to executable memory.
+/// @return true if installed.
+bool Install(Assembler *as, void **native, size_t *native_size)
+{
+    for (int i = 0; i < as->fixup_count; i++)
+    {
+        JumpFixup *fixup = &as->fixups[i];
+        int32_t target;
+        if (fixup->target == TARGET_OK_EXIT)
+            target = (int32_t)as->ok_exit;
+        else if (fixup->target == TARGET_TAIL_CALL_EXIT)
+            target = (int32_t)as->tail_call_exit;
+        else if (fixup->target == TARGET_ERROR_EXIT)
+            target = (int32_t)as->error_exit;
+        else
+            target = as->labels[fixup->target];
+        if (target < 0)
+            return false;
+
+        int32_t rel = target - (int32_t)(fixup->at + 4);
+        memcpy(as->code + fixup->at, &rel, sizeof(int32_t));
+    }
+
+    void *memory = mmap(NULL, as->count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return false;
+
+    memcpy(memory, as->code, as->count);
+    if (mprotect(memory, as->count, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(memory, as->count);
+        return false;
+    }
+
+    *native = memory;
+    *native_size = as->count;
+    return true;
+}
+
+void FreeAssembler(Assembler *as)
+{
+    free(as->code);
+    free(as->labels);
+    free(as->fixups);
+    free(as->exits);
+}
+
+void EmitPrologue(Assembler *as)
+{
+    // push rbp; mov rbp, rsp
+    Byte(as, 0x55);
+    MoveRegister(as, RBP, RSP);
+    // push rbx; push r12; push r13; push r14; push r15
+    Byte(as, 0x53);
+    Byte(as, 0x41);
+    Byte(as, 0x54);
+    Byte(as, 0x41);
+    Byte(as, 0x55);
+    Byte(as, 0x41);
+    Byte(as, 0x56);
+    Byte(as, 0x41);
+    Byte(as, 0x57);
+    // Keep the stack 16-byte aligned for calls.
+    AddImmediate(as, RSP, -8);
+
+    Store(as, RSP, VM_SLOT, RDI);
+    MoveRegister(as, REG_FRAME, RSI);
+    MoveRegister(as, REG_STACK_TOP, RDX);
+    MoveRegister(as, REG_CONSTANTS, RCX);
+    Load(as, REG_SLOTS, REG_FRAME, offsetof(CallFrame, slots));
+    MoveImmediate(as, REG_QNAN, QNAN);
+}
+
+/// @brief Emits the exits. Each sets the status returned to lox_JitRunFrame, and then they share
+///        the code that restores the registers.
+void EmitEpilogue(Assembler *as)
+{
+    // mov eax, status; jmp rel8 to the restore code.
+    as->ok_exit = as->count;
+    Byte(as, 0xB8);
+    Int32(as, NATIVE_OK);
+    Byte(as, 0xEB);
+    Byte(as, 12);
+    as->tail_call_exit = as->count;
+    Byte(as, 0xB8);
+    Int32(as, NATIVE_TAIL_CALL);
+    Byte(as, 0xEB);
+    Byte(as, 5);
+    as->error_exit = as->count;
+    Byte(as, 0xB8);
+    Int32(as, NATIVE_ERROR);
+    AddImmediate(as, RSP, 8);
+    // pop r15; pop r14; pop r13; pop r12; pop rbx; pop rbp; ret
+    Byte(as, 0x41);
+    Byte(as, 0x5F);
+    Byte(as, 0x41);
+    Byte(as, 0x5E);
+    Byte(as, 0x41);
+    Byte(as, 0x5D);
+    Byte(as, 0x41);
+    Byte(as, 0x5C);
+    Byte(as, 0x5B);
+    Byte(as, 0x5D);
+    Byte(as, 0xC3);
+}
+
+void EmitInstruction(Assembler *as, int offset)
+{
+    Chunk *chunk = &as->function->chunk;
+    uint8_t *code = chunk->code + offset;
+    // Helpers are given the ip after the instruction, like the interpreter has when it fails.
+    uint8_t *next = code + lox_InstructionLength(code[0]);
+
+    switch (code[0])
+    {
+    case OP_CONSTANT:
+        Load(as, RAX, REG_CONSTANTS, code[1] * sizeof(Value));
+        Push(as, RAX);
+        break;
+    case OP_NIL:
+        PushImmediate(as, NIL_VAL);
+        break;
+    case OP_TRUE:
+        PushImmediate(as, TRUE_VAL);
+        break;
+    case OP_FALSE:
+        PushImmediate(as, FALSE_VAL);
+        break;
+    case OP_POP:
+        AddImmediate(as, REG_STACK_TOP, -(int32_t)sizeof(Value));
+        break;
+    case OP_GET_LOCAL:
+        Load(as, RAX, REG_SLOTS, code[1] * sizeof(Value));
+        Push(as, RAX);
+        break;
+    case OP_SET_LOCAL:
+        Load(as, RAX, REG_STACK_TOP, -(int32_t)sizeof(Value));
+        Store(as, REG_SLOTS, code[1] * sizeof(Value), RAX);
+        break;
+    case OP_GET_LOCAL_CONSTANT:
+        Load(as, RAX, REG_SLOTS, code[1] * sizeof(Value));
+        Push(as, RAX);
+        Load(as, RAX, REG_CONSTANTS, code[2] * sizeof(Value));
+        Push(as, RAX);
+        break;
+    case OP_GET_LOCAL_LOCAL:
+        Load(as, RAX, REG_SLOTS, code[1] * sizeof(Value));
+        Push(as, RAX);
+        Load(as, RAX, REG_SLOTS, code[2] * sizeof(Value));
+        Push(as, RAX);
+        break;
+    case OP_DEFINE_GLOBAL_SLOT:
+    case OP_GET_GLOBAL_SLOT:
+    case OP_SET_GLOBAL_SLOT:
+    {
+        int32_t slot = (code[1] << 8) | code[2];
+        // The global array grows as new globals are compiled, so load it on every access.
+        Load(as, RDX, RSP, VM_SLOT);
+        Load(as, RDX, RDX, offsetof(VM, global_values.values));
+        if (code[0] == OP_DEFINE_GLOBAL_SLOT)
+        {
+            Load(as, RAX, REG_STACK_TOP, -(int32_t)sizeof(Value));
+            Store(as, RDX, slot * sizeof(Value), RAX);
+            AddImmediate(as, REG_STACK_TOP, -(int32_t)sizeof(Value));
+            break;
+        }
+
+        Load(as, RAX, RDX, slot * sizeof(Value));
+        MoveImmediate(as, RCX, UNDEFINED_VAL);
+        Alu(as, 0x39, RAX, RCX);
+        size_t defined = JumpIf(as, CC_NOT_EQUAL);
+        CallHelper(as, UndefinedGlobalHelper, slot, next);
+        PatchHere(as, defined);
+        if (code[0] == OP_GET_GLOBAL_SLOT)
+        {
+            Push(as, RAX);
+        }
+        else
+        {
+            Load(as, RAX, REG_STACK_TOP, -(int32_t)sizeof(Value));
+            Store(as, RDX, slot * sizeof(Value), RAX);
+        }
+        break;
+    }
+    case OP_ADD:
+    case OP_ADD_NUMBER:
+    case OP_ADD_STRING:
+        // The quickened forms only record what the interpreter has seen so far, so every form
+        // keeps both the number and the string path.
+        EmitArithmetic(as, OP_ADD, 0x58, next);
+        break;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUMBER:
+        EmitArithmetic(as, OP_SUBTRACT, 0x5C, next);
+        break;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUMBER:
+        EmitArithmetic(as, OP_MULTIPLY, 0x59, next);
+        break;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUMBER:
+        EmitArithmetic(as, OP_DIVIDE, 0x5E, next);
+        break;
+    case OP_LESS:
+    case OP_LESS_NUMBER:
+        EmitComparison(as, OP_LESS, true, next);
+        break;
+    case OP_GREATER:
+    case OP_GREATER_NUMBER:
+        EmitComparison(as, OP_GREATER, false, next);
+        break;
+    case OP_NEGATE:
+    {
+        Load(as, RAX, REG_STACK_TOP, -(int32_t)sizeof(Value));
+        size_t slow = CheckNumber(as, RAX);
+        // btc rax, 63
+        Rex(as, 0, RAX);
+        Byte(as, 0x0F);
+        Byte(as, 0xBA);
+        Byte(as, 0xF8);
+        Byte(as, 63);
+        Store(as, REG_STACK_TOP, -(int32_t)sizeof(Value), RAX);
+        size_t done = Jump(as);
+        PatchHere(as, slow);
+        CallHelper(as, ArithmeticHelper, OP_NEGATE, next);
+        PatchHere(as, done);
+        break;
+    }
+    case OP_NOT:
+    {
+        // Falsey values are nil and false.
+        Load(as, RDX, REG_STACK_TOP, -(int32_t)sizeof(Value));
+        MoveImmediate(as, RCX, NIL_VAL);
+        Alu(as, 0x39, RDX, RCX);
+        size_t is_nil = JumpIf(as, CC_EQUAL);
+        MoveImmediate(as, RCX, FALSE_VAL);
+        Alu(as, 0x39, RDX, RCX);
+        PatchHere(as, is_nil);
+        SetConditionAsBool(as, CC_EQUAL);
+        Store(as, REG_STACK_TOP, -(int32_t)sizeof(Value), RAX);
+        break;
+    }
+    case OP_EQUAL:
+        Load(as, RDI, REG_STACK_TOP, -2 * (int32_t)sizeof(Value));
+        Load(as, RSI, REG_STACK_TOP, -(int32_t)sizeof(Value));
+        CallFunction(as, (void *)lox_ValuesEqual);
+        // test al, al
+        Byte(as, 0x84);
+        Byte(as, 0xC0);
+        SetConditionAsBool(as, CC_NOT_EQUAL);
+        AddImmediate(as, REG_STACK_TOP, -(int32_t)sizeof(Value));
+        Store(as, REG_STACK_TOP, -(int32_t)sizeof(Value), RAX);
+        break;
+    case OP_JUMP_IF_FALSE:
+    {
+        int target = offset + 3 + ((code[1] << 8) | code[2]);
+        Load(as, RAX, REG_STACK_TOP, -(int32_t)sizeof(Value));
+        MoveImmediate(as, RCX, NIL_VAL);
+        Alu(as, 0x39, RAX, RCX);
+        JumpToTarget(as, JumpIf(as, CC_EQUAL), target);
+        MoveImmediate(as, RCX, FALSE_VAL);
+        Alu(as, 0x39, RAX, RCX);
+        JumpToTarget(as, JumpIf(as, CC_EQUAL), target);
+        break;
+    }
+    case OP_JUMP:
+        JumpToTarget(as, Jump(as), offset + 3 + ((code[1] << 8) | code[2]));
+        break;
+    case OP_LOOP:
+        EmitFuelCheck(as, (code[1] << 8) | code[2], next);
+        JumpToTarget(as, Jump(as), offset + 3 - ((code[1] << 8) | code[2]));
+        break;
+    case OP_LESS_JUMP_IF_FALSE:
+    {
+        int target = offset + 3 + ((code[1] << 8) | code[2]);
+        Load(as, RAX, REG_STACK_TOP, -2 * (int32_t)sizeof(Value));
+        size_t slow_a = CheckNumber(as, RAX);
+        Load(as, RDX, REG_STACK_TOP, -(int32_t)sizeof(Value));
+        size_t slow_b = CheckNumber(as, RDX);
+        MoveToXmm(as, 0, RAX);
+        MoveToXmm(as, 1, RDX);
+        // ucomisd xmm1, xmm0 is "above" only if a < b, and never for NaN.
+        Sse(as, 0x66, 0x2E, 1, 0);
+        LoadAddress(as, REG_STACK_TOP, REG_STACK_TOP, -2 * (int32_t)sizeof(Value));
+        size_t less = JumpIf(as, CC_ABOVE);
+        PushImmediate(as, FALSE_VAL);
+        JumpToTarget(as, Jump(as), target);
+        PatchHere(as, slow_a);
+        PatchHere(as, slow_b);
+        CallHelper(as, ArithmeticHelper, OP_LESS, next);
+        PatchHere(as, less);
+        break;
+    }
+    case OP_INCREMENT_LOCAL:
+    {
+        int32_t slot = code[1] * sizeof(Value);
+        Value constant = chunk->constants.values[code[2]];
+        size_t done = 0;
+        bool fast = IS_NUMBER(constant);
+        if (fast)
+        {
+            Load(as, RAX, REG_SLOTS, slot);
+            size_t slow = CheckNumber(as, RAX);
+            MoveToXmm(as, 0, RAX);
+            MoveImmediate(as, RDX, constant);
+            MoveToXmm(as, 1, RDX);
+            Sse(as, 0xF2, 0x58, 0, 1);
+            MoveFromXmm(as, RAX, 0);
+            Store(as, REG_SLOTS, slot, RAX);
+            done = Jump(as);
+            PatchHere(as, slow);
+        }
+        CallHelper(as, IncrementLocalHelper, (code[2] << 8) | code[1], next);
+        if (fast)
+            PatchHere(as, done);
+        break;
+    }
+    case OP_PRINT:
+        CallHelper(as, PrintHelper, 0, next);
+        break;
+    case OP_CLOSURE:
+        CallHelper(as, ClosureHelper, code[1], next);
+        break;
+    case OP_CALL:
+        CallHelper(as, CallHelperFunction, code[1], next);
+        ReloadFrame(as);
+        break;
+    case OP_TAIL_CALL:
+    {
+        Load(as, RDI, RSP, VM_SLOT);
+        MoveRegister(as, RSI, REG_FRAME);
+        MoveRegister(as, RDX, REG_STACK_TOP);
+        MoveImmediate(as, RCX, code[1]);
+        MoveImmediate(as, R8, (uint64_t)(uintptr_t)next);
+        CallFunction(as, (void *)TailCallHelper);
+        Alu(as, 0x85, RAX, RAX);
+        JumpToTarget(as, JumpIf(as, CC_EQUAL), TARGET_ERROR_EXIT);
+        // The callee took over the frame. lox_JitRunFrame continues with it.
+        MoveImmediate(as, RCX, (uint64_t)(uintptr_t)TAIL_CALLED);
+        Alu(as, 0x39, RAX, RCX);
+        JumpToTarget(as, JumpIf(as, CC_EQUAL), TARGET_TAIL_CALL_EXIT);
+        MoveRegister(as, REG_STACK_TOP, RAX);
+        break;
+    }
+    case OP_RETURN:
+        CallHelper(as, ReturnHelper, 0, next);
+        JumpToTarget(as, Jump(as), TARGET_OK_EXIT);
+        break;
+    default:
+        as->failed = true;
+        break;
+    }
+}
+
+/// @brief Emits a binary arithmetic instruction with an inline fast path for two numbers.
+void EmitArithmetic(Assembler *as, uint8_t opcode, uint8_t sse_opcode, uint8_t *ip)
+{
+    Load(as, RAX, REG_STACK_TOP, -2 * (int32_t)sizeof(Value));
+    size_t slow_a = CheckNumber(as, RAX);
+    Load(as, RDX, REG_STACK_TOP, -(int32_t)sizeof(Value));
+    size_t slow_b = CheckNumber(as, RDX);
+    MoveToXmm(as, 0, RAX);
+    MoveToXmm(as, 1, RDX);
+    Sse(as, 0xF2, sse_opcode, 0, 1);
+    MoveFromXmm(as, RAX, 0);
+    Store(as, REG_STACK_TOP, -2 * (int32_t)sizeof(Value), RAX);
+    AddImmediate(as, REG_STACK_TOP, -(int32_t)sizeof(Value));
+    size_t done = Jump(as);
+    PatchHere(as, slow_a);
+    PatchHere(as, slow_b);
+    CallHelper(as, ArithmeticHelper, opcode, ip);
+    PatchHere(as, done);
+}
+
+/// @brief Emits OP_LESS or OP_GREATER with an inline fast path for two numbers.
+void EmitComparison(Assembler *as, uint8_t opcode, bool less, uint8_t *ip)
+{
+    Load(as, RAX, REG_STACK_TOP, -2 * (int32_t)sizeof(Value));
+    size_t slow_a = CheckNumber(as, RAX);
+    Load(as, RDX, REG_STACK_TOP, -(int32_t)sizeof(Value));
+    size_t slow_b = CheckNumber(as, RDX);
+    MoveToXmm(as, 0, RAX);
+    MoveToXmm(as, 1, RDX);
+    // "Above" is false for unordered operands, so NaN compares false either way.
+    if (less)
+        Sse(as, 0x66, 0x2E, 1, 0);
+    else
+        Sse(as, 0x66, 0x2E, 0, 1);
+    SetConditionAsBool(as, CC_ABOVE);
+    Store(as, REG_STACK_TOP, -2 * (int32_t)sizeof(Value), RAX);
+    AddImmediate(as, REG_STACK_TOP, -(int32_t)sizeof(Value));
+    size_t done = Jump(as);
+    PatchHere(as, slow_a);
+    PatchHere(as, slow_b);
+    CallHelper(as, ArithmeticHelper, opcode, ip);
+    PatchHere(as, done);
+}
+
+/// @brief Emits a recorded instruction of a trace.
+void EmitTraceStep(Assembler *as, TraceStep *step, size_t loop_start)
+{
+    uint8_t *ip = step->ip;
+    uint8_t *next = ip + lox_InstructionLength(ip[0]);
+    bool numbers = step->observed & TRACE_NUMBERS;
+    bool taken = step->observed & TRACE_TAKEN;
+    uint8_t sse_opcode = 0;
+
+    switch (ip[0])
+    {
+    case OP_ADD:
+    case OP_ADD_NUMBER:
+    case OP_ADD_STRING:
+        if (!numbers)
+        {
+            // Recorded with strings. Leave if an operand isn't text, like the numeric steps do
+            // when an operand isn't a number.
+            Load(as, RAX, REG_STACK_TOP, -2 * (int32_t)sizeof(Value));
+            GuardText(as, RAX, ip);
+            Load(as, RAX, REG_STACK_TOP, -(int32_t)sizeof(Value));
+            GuardText(as, RAX, ip);
+            CallHelper(as, ArithmeticHelper, OP_ADD, next);
+            break;
+        }
+        sse_opcode = 0x58;
+        goto arithmetic;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUMBER:
+        sse_opcode = 0x5C;
+        goto arithmetic;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUMBER:
+        sse_opcode = 0x59;
+        goto arithmetic;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUMBER:
+        sse_opcode = 0x5E;
+    arithmetic:
+        EmitNumberOperands(as, ip);
+        Sse(as, 0xF2, sse_opcode, 0, 1);
+        MoveFromXmm(as, RAX, 0);
+        Store(as, REG_STACK_TOP, -2 * (int32_t)sizeof(Value), RAX);
+        AddImmediate(as, REG_STACK_TOP, -(int32_t)sizeof(Value));
+        break;
+    case OP_LESS:
+    case OP_LESS_NUMBER:
+    case OP_GREATER:
+    case OP_GREATER_NUMBER:
+        EmitNumberOperands(as, ip);
+        if (ip[0] == OP_LESS || ip[0] == OP_LESS_NUMBER)
+            Sse(as, 0x66, 0x2E, 1, 0);
+        else
+            Sse(as, 0x66, 0x2E, 0, 1);
+        SetConditionAsBool(as, CC_ABOVE);
+        Store(as, REG_STACK_TOP, -2 * (int32_t)sizeof(Value), RAX);
+        AddImmediate(as, REG_STACK_TOP, -(int32_t)sizeof(Value));
+        break;
+    case OP_NEGATE:
+        Load(as, RAX, REG_STACK_TOP, -(int32_t)sizeof(Value));
+        GuardNumber(as, RAX, ip);
+        // btc rax, 63
+        Rex(as, 0, RAX);
+        Byte(as, 0x0F);
+        Byte(as, 0xBA);
+        Byte(as, 0xF8);
+        Byte(as, 63);
+        Store(as, REG_STACK_TOP, -(int32_t)sizeof(Value), RAX);
+        break;
+    case OP_INCREMENT_LOCAL:
+    {
+        if (!numbers)
+        {
+            CallHelper(as, IncrementLocalHelper, (ip[2] << 8) | ip[1], next);
+            break;
+        }
+        int32_t slot = ip[1] * sizeof(Value);
+        Load(as, RAX, REG_SLOTS, slot);
+        GuardNumber(as, RAX, ip);
+        MoveToXmm(as, 0, RAX);
+        MoveImmediate(as, RDX, as->function->chunk.constants.values[ip[2]]);
+        MoveToXmm(as, 1, RDX);
+        Sse(as, 0xF2, 0x58, 0, 1);
+        MoveFromXmm(as, RAX, 0);
+        Store(as, REG_SLOTS, slot, RAX);
+        break;
+    }
+    case OP_LESS_JUMP_IF_FALSE:
+        EmitNumberOperands(as, ip);
+        Sse(as, 0x66, 0x2E, 1, 0);
+        // Leave if the comparison goes the other way than it did when recorded.
+        ExitIf(as, taken ? CC_ABOVE : CC_BELOW_EQUAL, ip);
+        AddImmediate(as, REG_STACK_TOP, -2 * (int32_t)sizeof(Value));
+        if (taken)
+            PushImmediate(as, FALSE_VAL);
+        break;
+    case OP_JUMP_IF_FALSE:
+        Load(as, RAX, REG_STACK_TOP, -(int32_t)sizeof(Value));
+        MoveImmediate(as, RCX, NIL_VAL);
+        Alu(as, 0x39, RAX, RCX);
+        if (taken)
+        {
+            size_t is_nil = JumpIf(as, CC_EQUAL);
+            MoveImmediate(as, RCX, FALSE_VAL);
+            Alu(as, 0x39, RAX, RCX);
+            ExitIf(as, CC_NOT_EQUAL, ip);
+            PatchHere(as, is_nil);
+        }
+        else
+        {
+            ExitIf(as, CC_EQUAL, ip);
+            MoveImmediate(as, RCX, FALSE_VAL);
+            Alu(as, 0x39, RAX, RCX);
+            ExitIf(as, CC_EQUAL, ip);
+        }
+        break;
+    case OP_JUMP:
+        // The trace already continues at the target.
+        break;
+    case OP_LOOP:
+        // Other back-edges are followed by the recording, like forward jumps.
+        if (step->observed & TRACE_CLOSES_LOOP)
+        {
+            EmitFuelCheck(as, (ip[1] << 8) | ip[2], next);
+            JumpBack(as, loop_start);
+        }
+        break;
+    default:
+        EmitInstruction(as, (int)(ip - as->function->chunk.code));
+        break;
+    }
+}
+
+/// @brief Loads the two operands on top of the stack into xmm0 and xmm1, guarding that they are
+///        numbers. The stack is left alone, so a failing guard can resume at 'ip'.
+void EmitNumberOperands(Assembler *as, uint8_t *ip)
+{
+    Load(as, RAX, REG_STACK_TOP, -2 * (int32_t)sizeof(Value));
+    GuardNumber(as, RAX, ip);
+    Load(as, RDX, REG_STACK_TOP, -(int32_t)sizeof(Value));
+    GuardNumber(as, RDX, ip);
+    MoveToXmm(as, 0, RAX);
+    MoveToXmm(as, 1, RDX);
+}
+
+/// @brief Charges a back-edge to vm->fuel like the interpreter does, and calls lox_Safepoint
+///        once it runs out.
+void EmitFuelCheck(Assembler *as, int32_t charge, uint8_t *ip)
+{
+    // sub qword [rax + offsetof(VM, fuel)], charge
+    Load(as, RAX, RSP, VM_SLOT);
+    Rex(as, 0, RAX);
+    Byte(as, 0x81);
+    MemoryOperand(as, 5, RAX, offsetof(VM, fuel));
+    Int32(as, charge);
+    size_t left = JumpIf(as, CC_NOT_SIGN);
+    CallHelper(as, SafepointHelper, 0, ip);
+    PatchHere(as, left);
+}
+
+/// @brief Emits the code run when a guard fails: the frame's ip is set to where the interpreter
+///        resumes, the stack top is written back, and native code returns.
+void EmitSideExits(Assembler *as)
+{
+    if (as->exit_count == 0)
+        return;
+
+    size_t side_exit = as->count;
+    Store(as, REG_FRAME, offsetof(CallFrame, ip), RAX);
+    Load(as, RCX, RSP, VM_SLOT);
+    Store(as, RCX, offsetof(VM, stack_top), REG_STACK_TOP);
+    JumpToTarget(as, Jump(as), TARGET_OK_EXIT);
+
+    for (int i = 0; i < as->exit_count; i++)
+    {
+        PatchHere(as, as->exits[i].at);
+        MoveImmediate(as, RAX, (uint64_t)(uintptr_t)as->exits[i].ip);
+        JumpBack(as, side_exit);
+    }
+}
+
+/// @brief Slow path for arithmetic, comparisons and negation: concatenates strings for OP_ADD and
+///        reports a runtime error for everything else.
+Value *ArithmeticHelper(VM *vm, CallFrame *frame, Value *stack_top, int opcode, uint8_t *ip)
+{
+    frame->ip = ip;
+    vm->stack_top = stack_top;
+
+    if (opcode == OP_ADD && IS_TEXT(stack_top[-1]) && IS_TEXT(stack_top[-2]))
+        return lox_Concatenate(vm) ? vm->stack_top : NULL;
+
+    if (opcode == OP_ADD)
+        lox_RuntimeError(vm, "Operands must be two numbers or two strings.");
+    else if (opcode == OP_NEGATE)
+        lox_RuntimeError(vm, "Operand must be a number.");
+    else
+        lox_RuntimeError(vm, "Operands must be numbers.");
+    return NULL;
+}
+
+Value *IncrementLocalHelper(VM *vm, CallFrame *frame, Value *stack_top, int operand, uint8_t *ip)
+{
+    frame->ip = ip;
+    uint8_t slot = operand & 0xFF;
+    Value constant = frame->function->chunk.constants.values[operand >> 8];
+    Value value = frame->slots[slot];
+
+    if (IS_NUMBER(value) && IS_NUMBER(constant))
+    {
+        frame->slots[slot] = NUMBER_VAL(AS_NUMBER(value) + AS_NUMBER(constant));
+        return stack_top;
+    }
+
+    stack_top[0] = value;
+    stack_top[1] = constant;
+    vm->stack_top = stack_top + 2;
+    if (IS_TEXT(value) && IS_TEXT(constant))
+    {
+        if (!lox_Concatenate(vm))
+            return NULL;
+        frame->slots[slot] = lox_PopStack(vm);
+        return vm->stack_top;
+    }
+
+    vm->stack_top = stack_top;
+    lox_RuntimeError(vm, "Operands must be two numbers or two strings.");
+    return NULL;
+}
+
+Value *UndefinedGlobalHelper(VM *vm, CallFrame *frame, Value *stack_top, int slot, uint8_t *ip)
+{
+    frame->ip = ip;
+    vm->stack_top = stack_top;
+    lox_RuntimeError(vm, "Undefined variable '%s'.", AS_STRING(vm->global_names.values[slot])->chars);
+    return NULL;
+}
+
+Value *PrintHelper(VM *vm, CallFrame *frame, Value *stack_top, int operand, uint8_t *ip)
+{
+    lox_PrintValue(stack_top[-1]);
+    printf("\n");
+    return stack_top - 1;
+}
+
+Value *ClosureHelper(VM *vm, CallFrame *frame, Value *stack_top, int constant, uint8_t *ip)
+{
+    frame->ip = ip;
+    vm->stack_top = stack_top;
+    ObjFunction *function = AS_FUNCTION(frame->function->chunk.constants.values[constant]);
+    lox_PushStack(vm, OBJ_VAL(lox_CreateClosure(vm, function)));
+    return vm->stack_top;
+}
+
+/// @brief Calls the callee below the arguments, and runs it to completion if it's a Lox function.
+Value *CallHelperFunction(VM *vm, CallFrame *frame, Value *stack_top, int arg_count, uint8_t *ip)
+{
+    frame->ip = ip;
+    vm->stack_top = stack_top;
+
+    ObjFiber *fiber = vm->fiber;
+    int frame_count = vm->frame_count;
+    if (!lox_CallValue(vm, stack_top[-1 - arg_count], arg_count))
+        return NULL;
+
+    if (vm->fiber != fiber)
+        return WaitForFiber(vm, fiber, frame_count);
+
+    if (vm->frame_count > frame_count)
+    {
+        JitResult result = lox_JitRunFrame(vm, &vm->frames[vm->frame_count - 1]);
+        if (result == JIT_NOT_COMPILED)
+            result = lox_RunFrames(vm, fiber, frame_count) == INTERPRET_OK ? JIT_OK : JIT_ERROR;
+        if (result == JIT_ERROR)
+            return NULL;
+    }
+
+    return vm->stack_top;
+}
+
+/// @brief Calls the callee below the arguments from tail position.
+/// @return TAIL_CALLED if the callee took over the frame, or the stack top after a native call.
+Value *TailCallHelper(VM *vm, CallFrame *frame, Value *stack_top, int arg_count, uint8_t *ip)
+{
+    frame->ip = ip;
+    vm->stack_top = stack_top;
+
+    ObjFiber *fiber = vm->fiber;
+    int frame_count = vm->frame_count;
+    if (!lox_TailCallValue(vm, stack_top[-1 - arg_count], arg_count))
+        return NULL;
+
+    if (vm->fiber != fiber)
+        return WaitForFiber(vm, fiber, frame_count);
+
+    return frame->ip != ip ? TAIL_CALLED : vm->stack_top;
+}
+
+/// @brief Pops the frame and leaves the result where the callee was, like OP_RETURN.
+Value *ReturnHelper(VM *vm, CallFrame *frame, Value *stack_top, int operand, uint8_t *ip)
+{
+    Value result = stack_top[-1];
+    vm->frame_count--;
+    frame->slots[0] = result;
+    vm->stack_top = frame->slots + 1;
+    return vm->stack_top;
+}
+
+/// @brief Stops at a back-edge once vm->fuel has run out(see lox_Safepoint).
+Value *SafepointHelper(VM *vm, CallFrame *frame, Value *stack_top, int operand, uint8_t *ip)
+{
+    frame->ip = ip;
+    vm->stack_top = stack_top;
+    return lox_Safepoint(vm) ? stack_top : NULL;
+}
+
+/// @brief Called after a native called from native code switched fibers, by resuming or yielding.
+///        Native code can't be suspended, so the other fibers run in the interpreter until
+///        'fiber' is back at 'frame_count' frames, with the result of the call on its stack.
+/// @return the stack top of 'fiber', or NULL after a runtime error.
+Value *WaitForFiber(VM *vm, ObjFiber *fiber, int frame_count)
+{
+    if (lox_RunFrames(vm, fiber, frame_count) != INTERPRET_OK)
+        return NULL;
+    return vm->stack_top;
+}
+
+#endif
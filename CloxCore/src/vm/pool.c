@@ -0,0 +1,102 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "vm/pool.h"
+#include "core/memory.h"
+
+// What the workers of a pool share. Everything but 'next' and 'failed' is read-only.
+typedef struct
+{
+    VM *owner;
+    ObjFunction *script;
+    const char *entry;
+    const char **inputs;
+    int input_count;
+    // Index of the next input to take.
+    atomic_int next;
+    atomic_int failed;
+    // Set once a missing entry function has been reported, so it's reported once per pool.
+    atomic_bool reported;
+} Pool;
+
+static void *RunWorker(void *arg);
+
+/// @brief Runs the compiled 'script' on 'worker_count' threads, calling its function 'entry'
+///        once per input. The script is compiled once, by 'owner', and its functions and
+///        constants are shared. Each worker has its own VM(see lox_InitSharedVM), which runs the
+///        script to define its globals and then takes inputs until there are none left.
+///        Inputs are taken by incrementing a shared index, which keeps every worker busy without
+///        locks until the queue runs dry.
+/// @param owner compiled 'script'. It may have run it before, but must be left untouched until
+///        the workers are done.
+/// @param entry names the global function called with each input as its only argument.
+/// @param inputs are passed to 'entry' as strings.
+/// @return the number of inputs that failed, or -1 if the workers couldn't be started.
+int lox_RunPool(VM *owner, ObjFunction *script, const char *entry,
+                const char **inputs, int input_count, int worker_count)
+{
+    if (worker_count < 1)
+        worker_count = 1;
+    if (worker_count > POOL_MAX_WORKERS)
+        worker_count = POOL_MAX_WORKERS;
+
+    Pool pool = {.owner = owner, .script = script, .entry = entry,
+                 .inputs = inputs, .input_count = input_count};
+    atomic_init(&pool.next, 0);
+    atomic_init(&pool.failed, 0);
+    atomic_init(&pool.reported, false);
+
+    // The workers share the owner's objects, which mustn't move while they run.
+    lox_CollectNursery(owner);
+    pthread_t threads[POOL_MAX_WORKERS];
+    int started = 0;
+    for (; started < worker_count; started++)
+    {
+        if (pthread_create(&threads[started], NULL, RunWorker, &pool) != 0)
+            break;
+    }
+
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    if (started == 0)
+        return -1;
+    return atomic_load(&pool.failed);
+}
+
+void *RunWorker(void *arg)
+{
+    Pool *pool = arg;
+    VM vm;
+    lox_InitSharedVM(&vm, pool->owner);
+    vm.frames_max = pool->owner->frames_max;
+
+    Value entry;
+    bool ready = lox_CallFunction(&vm, OBJ_VAL(pool->script), 0, NULL, NULL) == INTERPRET_OK;
+    if (ready && !(lox_GetGlobal(&vm, pool->entry, &entry) && (IS_CLOSURE(entry) || IS_FUNCTION(entry))))
+    {
+        if (!atomic_exchange(&pool->reported, true))
+            fprintf(stderr, "Entry function '%s' is not defined.\n", pool->entry);
+        ready = false;
+    }
+
+    int index;
+    while ((index = atomic_fetch_add(&pool->next, 1)) < pool->input_count)
+    {
+        if (!ready)
+        {
+            atomic_fetch_add(&pool->failed, 1);
+            continue;
+        }
+
+        const char *input = pool->inputs[index];
+        Value argument = OBJ_VAL(lox_CopyString(&vm, input, (int)strlen(input)));
+        if (lox_CallFunction(&vm, entry, 1, &argument, NULL) != INTERPRET_OK)
+            atomic_fetch_add(&pool->failed, 1);
+    }
+
+    lox_FreeVM(&vm);
+    return NULL;
+}
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "vm/profiler.h"
+#include "core/chunk.h"
+#include "core/debug.h"
+
+// Must be a power of two.
+#define NGRAM_TABLE_CAPACITY (1 << 16)
+
+typedef struct
+{
+    // Opcodes packed one per byte, with the length of the sequence in the top byte.
+    // Zero marks an empty bucket.
+    uint64_t key;
+    uint64_t count;
+} NgramEntry;
+
+typedef struct
+{
+    uint8_t window[NGRAM_MAX];
+    int window_length;
+    uint8_t *next_ip;
+    NgramEntry *entries;
+    int entry_count;
+    uint64_t instructions;
+} Profiler;
+
+static Profiler profiler;
+
+static void RecordNgram(uint64_t key);
+static int CompareEntries(const void *a, const void *b);
+
+/// @brief Records the instruction at 'ip' and every opcode sequence of length 2 to NGRAM_MAX
+///        that ends with it. Sequences only span instructions that follow each other in the chunk,
+///        so taken jumps, calls and returns start a new window.
+/// @param ip points to the opcode of the instruction about to execute.
+void lox_ProfileInstruction(uint8_t *ip)
+{
+    if (profiler.entries == NULL)
+    {
+        profiler.entries = calloc(NGRAM_TABLE_CAPACITY, sizeof(NgramEntry));
+    }
+
+    if (ip != profiler.next_ip)
+    {
+        profiler.window_length = 0;
+    }
+
+    uint8_t opcode = *ip;
+    profiler.next_ip = ip + lox_InstructionLength(opcode);
+    profiler.instructions++;
+
+    if (profiler.window_length == NGRAM_MAX)
+    {
+        for (int i = 1; i < NGRAM_MAX; i++)
+            profiler.window[i - 1] = profiler.window[i];
+        profiler.window_length--;
+    }
+    profiler.window[profiler.window_length++] = opcode;
+
+    uint64_t ops = 0;
+    for (int length = 1; length <= profiler.window_length; length++)
+    {
+        ops |= (uint64_t)profiler.window[profiler.window_length - length] << (8 * (length - 1));
+        if (length >= 2)
+            RecordNgram(((uint64_t)length << 56) | ops);
+    }
+}
+
+void lox_PrintProfile()
+{
+    if (profiler.entries == NULL)
+        return;
+
+    NgramEntry *sorted = malloc(sizeof(NgramEntry) * NGRAM_TABLE_CAPACITY);
+    int count = 0;
+    for (int i = 0; i < NGRAM_TABLE_CAPACITY; i++)
+    {
+        if (profiler.entries[i].key != 0)
+            sorted[count++] = profiler.entries[i];
+    }
+    qsort(sorted, count, sizeof(NgramEntry), CompareEntries);
+
+    printf("== opcode n-grams (%llu instructions) ==\n", (unsigned long long)profiler.instructions);
+    for (int length = 2; length <= NGRAM_MAX; length++)
+    {
+        printf("-- length %d --\n", length);
+        int printed = 0;
+        for (int i = 0; i < count && printed < 10; i++)
+        {
+            if ((int)(sorted[i].key >> 56) != length)
+                continue;
+
+            printf("%12llu %5.1f%% ", (unsigned long long)sorted[i].count,
+                   100.0 * sorted[i].count / profiler.instructions);
+            // Opcodes are packed with the most recent one in the lowest byte.
+            for (int j = length - 1; j >= 0; j--)
+            {
+                printf(" %s", lox_OpcodeName((sorted[i].key >> (8 * j)) & 0xFF));
+            }
+            printf("\n");
+            printed++;
+        }
+    }
+
+    free(sorted);
+}
+
+void RecordNgram(uint64_t key)
+{
+    uint64_t hash = key * 0x9E3779B97F4A7C15ull;
+    uint32_t index = (uint32_t)(hash >> 48) & (NGRAM_TABLE_CAPACITY - 1);
+    for (;;)
+    {
+        NgramEntry *entry = &profiler.entries[index];
+        if (entry->key == key)
+        {
+            entry->count++;
+            return;
+        }
+        if (entry->key == 0)
+        {
+            // Keep the table sparse enough for probing to terminate. N-grams seen after that are dropped.
+            if (profiler.entry_count >= NGRAM_TABLE_CAPACITY * 3 / 4)
+                return;
+            profiler.entry_count++;
+            entry->key = key;
+            entry->count = 1;
+            return;
+        }
+
+        index = (index + 1) & (NGRAM_TABLE_CAPACITY - 1);
+    }
+}
+
+int CompareEntries(const void *a, const void *b)
+{
+    const NgramEntry *entry_a = a;
+    const NgramEntry *entry_b = b;
+    if (entry_a->count == entry_b->count)
+        return 0;
+    return entry_a->count < entry_b->count ? 1 : -1;
+}
@@ -0,0 +1,698 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm/scheduler.h"
+#include "core/memory.h"
+
+typedef enum
+{
+    // Not created yet.
+    TASK_NONE,
+    // Waiting in a deque, or running.
+    TASK_QUEUED,
+    TASK_DONE,
+    // A runtime error ended it. The error has been reported.
+    TASK_FAILED,
+} TaskState;
+
+// A value passed between VMs. Strings are copied out of the sender's heap. Functions are part of
+// the shared code, so they can be passed as they are.
+typedef struct
+{
+    Value value;
+    // The characters of a string, or NULL.
+    char *chars;
+    int length;
+} TaskValue;
+
+// A fiber waiting in join.
+typedef struct Joiner
+{
+    TaskWorker *worker;
+    ObjFiber *fiber;
+    // The task the fiber runs, and the task it waits for.
+    int task;
+    int joined;
+    struct Joiner *next;
+    // The joiners of the fibers parked on 'worker'. Only its thread uses these links.
+    struct Joiner *parked_previous;
+    struct Joiner *parked_next;
+} Joiner;
+
+typedef struct
+{
+    atomic_int state;
+    Value function;
+    TaskValue argument;
+    TaskValue result;
+    // Guards the result and the joiners.
+    pthread_mutex_t lock;
+    Joiner *joiners;
+} Task;
+
+// The ids of queued tasks. The owning thread pushes and pops at the bottom, thieves take from
+// the top.
+typedef struct
+{
+    pthread_mutex_t lock;
+    int *ids;
+    int start;
+    int count;
+    int capacity;
+} TaskDeque;
+
+typedef struct
+{
+    VM *owner;
+    TaskWorker *workers;
+    int thread_count;
+    // Threads taking part. Lowered if some couldn't be started.
+    atomic_int worker_count;
+    _Atomic(Task *) blocks[TASK_MAX_BLOCKS];
+    atomic_int next_id;
+    int root;
+    // Tasks in all deques, and threads waiting for work.
+    atomic_int queued;
+    atomic_int sleepers;
+    // Guards the rest, and the woken fibers of every worker.
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    int woken;
+    // Set once the root task has finished, or every task is waiting in join.
+    bool finished;
+    bool deadlock;
+} Scheduler;
+
+struct TaskWorker
+{
+    Scheduler *scheduler;
+    int index;
+    VM vm;
+    pthread_t thread;
+    TaskDeque deque;
+    // Fibers whose joined task has finished. woken_count is read without the lock, to skip
+    // taking it when there are none.
+    Joiner *woken;
+    atomic_int woken_count;
+    // Every fiber of this thread waiting in join, whether woken or not. They're only
+    // reachable from here, so the collector marks them through this list.
+    Joiner *parked;
+    // The fiber running a task, and the task's id.
+    ObjFiber *current;
+    int current_task;
+    Value run_native;
+    uint32_t seed;
+};
+
+static void *RunWorker(void *arg);
+static void RunTaskFiber(TaskWorker *worker, ObjFiber *fiber, int id, Value value);
+static bool RunNative(VM *vm, int arg_count, Value *args, Value *result);
+static int NewTask(Scheduler *scheduler, Value function, TaskValue argument);
+static Task *GetTask(Scheduler *scheduler, double id);
+static void FinishTask(Scheduler *scheduler, int id, TaskState state, TaskValue result);
+static void PushTask(Scheduler *scheduler, TaskDeque *deque, int id);
+static int TakeTask(Scheduler *scheduler, TaskDeque *deque, bool bottom);
+static int StealTask(TaskWorker *worker);
+static Joiner *TakeWoken(TaskWorker *worker);
+static void Park(TaskWorker *worker, Joiner *joiner);
+static void Unpark(TaskWorker *worker, Joiner *joiner);
+static bool Sleep(TaskWorker *worker);
+static bool PackValue(Value value, TaskValue *packed);
+static Value UnpackValue(VM *vm, TaskValue *packed);
+static void FreeScheduler(Scheduler *scheduler);
+
+bool lox_TaskNative(VM *vm, int arg_count, Value *args, Value *result)
+{
+    ObjFunction *function = NULL;
+    if ((arg_count == 1 || arg_count == 2) && IS_CLOSURE(args[0]))
+        function = AS_CLOSURE(args[0])->function;
+    else if ((arg_count == 1 || arg_count == 2) && IS_FUNCTION(args[0]))
+        function = AS_FUNCTION(args[0]);
+
+    if (function == NULL || function->arity > 1)
+    {
+        lox_RuntimeError(vm, "Expected a function taking at most one argument, and an optional value.");
+        return false;
+    }
+
+    TaskWorker *worker = vm->task_worker;
+    if (worker == NULL)
+    {
+        lox_RuntimeError(vm, "Tasks only run on a scheduler's threads.");
+        return false;
+    }
+
+    TaskValue argument = {.value = NIL_VAL};
+    if (arg_count == 2 && !PackValue(args[1], &argument))
+    {
+        lox_RuntimeError(vm, "Can only pass nil, booleans, numbers, strings and functions to a task.");
+        return false;
+    }
+
+    int id = NewTask(worker->scheduler, OBJ_VAL(function), argument);
+    if (id < 0)
+    {
+        free(argument.chars);
+        lox_RuntimeError(vm, "Too many tasks.");
+        return false;
+    }
+
+    PushTask(worker->scheduler, &worker->deque, id);
+    *result = NUMBER_VAL(id);
+    return true;
+}
+
+bool lox_JoinNative(VM *vm, int arg_count, Value *args, Value *result)
+{
+    TaskWorker *worker = vm->task_worker;
+    if (worker == NULL)
+    {
+        lox_RuntimeError(vm, "Tasks only run on a scheduler's threads.");
+        return false;
+    }
+
+    Task *task;
+    if (arg_count != 1 || !IS_NUMBER(args[0]) || (task = GetTask(worker->scheduler, AS_NUMBER(args[0]))) == NULL)
+    {
+        lox_RuntimeError(vm, "Expected a task.");
+        return false;
+    }
+
+    int id = (int)AS_NUMBER(args[0]);
+    if (vm->fiber != worker->current)
+    {
+        lox_RuntimeError(vm, "Can only join from a task, not from a fiber it resumed.");
+        return false;
+    }
+    if (id == worker->current_task)
+    {
+        lox_RuntimeError(vm, "A task can't join itself.");
+        return false;
+    }
+
+    pthread_mutex_lock(&task->lock);
+    int state = atomic_load(&task->state);
+    if (state != TASK_QUEUED)
+    {
+        pthread_mutex_unlock(&task->lock);
+        *result = state == TASK_DONE ? UnpackValue(vm, &task->result) : NIL_VAL;
+        return true;
+    }
+
+    Joiner *joiner = malloc(sizeof(Joiner));
+    *joiner = (Joiner){.worker = worker, .fiber = vm->fiber, .task = worker->current_task,
+                       .joined = id, .next = task->joiners};
+    task->joiners = joiner;
+    pthread_mutex_unlock(&task->lock);
+    Park(worker, joiner);
+
+    // Switch back to the worker, which resumes the fiber once the task has finished. That
+    // happens on this thread, so it can't happen before the switch.
+    ObjFiber *fiber = vm->fiber;
+    fiber->state = FIBER_WAITING;
+    vm->transfer_to = fiber->resumer;
+    fiber->resumer = NULL;
+    *result = NIL_VAL;
+    return true;
+}
+
+/// @brief Calls 'entry' as the root task, and runs tasks on 'thread_count' threads until it has
+///        finished. The owner has run the script that defines 'entry'. Each thread gets a VM
+///        that shares the owner's code and starts out with the owner's globals. The owner must
+///        not run anything until the threads are done.
+/// @param entry is a function taking at most one argument. It's called with nil.
+/// @param result receives the root task's result, unless it is NULL.
+/// @return INTERPRET_RUNTIME_ERROR if the root task failed, or every task was left waiting in
+///         join. The error has been reported.
+InterpretResult lox_RunTasks(VM *owner, Value entry, int thread_count, Value *result)
+{
+    TaskValue argument = {.value = NIL_VAL};
+    if (!(IS_CLOSURE(entry) || IS_FUNCTION(entry)) || !PackValue(entry, &argument) ||
+        AS_FUNCTION(argument.value)->arity > 1)
+    {
+        fprintf(stderr, "The root task must be a function taking at most one argument.\n");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    if (thread_count < 1)
+        thread_count = 1;
+    if (thread_count > SCHEDULER_MAX_THREADS)
+        thread_count = SCHEDULER_MAX_THREADS;
+
+    Scheduler *scheduler = calloc(1, sizeof(Scheduler));
+    scheduler->owner = owner;
+    scheduler->workers = calloc(thread_count, sizeof(TaskWorker));
+    scheduler->thread_count = thread_count;
+    atomic_init(&scheduler->worker_count, thread_count);
+    atomic_init(&scheduler->next_id, 0);
+    atomic_init(&scheduler->queued, 0);
+    atomic_init(&scheduler->sleepers, 0);
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->work, NULL);
+    pthread_cond_init(&scheduler->done, NULL);
+    for (int i = 0; i < thread_count; i++)
+    {
+        TaskWorker *worker = &scheduler->workers[i];
+        worker->scheduler = scheduler;
+        worker->index = i;
+        worker->seed = 2654435761u * (i + 1);
+        atomic_init(&worker->woken_count, 0);
+        pthread_mutex_init(&worker->deque.lock, NULL);
+    }
+
+    // The threads share the owner's objects, which mustn't move while they run.
+    lox_CollectNursery(owner);
+    scheduler->root = NewTask(scheduler, argument.value, (TaskValue){.value = NIL_VAL});
+    PushTask(scheduler, &scheduler->workers[0].deque, scheduler->root);
+
+    int started = 0;
+    for (; started < thread_count; started++)
+    {
+        if (pthread_create(&scheduler->workers[started].thread, NULL, RunWorker, &scheduler->workers[started]) != 0)
+            break;
+    }
+
+    InterpretResult status = INTERPRET_RUNTIME_ERROR;
+    pthread_mutex_lock(&scheduler->lock);
+    atomic_store(&scheduler->worker_count, started);
+    if (started == 0)
+        scheduler->finished = true;
+    while (!scheduler->finished)
+        pthread_cond_wait(&scheduler->done, &scheduler->lock);
+    pthread_cond_broadcast(&scheduler->work);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(scheduler->workers[i].thread, NULL);
+
+    Task *root = GetTask(scheduler, scheduler->root);
+    if (started == 0)
+        fprintf(stderr, "Error: Can't start threads.\n");
+    else if (scheduler->deadlock)
+        fprintf(stderr, "Deadlock: every task is waiting in join.\n");
+    else if (atomic_load(&root->state) == TASK_DONE)
+        status = INTERPRET_OK;
+
+    if (result != NULL)
+        *result = status == INTERPRET_OK ? UnpackValue(owner, &root->result) : NIL_VAL;
+    FreeScheduler(scheduler);
+    return status;
+}
+
+/// @brief Marks the fibers of the VM's scheduler thread that wait in join.
+void lox_MarkTaskRoots(VM *vm)
+{
+    TaskWorker *worker = vm->task_worker;
+    if (worker == NULL)
+        return;
+
+    for (Joiner *joiner = worker->parked; joiner != NULL; joiner = joiner->parked_next)
+        lox_MarkObject(vm, (Obj *)joiner->fiber);
+}
+
+void *RunWorker(void *arg)
+{
+    TaskWorker *worker = arg;
+    Scheduler *scheduler = worker->scheduler;
+    VM *vm = &worker->vm;
+    lox_InitSharedVM(vm, scheduler->owner);
+    vm->frames_max = scheduler->owner->frames_max;
+    vm->task_worker = worker;
+    worker->run_native = OBJ_VAL(lox_CreateNative(vm, RunNative));
+    lox_WriteValueArray(vm, &vm->handles, worker->run_native);
+
+    while (true)
+    {
+        // Fibers that were waiting in join go first, since they hold on to their stacks.
+        Joiner *joiner = TakeWoken(worker);
+        if (joiner != NULL)
+        {
+            while (joiner != NULL)
+            {
+                Joiner *next = joiner->next;
+                Task *joined = GetTask(scheduler, joiner->joined);
+                Value value = atomic_load(&joined->state) == TASK_DONE ? UnpackValue(vm, &joined->result)
+                                                                       : NIL_VAL;
+                Unpark(worker, joiner);
+                RunTaskFiber(worker, joiner->fiber, joiner->task, value);
+                free(joiner);
+                joiner = next;
+            }
+            continue;
+        }
+
+        int id = TakeTask(scheduler, &worker->deque, true);
+        if (id < 0)
+            id = StealTask(worker);
+        if (id >= 0)
+        {
+            Task *task = GetTask(scheduler, id);
+            ObjFiber *fiber = lox_CreateFiber(vm, task->function);
+            fiber->spawned = true;
+            RunTaskFiber(worker, fiber, id, UnpackValue(vm, &task->argument));
+            continue;
+        }
+
+        if (!Sleep(worker))
+            break;
+    }
+
+    lox_FreeVM(vm);
+    return NULL;
+}
+
+/// @brief Runs a task's fiber until its function returns or it waits in join.
+/// @param value is passed to the function when it starts, and otherwise returned from join.
+void RunTaskFiber(TaskWorker *worker, ObjFiber *fiber, int id, Value value)
+{
+    worker->current = fiber;
+    worker->current_task = id;
+    Value args[] = {OBJ_VAL(fiber), value};
+    Value result;
+    InterpretResult status = lox_CallFunction(&worker->vm, worker->run_native, 2, args, &result);
+    worker->current = NULL;
+
+    TaskValue packed = {.value = NIL_VAL};
+    if (status != INTERPRET_OK)
+    {
+        FinishTask(worker->scheduler, id, TASK_FAILED, packed);
+    }
+    else if (fiber->state == FIBER_DONE)
+    {
+        if (PackValue(result, &packed))
+        {
+            FinishTask(worker->scheduler, id, TASK_DONE, packed);
+        }
+        else
+        {
+            fprintf(stderr, "Task %d returned a value that can't be passed between tasks.\n", id);
+            FinishTask(worker->scheduler, id, TASK_FAILED, (TaskValue){.value = NIL_VAL});
+        }
+    }
+}
+
+/// @brief Switches from the worker's main fiber to a task's fiber. Like resume, but the task's
+///        fiber is spawned, and may be waiting in join.
+bool RunNative(VM *vm, int arg_count, Value *args, Value *result)
+{
+    ObjFiber *fiber = AS_FIBER(args[0]);
+    fiber->resumer = vm->fiber;
+    vm->transfer_to = fiber;
+    *result = args[1];
+    return true;
+}
+
+/// @return the new task's id, or -1 if there are too many tasks.
+int NewTask(Scheduler *scheduler, Value function, TaskValue argument)
+{
+    int id = atomic_fetch_add(&scheduler->next_id, 1);
+    if (id >= TASK_BLOCK_SIZE * TASK_MAX_BLOCKS)
+        return -1;
+
+    _Atomic(Task *) *slot = &scheduler->blocks[id / TASK_BLOCK_SIZE];
+    Task *block = atomic_load(slot);
+    if (block == NULL)
+    {
+        Task *fresh = calloc(TASK_BLOCK_SIZE, sizeof(Task));
+        if (atomic_compare_exchange_strong(slot, &block, fresh))
+            block = fresh;
+        else
+            free(fresh);
+    }
+
+    Task *task = &block[id % TASK_BLOCK_SIZE];
+    task->function = function;
+    task->argument = argument;
+    task->result = (TaskValue){.value = NIL_VAL};
+    pthread_mutex_init(&task->lock, NULL);
+    atomic_store(&task->state, TASK_QUEUED);
+    return id;
+}
+
+/// @return the task with 'id', or NULL if there's none.
+Task *GetTask(Scheduler *scheduler, double id)
+{
+    if (!(id >= 0 && id < atomic_load(&scheduler->next_id) && id < TASK_BLOCK_SIZE * TASK_MAX_BLOCKS) ||
+        id != (int)id)
+        return NULL;
+
+    Task *block = atomic_load(&scheduler->blocks[(int)id / TASK_BLOCK_SIZE]);
+    if (block == NULL)
+        return NULL;
+    Task *task = &block[(int)id % TASK_BLOCK_SIZE];
+    return atomic_load(&task->state) == TASK_NONE ? NULL : task;
+}
+
+/// @brief Stores a task's result and wakes the fibers waiting for it.
+void FinishTask(Scheduler *scheduler, int id, TaskState state, TaskValue result)
+{
+    Task *task = GetTask(scheduler, id);
+    pthread_mutex_lock(&task->lock);
+    task->result = result;
+    atomic_store(&task->state, state);
+    Joiner *joiner = task->joiners;
+    task->joiners = NULL;
+    pthread_mutex_unlock(&task->lock);
+
+    if (joiner == NULL && id != scheduler->root)
+        return;
+
+    pthread_mutex_lock(&scheduler->lock);
+    while (joiner != NULL)
+    {
+        Joiner *next = joiner->next;
+        TaskWorker *worker = joiner->worker;
+        joiner->next = worker->woken;
+        worker->woken = joiner;
+        atomic_fetch_add(&worker->woken_count, 1);
+        scheduler->woken++;
+        joiner = next;
+    }
+    if (id == scheduler->root)
+    {
+        scheduler->finished = true;
+        pthread_cond_signal(&scheduler->done);
+    }
+    pthread_cond_broadcast(&scheduler->work);
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+void PushTask(Scheduler *scheduler, TaskDeque *deque, int id)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity)
+    {
+        int capacity = deque->capacity < 16 ? 16 : deque->capacity * 2;
+        int *ids = malloc(sizeof(int) * capacity);
+        for (int i = 0; i < deque->count; i++)
+            ids[i] = deque->ids[(deque->start + i) % deque->capacity];
+        free(deque->ids);
+        deque->ids = ids;
+        deque->start = 0;
+        deque->capacity = capacity;
+    }
+    deque->ids[(deque->start + deque->count) % deque->capacity] = id;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+
+    // A thread going to sleep counts itself before it checks the queue, and this checks for
+    // sleepers after counting the task, so one of them sees the other.
+    atomic_fetch_add(&scheduler->queued, 1);
+    if (atomic_load(&scheduler->sleepers) > 0)
+    {
+        pthread_mutex_lock(&scheduler->lock);
+        pthread_cond_signal(&scheduler->work);
+        pthread_mutex_unlock(&scheduler->lock);
+    }
+}
+
+/// @brief Takes the newest task from the bottom of a deque, or the oldest from the top.
+/// @return the task's id, or -1 if the deque is empty.
+int TakeTask(Scheduler *scheduler, TaskDeque *deque, bool bottom)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == 0)
+    {
+        pthread_mutex_unlock(&deque->lock);
+        return -1;
+    }
+
+    int id;
+    if (bottom)
+    {
+        id = deque->ids[(deque->start + deque->count - 1) % deque->capacity];
+    }
+    else
+    {
+        id = deque->ids[deque->start];
+        deque->start = (deque->start + 1) % deque->capacity;
+    }
+    deque->count--;
+    pthread_mutex_unlock(&deque->lock);
+    atomic_fetch_sub(&scheduler->queued, 1);
+    return id;
+}
+
+/// @brief Takes the oldest task of another thread, starting from a random one.
+int StealTask(TaskWorker *worker)
+{
+    Scheduler *scheduler = worker->scheduler;
+    int count = atomic_load(&scheduler->worker_count);
+    if (atomic_load(&scheduler->queued) == 0 || count < 2)
+        return -1;
+
+    // xorshift32
+    worker->seed ^= worker->seed << 13;
+    worker->seed ^= worker->seed >> 17;
+    worker->seed ^= worker->seed << 5;
+    int first = (int)(worker->seed % (uint32_t)count);
+    for (int i = 0; i < count; i++)
+    {
+        int victim = (first + i) % count;
+        if (victim == worker->index)
+            continue;
+        int id = TakeTask(scheduler, &scheduler->workers[victim].deque, false);
+        if (id >= 0)
+            return id;
+    }
+    return -1;
+}
+
+Joiner *TakeWoken(TaskWorker *worker)
+{
+    if (atomic_load(&worker->woken_count) == 0)
+        return NULL;
+
+    Scheduler *scheduler = worker->scheduler;
+    pthread_mutex_lock(&scheduler->lock);
+    Joiner *woken = worker->woken;
+    worker->woken = NULL;
+    scheduler->woken -= atomic_exchange(&worker->woken_count, 0);
+    pthread_mutex_unlock(&scheduler->lock);
+    return woken;
+}
+
+/// @brief Waits until there's a task to take or a fiber to resume.
+/// @return false once the scheduler has finished.
+bool Sleep(TaskWorker *worker)
+{
+    Scheduler *scheduler = worker->scheduler;
+    pthread_mutex_lock(&scheduler->lock);
+    atomic_fetch_add(&scheduler->sleepers, 1);
+    while (!scheduler->finished && atomic_load(&scheduler->queued) == 0 && worker->woken == NULL)
+    {
+        if (atomic_load(&scheduler->sleepers) == atomic_load(&scheduler->worker_count) && scheduler->woken == 0)
+        {
+            // No thread is running a task and none can start one, so every task left is
+            // waiting in join.
+            scheduler->deadlock = true;
+            scheduler->finished = true;
+            pthread_cond_signal(&scheduler->done);
+            break;
+        }
+        pthread_cond_wait(&scheduler->work, &scheduler->lock);
+    }
+    atomic_fetch_sub(&scheduler->sleepers, 1);
+    bool running = !scheduler->finished;
+    pthread_mutex_unlock(&scheduler->lock);
+    return running;
+}
+
+/// @return false if the value can't be passed between VMs.
+bool PackValue(Value value, TaskValue *packed)
+{
+    *packed = (TaskValue){.value = value};
+    if (!IS_OBJ(value) || IS_FUNCTION(value) || IS_NATIVE(value))
+        return true;
+
+    if (IS_CLOSURE(value))
+    {
+        packed->value = OBJ_VAL(AS_CLOSURE(value)->function);
+        return true;
+    }
+    if (IS_TEXT(value))
+    {
+        int length = TextLength(AS_OBJ(value));
+        packed->value = NIL_VAL;
+        packed->chars = malloc(length + 1);
+        lox_CopyText(AS_OBJ(value), packed->chars);
+        packed->chars[length] = '\0';
+        packed->length = length;
+        return true;
+    }
+    return false;
+}
+
+Value UnpackValue(VM *vm, TaskValue *packed)
+{
+    if (packed->chars != NULL)
+        return OBJ_VAL(lox_CopyString(vm, packed->chars, packed->length));
+    return packed->value;
+}
+
+void Park(TaskWorker *worker, Joiner *joiner)
+{
+    joiner->parked_previous = NULL;
+    joiner->parked_next = worker->parked;
+    if (worker->parked != NULL)
+        worker->parked->parked_previous = joiner;
+    worker->parked = joiner;
+}
+
+void Unpark(TaskWorker *worker, Joiner *joiner)
+{
+    if (joiner->parked_previous != NULL)
+        joiner->parked_previous->parked_next = joiner->parked_next;
+    else
+        worker->parked = joiner->parked_next;
+    if (joiner->parked_next != NULL)
+        joiner->parked_next->parked_previous = joiner->parked_previous;
+}
+
+void FreeScheduler(Scheduler *scheduler)
+{
+    for (int i = 0; i < TASK_MAX_BLOCKS; i++)
+    {
+        Task *block = atomic_load(&scheduler->blocks[i]);
+        if (block == NULL)
+            continue;
+        for (int j = 0; j < TASK_BLOCK_SIZE; j++)
+        {
+            Task *task = &block[j];
+            if (atomic_load(&task->state) == TASK_NONE)
+                continue;
+            free(task->argument.chars);
+            free(task->result.chars);
+            while (task->joiners != NULL)
+            {
+                Joiner *next = task->joiners->next;
+                free(task->joiners);
+                task->joiners = next;
+            }
+            pthread_mutex_destroy(&task->lock);
+        }
+        free(block);
+    }
+
+    for (int i = 0; i < scheduler->thread_count; i++)
+    {
+        TaskWorker *worker = &scheduler->workers[i];
+        while (worker->woken != NULL)
+        {
+            Joiner *next = worker->woken->next;
+            free(worker->woken);
+            worker->woken = next;
+        }
+        free(worker->deque.ids);
+        pthread_mutex_destroy(&worker->deque.lock);
+    }
+    free(scheduler->workers);
+    pthread_mutex_destroy(&scheduler->lock);
+    pthread_cond_destroy(&scheduler->work);
+    pthread_cond_destroy(&scheduler->done);
+    free(scheduler);
+}
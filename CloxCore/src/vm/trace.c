@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "vm/trace.h"
+
+#ifdef USE_JIT
+
+#include "core/chunk.h"
+
+struct TraceRecorder
+{
+    // The trace being recorded, or NULL.
+    Trace *trace;
+    // Index of the frame running the loop. Instructions of other frames aren't recorded.
+    int frame_index;
+    int recorded;
+    int compiled;
+    int aborted;
+};
+
+static TraceRecorder *GetRecorder(VM *vm);
+static Trace *FindTrace(ObjFunction *function, uint8_t *header);
+static void StartRecording(VM *vm, CallFrame *frame, Trace *trace);
+static void StopRecording(TraceRecorder *recorder, bool complete);
+static bool Observe(TraceRecorder *recorder, CallFrame *frame, uint8_t *ip, Value *stack_top, uint8_t *observed);
+static void AppendStep(Trace *trace, uint8_t *ip, uint8_t observed);
+
+/// @brief Counts a back-edge to 'header'. Once the loop is hot, its next iteration is recorded.
+/// @param frame running the loop.
+/// @param header is the target of the back-edge.
+/// @return the compiled trace of the loop, or NULL if the interpreter should keep going.
+Trace *lox_TraceBackEdge(VM *vm, CallFrame *frame, uint8_t *header)
+{
+    TraceRecorder *recorder = GetRecorder(vm);
+    // While recording, the loop's frame must keep running in the interpreter.
+    if (recorder->trace != NULL && frame - vm->frames == recorder->frame_index)
+        return NULL;
+
+    Trace *trace = FindTrace(frame->function, header);
+    if (trace->native != NULL)
+        return trace;
+
+    if (recorder->trace != NULL || trace->aborts >= TRACE_MAX_ABORTS)
+        return NULL;
+
+    if (++trace->hits >= TRACE_HOT_LOOP)
+        StartRecording(vm, frame, trace);
+    return NULL;
+}
+
+/// @brief Records the instruction at 'ip' before it's executed.
+/// @param frame executing the instruction.
+/// @param ip points to the opcode.
+/// @param stack_top is the current top of the value stack.
+/// @return false once recording has stopped, either because the loop was closed or aborted.
+bool lox_TraceRecord(VM *vm, CallFrame *frame, uint8_t *ip, Value *stack_top)
+{
+    TraceRecorder *recorder = vm->trace_recorder;
+    if (recorder == NULL || recorder->trace == NULL)
+        return false;
+
+    // Callees run normally. Only the instructions of the loop's frame make up the trace.
+    if (frame - vm->frames != recorder->frame_index)
+        return true;
+
+    Trace *trace = recorder->trace;
+    uint8_t observed = 0;
+    if (!Observe(recorder, frame, ip, stack_top, &observed) || trace->step_count == TRACE_MAX_LENGTH)
+    {
+        StopRecording(recorder, false);
+        return false;
+    }
+
+    AppendStep(trace, ip, observed);
+    if (observed & TRACE_CLOSES_LOOP)
+    {
+        StopRecording(recorder, true);
+        return false;
+    }
+    return true;
+}
+
+bool lox_TraceIsRecording(VM *vm)
+{
+    return vm->trace_recorder != NULL && vm->trace_recorder->trace != NULL;
+}
+
+/// @brief Drops the recording in progress, if any. Called when a runtime error unwinds the frames.
+void lox_TraceAbort(VM *vm)
+{
+    if (lox_TraceIsRecording(vm))
+        StopRecording(vm->trace_recorder, false);
+}
+
+void lox_FreeTraces(VM *vm, ObjFunction *function)
+{
+    TraceRecorder *recorder = vm->trace_recorder;
+    Trace *trace = function->traces;
+    while (trace != NULL)
+    {
+        Trace *next = trace->next;
+        if (recorder != NULL && recorder->trace == trace)
+            recorder->trace = NULL;
+        lox_JitFreeTrace(trace);
+        free(trace->steps);
+        free(trace);
+        trace = next;
+    }
+    function->traces = NULL;
+}
+
+void lox_PrintTraceStats(VM *vm)
+{
+    TraceRecorder *recorder = GetRecorder(vm);
+    fprintf(stderr, "Traces recorded: %d, compiled: %d, aborted: %d\n",
+            recorder->recorded, recorder->compiled, recorder->aborted);
+}
+
+void lox_FreeTraceRecorder(VM *vm)
+{
+    free(vm->trace_recorder);
+    vm->trace_recorder = NULL;
+}
+
+TraceRecorder *GetRecorder(VM *vm)
+{
+    if (vm->trace_recorder == NULL)
+        vm->trace_recorder = calloc(1, sizeof(TraceRecorder));
+    return vm->trace_recorder;
+}
+
+Trace *FindTrace(ObjFunction *function, uint8_t *header)
+{
+    for (Trace *trace = function->traces; trace != NULL; trace = trace->next)
+    {
+        if (trace->header == header)
+            return trace;
+    }
+
+    Trace *trace = calloc(1, sizeof(Trace));
+    trace->function = function;
+    trace->header = header;
+    trace->next = function->traces;
+    function->traces = trace;
+    return trace;
+}
+
+void StartRecording(VM *vm, CallFrame *frame, Trace *trace)
+{
+    trace->step_count = 0;
+    vm->trace_recorder->trace = trace;
+    vm->trace_recorder->frame_index = (int)(frame - vm->frames);
+}
+
+/// @brief Ends the recording. A complete trace is compiled, an aborted one counts
+///        towards blacklisting its loop.
+void StopRecording(TraceRecorder *recorder, bool complete)
+{
+    Trace *trace = recorder->trace;
+    recorder->trace = NULL;
+    trace->hits = 0;
+
+    if (complete)
+    {
+        recorder->recorded++;
+        if (lox_JitCompileTrace(trace))
+        {
+            recorder->compiled++;
+            return;
+        }
+    }
+    else
+    {
+        recorder->aborted++;
+    }
+
+    trace->aborts++;
+    trace->step_count = 0;
+}
+
+/// @brief Records the operand types an instruction sees.
+/// @return false if the instruction can't be part of a trace.
+bool Observe(TraceRecorder *recorder, CallFrame *frame, uint8_t *ip, Value *stack_top, uint8_t *observed)
+{
+    Value a;
+    Value b;
+    switch (*ip)
+    {
+    case OP_ADD:
+    case OP_ADD_NUMBER:
+    case OP_ADD_STRING:
+        a = stack_top[-2];
+        b = stack_top[-1];
+        if (IS_TEXT(a) && IS_TEXT(b))
+        {
+            *observed = TRACE_STRINGS;
+            return true;
+        }
+        *observed = TRACE_NUMBERS;
+        return IS_NUMBER(a) && IS_NUMBER(b);
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUMBER:
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUMBER:
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUMBER:
+    case OP_GREATER:
+    case OP_GREATER_NUMBER:
+    case OP_LESS:
+    case OP_LESS_NUMBER:
+        *observed = TRACE_NUMBERS;
+        return IS_NUMBER(stack_top[-2]) && IS_NUMBER(stack_top[-1]);
+    case OP_NEGATE:
+        *observed = TRACE_NUMBERS;
+        return IS_NUMBER(stack_top[-1]);
+    case OP_INCREMENT_LOCAL:
+        a = frame->slots[ip[1]];
+        b = frame->function->chunk.constants.values[ip[2]];
+        if (IS_TEXT(a) && IS_TEXT(b))
+        {
+            *observed = TRACE_STRINGS;
+            return true;
+        }
+        *observed = TRACE_NUMBERS;
+        return IS_NUMBER(a) && IS_NUMBER(b);
+    case OP_LESS_JUMP_IF_FALSE:
+        a = stack_top[-2];
+        b = stack_top[-1];
+        if (!IS_NUMBER(a) || !IS_NUMBER(b))
+            return false;
+        *observed = TRACE_NUMBERS | (AS_NUMBER(a) < AS_NUMBER(b) ? 0 : TRACE_TAKEN);
+        return true;
+    case OP_JUMP_IF_FALSE:
+        a = stack_top[-1];
+        if (IS_NIL(a) || (IS_BOOL(a) && !AS_BOOL(a)))
+            *observed = TRACE_TAKEN;
+        return true;
+    case OP_LOOP:
+        // Other back-edges are recorded as jumps. They are either part of the loop's own control
+        // flow(like the jump from a for-loop's increment to its condition), or an inner loop that
+        // gets unrolled until the trace is too long.
+        if (ip + 3 - ((ip[1] << 8) | ip[2]) == recorder->trace->header)
+            *observed = TRACE_CLOSES_LOOP;
+        return true;
+    case OP_TAIL_CALL:
+    case OP_RETURN:
+        return false;
+    default:
+        return true;
+    }
+}
+
+void AppendStep(Trace *trace, uint8_t *ip, uint8_t observed)
+{
+    if (trace->step_count + 1 > trace->step_capacity)
+    {
+        trace->step_capacity = trace->step_capacity < 32 ? 32 : trace->step_capacity * 2;
+        trace->steps = realloc(trace->steps, sizeof(TraceStep) * trace->step_capacity);
+    }
+    trace->steps[trace->step_count++] = (TraceStep){.ip = ip, .observed = observed};
+}
+
+#endif
@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -5,340 +6,1013 @@
 #include <time.h>
 
 #include "vm/vm.h"
+#include "common/hash.h"
 #include "core/debug.h"
 #include "core/value.h"
 #include "compiler/compiler.h"
 #include "core/memory.h"
 #include "core/object.h"
+#include "core/slab.h"
+#include "vm/profiler.h"
+#include "vm/jit.h"
+#include "vm/trace.h"
+#include "vm/fiber.h"
+#include "vm/io.h"
+#include "vm/scheduler.h"
+
+#if defined(THREADED_DISPATCH) && defined(__GNUC__)
+#define USE_COMPUTED_GOTO
+#endif
 
-VM vm;
 
-static Value clockNative(int argCount, Value* args) {
-  return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+static bool clockNative(VM *vm, int arg_count, Value *args, Value *result) {
+  *result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+  return true;
 }
 
-static InterpretResult Run();
-static void ResetStack();
-static Value Peek(int distance);
+static void InitState(VM *vm, const Allocator *allocator);
+static void ResetStack(VM *vm);
+static bool EnsureStack(VM *vm, size_t count);
 static bool IsFalsey(Value value);
-static void Concatenate();
-static void RuntimeError(const char *format, ...);
-static bool CallValue(Value callee, int arg_count);
-static bool Call(ObjFunction *function, int arg_count);
-static void DefineNative(const char *name, NativeFn function);
+static bool Call(VM *vm, ObjFunction *function, int arg_count);
+static bool PrepareCall(VM *vm, ObjFunction *function, int arg_count);
+static void DefineNative(VM *vm, const char *name, NativeFn function);
+static InterpretResult ErrorResult(VM *vm, InterpretResult result);
+static void StackOverflow(VM *vm);
+#ifdef DEBUG_TRACE_EXECUTION
+static void TraceInstruction(VM *vm, CallFrame *frame, uint8_t *ip, Value *stack_top);
+#endif
 
-void lox_InitVM()
+void lox_InitVM(VM *vm)
 {
-    ResetStack();
-    vm.objects = NULL;
-    lox_InitHashTable(&vm.strings);
-    lox_InitHashTable(&vm.globals);
+    lox_InitVMWithAllocator(vm, NULL);
+}
+
+/// @brief Initializes a VM whose heap, the objects and arrays and the nursery, gets its memory
+///        from 'allocator' rather than malloc. The VM's own bookkeeping, like the collector's
+///        stacks and compiled machine code, still comes from malloc. VMs running code compiled by
+///        this one(see lox_InitSharedVM) use the allocator too, from their own threads.
+///        The allocator may not return NULL: the VM exits then. lox_SetLimits sets a limit that
+///        the VM recovers from.
+/// @param allocator is copied, or NULL for malloc.
+void lox_InitVMWithAllocator(VM *vm, const Allocator *allocator)
+{
+    InitState(vm, allocator);
+    DefineNative(vm, "clock", clockNative);
+    DefineNative(vm, "fiber", lox_FiberNative);
+    DefineNative(vm, "resume", lox_ResumeNative);
+    DefineNative(vm, "yield", lox_YieldNative);
+    DefineNative(vm, "isDone", lox_IsDoneNative);
+    DefineNative(vm, "task", lox_TaskNative);
+    DefineNative(vm, "join", lox_JoinNative);
+#ifdef USE_EPOLL
+    DefineNative(vm, "spawn", lox_SpawnNative);
+    DefineNative(vm, "wait", lox_WaitNative);
+    DefineNative(vm, "pipe", lox_PipeNative);
+    DefineNative(vm, "pipeWriter", lox_PipeWriterNative);
+    DefineNative(vm, "open", lox_OpenNative);
+    DefineNative(vm, "listen", lox_ListenNative);
+    DefineNative(vm, "accept", lox_AcceptNative);
+    DefineNative(vm, "connect", lox_ConnectNative);
+    DefineNative(vm, "read", lox_ReadNative);
+    DefineNative(vm, "write", lox_WriteNative);
+    DefineNative(vm, "close", lox_CloseNative);
+#endif
+}
 
-    DefineNative("clock", clockNative);
+/// @brief Initializes a VM that runs code compiled by 'owner'. The VM has its own stacks, globals
+///        and heap, but starts out with the owner's interned strings and global slots. Interning
+///        the same characters then gives the owner's string, so strings stay comparable by
+///        identity, and the slots compiled into the shared code resolve to the same globals.
+///        Globals the owner has defined are copied, unless they hold a fiber.
+///        The owner may already have run the code, which quickens it and compiles hot functions.
+///        The VM only reads it: it takes the generic path when a quickened guard fails, and
+///        interprets functions the owner compiled. The owner must not run, compile or allocate
+///        while the VM is in use.
+/// @param owner compiled the code. Its objects must outlive the VM.
+void lox_InitSharedVM(VM *vm, VM *owner)
+{
+    InitState(vm, &owner->allocator);
+    vm->shared_code = true;
+    vm->gc_quantum = owner->gc_quantum;
+    vm->gc_concurrent = owner->gc_concurrent;
+    lox_CopyHashTable(vm, &owner->strings, &vm->strings);
+    lox_CopyHashTable(vm, &owner->global_slots, &vm->global_slots);
+    for (int i = 0; i < owner->global_values.count; i++)
+    {
+        lox_WriteValueArray(vm, &vm->global_names, owner->global_names.values[i]);
+        // Every other object is immutable, so it can be shared too.
+        Value value = owner->global_values.values[i];
+        lox_WriteValueArray(vm, &vm->global_values, IS_FIBER(value) ? UNDEFINED_VAL : value);
+    }
 }
 
-void lox_FreeVM()
+void lox_FreeVM(VM *vm)
 {
-    lox_FreeHashTable(&vm.strings);
-    lox_FreeHashTable(&vm.globals);
-    lox_FreeObjects();
+    lox_FreeHashTable(vm, &vm->strings);
+    lox_FreeHashTable(vm, &vm->global_slots);
+    lox_FreeValueArray(vm, &vm->global_names);
+    lox_FreeValueArray(vm, &vm->global_values);
+    lox_FreeValueArray(vm, &vm->handles);
+#ifdef USE_EPOLL
+    // Before the objects, since it refers to the fibers waiting on it.
+    lox_FreeIoLoop(vm);
+#endif
+    lox_FreeObjects(vm);
+#ifdef USE_JIT
+    lox_FreeTraceRecorder(vm);
+#endif
+    FREE_ARRAY(vm, CallFrame, vm->frames, vm->frame_capacity);
+    FREE_ARRAY(vm, Value, vm->stack, vm->stack_capacity);
+#ifdef USE_SLABS
+    lox_FreeSlabs(vm);
+#endif
 }
 
-InterpretResult lox_InterpretSource(const char *source)
+/// @brief Limits what the VM may use from now on. Running out of a budget stops the running code
+///        with a runtime error, and the call that started it returns INTERPRET_LIMIT_EXCEEDED.
+///        Call depth is limited by vm->frames_max.
+/// @param max_instructions is the number of instructions the VM may still run, or 0 for no limit.
+///        It's approximate: a back-edge is charged the length of the loop in bytes, and a call
+///        is charged 1, so straight-line code isn't counted.
+/// @param max_bytes is the most memory the VM may have allocated at once, or 0 for no limit.
+///        Going over it starts a collection at the next back-edge or call, and the limit is
+///        only exceeded if the heap is still too big after that. Natives and straight-line code
+///        may go over it in between.
+void lox_SetLimits(VM *vm, int64_t max_instructions, size_t max_bytes)
 {
-    ObjFunction *function = lox_Compile(source);
+    vm->fuel = max_instructions > 0 ? max_instructions : INT64_MAX;
+    vm->fuel_reserve = 0;
+    vm->memory_limit = max_bytes > 0 ? max_bytes : SIZE_MAX;
+    if (vm->bytes_allocated > vm->memory_limit)
+        lox_RequestSafepoint(vm);
+}
+
+InterpretResult lox_InterpretSource(VM *vm, const char *source)
+{
+    ObjFunction *function = lox_Compile(vm, source);
     if (function == NULL)
         return INTERPRET_COMPILE_ERROR;
 
-    lox_PushStack(OBJ_VAL(function));
-    Call(function, 0);
-    return Run();
+    return lox_CallFunction(vm, OBJ_VAL(function), 0, NULL, NULL);
 }
 
-void lox_PushStack(Value value)
+/// @brief Compiles 'source' once, so it can be run any number of times with lox_CallFunction.
+///        Running it defines the functions and globals it declares.
+/// @param source of the script.
+/// @return the script's top-level function, or NULL on a compile error. It stays alive as long
+///         as the VM.
+ObjFunction *lox_CompileSource(VM *vm, const char *source)
 {
-    *vm.stack_top = value;
-    vm.stack_top++;
+    ObjFunction *function = lox_Compile(vm, source);
+    if (function != NULL)
+        lox_WriteValueArray(vm, &vm->handles, OBJ_VAL(function));
+    return function;
 }
 
-Value lox_PopStack()
+/// @brief Calls 'callee' from C and runs it to completion. Hot functions are compiled by the JIT
+///        like they are when called from Lox.
+/// @param callee is a function, closure or native.
+/// @param args are the 'arg_count' arguments, or NULL if there are none.
+/// @param result receives the return value, unless it is NULL.
+/// @return INTERPRET_RUNTIME_ERROR if the call failed, or INTERPRET_LIMIT_EXCEEDED if it ran out
+///         of a budget(see lox_SetLimits). The error has been reported.
+InterpretResult lox_CallFunction(VM *vm, Value callee, int arg_count, const Value *args, Value *result)
 {
-    vm.stack_top--;
-    return *vm.stack_top;
+    if (vm->frame_count == 0)
+        vm->limit_exceeded = false;
+    if (!EnsureStack(vm, vm->stack_top - vm->stack + arg_count + 1))
+        return ErrorResult(vm, INTERPRET_RUNTIME_ERROR);
+
+    ObjFiber *fiber = vm->fiber;
+    int base_frame = vm->frame_count;
+    lox_PushStack(vm, callee);
+    for (int i = 0; i < arg_count; i++)
+        lox_PushStack(vm, args[i]);
+
+    if (!lox_CallValue(vm, callee, arg_count))
+        return ErrorResult(vm, INTERPRET_RUNTIME_ERROR);
+
+    // A native that resumed a fiber returns here once that fiber yields back.
+    if (vm->fiber != fiber || vm->frame_count > base_frame)
+    {
+        InterpretResult status;
+#ifdef USE_JIT
+        JitResult jit = vm->fiber == fiber ? lox_JitRunFrame(vm, &vm->frames[vm->frame_count - 1])
+                                           : JIT_NOT_COMPILED;
+        if (jit != JIT_NOT_COMPILED)
+            status = jit == JIT_OK ? INTERPRET_OK : INTERPRET_RUNTIME_ERROR;
+        else
+#endif
+            status = lox_RunFrames(vm, fiber, base_frame);
+        if (status != INTERPRET_OK)
+            return ErrorResult(vm, status);
+    }
+
+    Value value = lox_PopStack(vm);
+    if (result != NULL)
+        *result = value;
+    return INTERPRET_OK;
 }
 
-InterpretResult Run()
+/// @brief Looks up a global by name, e.g. a function to call with lox_CallFunction.
+/// @param name of the global.
+/// @param value receives the global's value.
+/// @return false if no such global has been defined.
+bool lox_GetGlobal(VM *vm, const char *name, Value *value)
 {
-    CallFrame *frame = &vm.frames[vm.frame_count - 1];
+    Value slot;
+    ObjString *key = lox_CopyString(vm, name, (int)strlen(name));
+    if (!lox_GetEntryHashTable(&vm->global_slots, key, &slot))
+        return false;
 
-#define READ_BYTE() (*frame->ip++)
+    *value = vm->global_values.values[(int)AS_NUMBER(slot)];
+    return !IS_UNDEFINED(*value);
+}
+
+void lox_PushStack(VM *vm, Value value)
+{
+    *vm->stack_top = value;
+    vm->stack_top++;
+}
+
+Value lox_PopStack(VM *vm)
+{
+    vm->stack_top--;
+    return *vm->stack_top;
+}
+
+/// @brief Finds the slot of the global 'name', declaring it if it doesn't exist.
+/// @param name of the global.
+/// @return the slot in vm->global_values.
+int lox_ResolveGlobalSlot(VM *vm, ObjString *name)
+{
+    Value slot;
+    if (lox_GetEntryHashTable(&vm->global_slots, name, &slot))
+        return (int)AS_NUMBER(slot);
+
+    int index = (int)vm->global_values.count;
+    lox_WriteValueArray(vm, &vm->global_names, OBJ_VAL(name));
+    lox_WriteValueArray(vm, &vm->global_values, UNDEFINED_VAL);
+    lox_AddEntryHashTable(vm, &vm->global_slots, name, NUMBER_VAL(index));
+    return index;
+}
+
+/// @brief Runs the interpreter loop until the newest frame below 'base_frame' returns.
+///        Calls made from C(lox_CallFunction) and from native code(the JIT) run the callee
+///        with the caller's frame count as the base. The result is left on the stack.
+///        Other fibers may run in between. The loop only stops on 'base_fiber'.
+/// @param base_fiber is the fiber whose frames are counted.
+/// @param base_frame is the frame count at which to stop.
+/// @return the result of running the frames.
+InterpretResult lox_RunFrames(VM *vm, ObjFiber *base_fiber, int base_frame)
+{
+    // The hot interpreter state is cached in locals so the compiler can keep it in registers.
+    // It is written back to the frame/VM(STORE_FRAME) before anything that inspects it, and
+    // reloaded(LOAD_FRAME) whenever the active frame changes.
+    CallFrame *frame;
+    register uint8_t *ip;
+    register Value *stack_top;
+    register Value *slots;
+    register Value *constants;
+
+#define LOAD_FRAME()                                          \
+    do                                                        \
+    {                                                         \
+        frame = &vm->frames[vm->frame_count - 1];               \
+        ip = frame->ip;                                       \
+        slots = frame->slots;                                 \
+        constants = frame->function->chunk.constants.values; \
+        stack_top = vm->stack_top;                             \
+    } while (false)
+#define STORE_FRAME() (frame->ip = ip, vm->stack_top = stack_top)
+
+#define READ_BYTE() (*ip++)
 #define READ_SHORT() \
-    (frame->ip += 2, \
-     (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() \
-    (frame->function->chunk.constants.values[READ_BYTE()])
+    (ip += 2,        \
+     (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(value_type, op)                       \
-    do                                                  \
-    {                                                   \
-        if (!IS_NUMBER(Peek(0)) || !IS_NUMBER(Peek(1))) \
-        {                                               \
-            RuntimeError("Operands must be numbers.");  \
-            return INTERPRET_RUNTIME_ERROR;             \
-        }                                               \
-        double b = AS_NUMBER(lox_PopStack());           \
-        double a = AS_NUMBER(lox_PopStack());           \
-        lox_PushStack(value_type(a op b));              \
+#define GLOBAL_NAME(slot) AS_STRING(vm->global_names.values[slot])
+#define PUSH(value) (*stack_top++ = (value))
+#define POP() (*--stack_top)
+#define PEEK(distance) (stack_top[-1 - (distance)])
+#define RUNTIME_ERROR(...)                  \
+    do                                      \
+    {                                       \
+        STORE_FRAME();                      \
+        lox_RuntimeError(vm, __VA_ARGS__);          \
+        return INTERPRET_RUNTIME_ERROR;     \
+    } while (false)
+// Rewrites the instruction being executed. Used to quicken a generic instruction into its
+// type-specialized form, and to deoptimize it back when a guard fails. Deoptimizing also rewinds
+// ip so the generic instruction is dispatched next. Shared code is read-only, but it may already
+// have been quickened by its owner, so a failed guard jumps straight to the generic handler
+// instead of rewriting it.
+#define QUICKEN(opcode) ((void)(vm->shared_code || (ip[-1] = (opcode))))
+#define DEOPTIMIZE(opcode)          \
+    do                              \
+    {                               \
+        if (vm->shared_code)        \
+            goto do_##opcode;       \
+        ip[-1] = (opcode);          \
+        ip--;                       \
+    } while (false)
+#define BINARY_OP(value_type, op, quickened)              \
+    do                                                    \
+    {                                                     \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))   \
+            RUNTIME_ERROR("Operands must be numbers.");   \
+        QUICKEN(quickened);                               \
+        double b = AS_NUMBER(POP());                      \
+        double a = AS_NUMBER(PEEK(0));                    \
+        PEEK(0) = value_type(a op b);                     \
+    } while (false)
+#define NUMBER_OP(value_type, op)           \
+    do                                      \
+    {                                       \
+        double b = AS_NUMBER(POP());        \
+        double a = AS_NUMBER(PEEK(0));      \
+        PEEK(0) = value_type(a op b);       \
     } while (false)
+#define NUMBER_OPERANDS() (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
 
-    for (;;)
-    {
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value *slot = vm.stack; slot < vm.stack_top; slot++)
-        {
-            printf("[ ");
-            lox_PrintValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        lox_DisassembleInstruction(&frame->function->chunk, (int)(frame->ip - frame->function->chunk.code));
+#define TRACE_INSTRUCTION() TraceInstruction(vm, frame, ip, stack_top)
+#elif defined(DEBUG_PROFILE_NGRAMS)
+#define TRACE_INSTRUCTION() lox_ProfileInstruction(ip)
+#else
+#define TRACE_INSTRUCTION() ((void)0)
 #endif
-        uint8_t instruction = READ_BYTE();
-        switch (instruction)
-        {
-        case OP_CONSTANT:
+
+
+#ifdef USE_COMPUTED_GOTO
+    // Direct-threaded dispatch: every handler ends with its own indirect jump, so the branch
+    // predictor gets one history slot per opcode instead of a single shared one.
+    // Every entry starts out at do_UNKNOWN and the opcodes override it, which -Woverride-init
+    // reports once per opcode, so the warning is off for the table.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+    static void *dispatch_table[UINT8_COUNT] = {
+        [0 ... UINT8_MAX] = &&do_UNKNOWN,
+        [OP_CONSTANT] = &&do_OP_CONSTANT,
+        [OP_NEGATE] = &&do_OP_NEGATE,
+        [OP_ADD] = &&do_OP_ADD,
+        [OP_SUBTRACT] = &&do_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&do_OP_MULTIPLY,
+        [OP_DIVIDE] = &&do_OP_DIVIDE,
+        [OP_RETURN] = &&do_OP_RETURN,
+        [OP_NIL] = &&do_OP_NIL,
+        [OP_TRUE] = &&do_OP_TRUE,
+        [OP_FALSE] = &&do_OP_FALSE,
+        [OP_NOT] = &&do_OP_NOT,
+        [OP_EQUAL] = &&do_OP_EQUAL,
+        [OP_GREATER] = &&do_OP_GREATER,
+        [OP_LESS] = &&do_OP_LESS,
+        [OP_PRINT] = &&do_OP_PRINT,
+        [OP_POP] = &&do_OP_POP,
+        [OP_DEFINE_GLOBAL_SLOT] = &&do_OP_DEFINE_GLOBAL_SLOT,
+        [OP_GET_GLOBAL_SLOT] = &&do_OP_GET_GLOBAL_SLOT,
+        [OP_SET_GLOBAL_SLOT] = &&do_OP_SET_GLOBAL_SLOT,
+        [OP_GET_LOCAL] = &&do_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&do_OP_SET_LOCAL,
+        [OP_JUMP_IF_FALSE] = &&do_OP_JUMP_IF_FALSE,
+        [OP_JUMP] = &&do_OP_JUMP,
+        [OP_LOOP] = &&do_OP_LOOP,
+        [OP_CALL] = &&do_OP_CALL,
+        [OP_TAIL_CALL] = &&do_OP_TAIL_CALL,
+        [OP_CLOSURE] = &&do_OP_CLOSURE,
+        [OP_GET_LOCAL_CONSTANT] = &&do_OP_GET_LOCAL_CONSTANT,
+        [OP_GET_LOCAL_LOCAL] = &&do_OP_GET_LOCAL_LOCAL,
+        [OP_INCREMENT_LOCAL] = &&do_OP_INCREMENT_LOCAL,
+        [OP_LESS_JUMP_IF_FALSE] = &&do_OP_LESS_JUMP_IF_FALSE,
+        [OP_ADD_NUMBER] = &&do_OP_ADD_NUMBER,
+        [OP_ADD_STRING] = &&do_OP_ADD_STRING,
+        [OP_SUBTRACT_NUMBER] = &&do_OP_SUBTRACT_NUMBER,
+        [OP_MULTIPLY_NUMBER] = &&do_OP_MULTIPLY_NUMBER,
+        [OP_DIVIDE_NUMBER] = &&do_OP_DIVIDE_NUMBER,
+        [OP_GREATER_NUMBER] = &&do_OP_GREATER_NUMBER,
+        [OP_LESS_NUMBER] = &&do_OP_LESS_NUMBER,
+    };
+#pragma GCC diagnostic pop
+
+#ifdef USE_JIT
+    // While a loop is being recorded, instructions are dispatched through a table that sends
+    // every opcode to the recorder first. Not recording costs nothing.
+    static void *record_table[UINT8_COUNT] = {[0 ... UINT8_MAX] = &&do_RECORD};
+    void **dispatch = dispatch_table;
+#define SET_RECORDING(enabled) (dispatch = (enabled) ? record_table : dispatch_table)
+#define DISPATCH_TABLE dispatch
+#else
+#define DISPATCH_TABLE dispatch_table
+#endif
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(opcode) do_##opcode:
+#define CASE_TARGET(opcode) CASE(opcode)
+#define DEFAULT do_UNKNOWN:
+#define DISPATCH()                             \
+    do                                         \
+    {                                          \
+        TRACE_INSTRUCTION();                   \
+        goto *DISPATCH_TABLE[READ_BYTE()];     \
+    } while (false)
+#else
+#ifdef USE_JIT
+    // Set while a loop is being recorded. Every instruction then passes through the recorder
+    // before it's executed.
+    bool recording = false;
+#define SET_RECORDING(enabled) (recording = (enabled))
+#define RECORD_INSTRUCTION() \
+    ((void)(recording && !lox_TraceRecord(vm, frame, ip, stack_top) && (recording = false)))
+#else
+#define RECORD_INSTRUCTION() ((void)0)
+#endif
+#define INTERPRET_LOOP \
+    for (;;)           \
+        switch (TRACE_INSTRUCTION(), RECORD_INSTRUCTION(), READ_BYTE())
+#define CASE(opcode) case opcode:
+// The generic handlers that a failed guard in shared code jumps to(see DEOPTIMIZE) also need a
+// label.
+#define CASE_TARGET(opcode) case opcode: do_##opcode:
+#define DEFAULT default:
+#define DISPATCH() continue
+#endif
+
+    LOAD_FRAME();
+
+    INTERPRET_LOOP
+    {
+        CASE(OP_CONSTANT)
         {
-            Value constant = READ_CONSTANT();
-            lox_PushStack(constant);
-            break;
+            PUSH(READ_CONSTANT());
+            DISPATCH();
         }
-        case OP_NEGATE:
+        CASE(OP_NEGATE)
         {
-            if (!IS_NUMBER(Peek(0)))
-            {
-                RuntimeError("Operand must be a number.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            lox_PushStack(NUMBER_VAL(-AS_NUMBER(lox_PopStack())));
-            break;
+            if (!IS_NUMBER(PEEK(0)))
+                RUNTIME_ERROR("Operand must be a number.");
+            PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+            DISPATCH();
         }
-        case OP_ADD:
+        CASE_TARGET(OP_ADD)
         {
-            if (IS_STRING(Peek(0)) && IS_STRING(Peek(1)))
+            if (IS_TEXT(PEEK(0)) && IS_TEXT(PEEK(1)))
             {
-                Concatenate();
+                QUICKEN(OP_ADD_STRING);
+                STORE_FRAME();
+                if (!lox_Concatenate(vm))
+                    return INTERPRET_RUNTIME_ERROR;
+                stack_top = vm->stack_top;
             }
-            else if (IS_NUMBER(Peek(0)) && IS_NUMBER(Peek(1)))
+            else if (NUMBER_OPERANDS())
             {
-                double b = AS_NUMBER(lox_PopStack());
-                double a = AS_NUMBER(lox_PopStack());
-                lox_PushStack(NUMBER_VAL(a + b));
+                QUICKEN(OP_ADD_NUMBER);
+                NUMBER_OP(NUMBER_VAL, +);
             }
             else
             {
-                RuntimeError("Operands must be two numbers or two strings.");
-                return INTERPRET_RUNTIME_ERROR;
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
             }
-            break;
+            DISPATCH();
         }
-        case OP_SUBTRACT:
+        CASE_TARGET(OP_SUBTRACT)
         {
-            BINARY_OP(NUMBER_VAL, -);
-            break;
+            BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUMBER);
+            DISPATCH();
         }
-        case OP_MULTIPLY:
+        CASE_TARGET(OP_MULTIPLY)
         {
-            BINARY_OP(NUMBER_VAL, *);
-            break;
+            BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUMBER);
+            DISPATCH();
         }
-        case OP_DIVIDE:
+        CASE_TARGET(OP_DIVIDE)
         {
-            BINARY_OP(NUMBER_VAL, /);
-            break;
+            BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUMBER);
+            DISPATCH();
         }
-        case OP_NIL:
+        CASE(OP_NIL)
         {
-            lox_PushStack(NIL_VAL);
-            break;
+            PUSH(NIL_VAL);
+            DISPATCH();
         }
-        case OP_TRUE:
+        CASE(OP_TRUE)
         {
-            lox_PushStack(BOOL_VAL(true));
-            break;
+            PUSH(BOOL_VAL(true));
+            DISPATCH();
         }
-        case OP_FALSE:
+        CASE(OP_FALSE)
         {
-            lox_PushStack(BOOL_VAL(false));
-            break;
+            PUSH(BOOL_VAL(false));
+            DISPATCH();
         }
-        case OP_NOT:
+        CASE(OP_NOT)
         {
-            lox_PushStack(BOOL_VAL(IsFalsey(lox_PopStack())));
-            break;
+            PEEK(0) = BOOL_VAL(IsFalsey(PEEK(0)));
+            DISPATCH();
         }
-        case OP_EQUAL:
+        CASE(OP_EQUAL)
         {
-            Value b = lox_PopStack();
-            Value a = lox_PopStack();
-            lox_PushStack(BOOL_VAL(lox_ValuesEqual(a, b)));
-            break;
+            Value b = POP();
+            Value a = PEEK(0);
+            PEEK(0) = BOOL_VAL(lox_ValuesEqual(a, b));
+            DISPATCH();
         }
-        case OP_GREATER:
+        CASE_TARGET(OP_GREATER)
         {
-            BINARY_OP(BOOL_VAL, >);
-            break;
+            BINARY_OP(BOOL_VAL, >, OP_GREATER_NUMBER);
+            DISPATCH();
         }
-        case OP_LESS:
+        CASE_TARGET(OP_LESS)
         {
-            BINARY_OP(BOOL_VAL, <);
-            break;
+            BINARY_OP(BOOL_VAL, <, OP_LESS_NUMBER);
+            DISPATCH();
         }
-        case OP_PRINT:
+        CASE(OP_PRINT)
         {
-            lox_PrintValue(lox_PopStack());
+            // Keep the line together when VMs print from several threads.
+            flockfile(stdout);
+            lox_PrintValue(POP());
             printf("\n");
-            break;
+            funlockfile(stdout);
+            DISPATCH();
         }
-        case OP_POP:
+        CASE(OP_POP)
         {
-            lox_PopStack();
-            break;
+            stack_top--;
+            DISPATCH();
         }
-        case OP_DEFINE_GLOBAL:
+        CASE(OP_DEFINE_GLOBAL_SLOT)
         {
-            ObjString *name = READ_STRING();
-            lox_AddEntryHashTable(&vm.globals, name, Peek(0));
-            lox_PopStack();
-            break;
+            uint16_t slot = READ_SHORT();
+            vm->global_values.values[slot] = POP();
+            DISPATCH();
         }
-        case OP_GET_GLOBAL:
+        CASE(OP_GET_GLOBAL_SLOT)
         {
-            ObjString *name = READ_STRING();
-            Value value;
-            if (!lox_GetEntryHashTable(&vm.globals, name, &value))
-            {
-                RuntimeError("Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            lox_PushStack(value);
-            break;
+            uint16_t slot = READ_SHORT();
+            Value value = vm->global_values.values[slot];
+            if (IS_UNDEFINED(value))
+                RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot)->chars);
+            PUSH(value);
+            DISPATCH();
         }
-        case OP_SET_GLOBAL:
+        CASE(OP_SET_GLOBAL_SLOT)
         {
-            ObjString *name = READ_STRING();
-            if (lox_AddEntryHashTable(&vm.globals, name, Peek(0)))
-            {
-                lox_RemoveEntryHashTable(&vm.globals, name);
-                RuntimeError("Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(vm->global_values.values[slot]))
+                RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot)->chars);
+            vm->global_values.values[slot] = PEEK(0);
+            DISPATCH();
         }
-        case OP_GET_LOCAL:
+        CASE(OP_GET_LOCAL)
         {
             uint8_t slot = READ_BYTE();
-            lox_PushStack(frame->slots[slot]);
-            break;
+            PUSH(slots[slot]);
+            DISPATCH();
         }
-        case OP_SET_LOCAL:
+        CASE(OP_SET_LOCAL)
         {
             uint8_t slot = READ_BYTE();
-            frame->slots[slot] = Peek(0);
-            break;
+            slots[slot] = PEEK(0);
+            DISPATCH();
         }
-        case OP_JUMP_IF_FALSE:
+        CASE(OP_JUMP_IF_FALSE)
         {
             // Read the offset of the jump instruction and adjust ip if condition is false.
             uint16_t offset = READ_SHORT();
-            if (IsFalsey(Peek(0)))
+            if (IsFalsey(PEEK(0)))
             {
-                frame->ip += offset;
+                ip += offset;
             }
-            break;
+            DISPATCH();
         }
-        case OP_JUMP:
+        CASE(OP_JUMP)
         {
             // Jump is unconditional, so we simply increase the IP.
             uint16_t offset = READ_SHORT();
-            frame->ip += offset;
-            break;
+            ip += offset;
+            DISPATCH();
         }
-        case OP_LOOP:
+        CASE(OP_LOOP)
         {
             uint16_t offset = READ_SHORT();
-            frame->ip -= offset;
-            break;
+            if ((vm->fuel -= offset) < 0)
+            {
+                STORE_FRAME();
+                if (!lox_Safepoint(vm))
+                    return INTERPRET_RUNTIME_ERROR;
+            }
+            ip -= offset;
+#ifdef USE_JIT
+            if (vm->trace_loops && vm->fiber == &vm->main_fiber)
+            {
+                Trace *trace = lox_TraceBackEdge(vm, frame, ip);
+                if (trace != NULL)
+                {
+                    // Run the loop natively until a guard fails, then continue where it left.
+                    STORE_FRAME();
+                    if (lox_JitRunTrace(vm, trace, frame) == JIT_ERROR)
+                        return INTERPRET_RUNTIME_ERROR;
+                    LOAD_FRAME();
+                }
+                SET_RECORDING(lox_TraceIsRecording(vm));
+            }
+#endif
+            DISPATCH();
         }
-        case OP_CALL:
+        CASE(OP_CALL)
         {
             int arg_count = READ_BYTE();
-            if (!CallValue(Peek(arg_count), arg_count))
+#ifdef USE_JIT
+            int frame_count = vm->frame_count;
+#endif
+            ObjFiber *fiber = vm->fiber;
+            STORE_FRAME();
+            if (!lox_CallValue(vm, PEEK(arg_count), arg_count))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            if (vm->fiber != fiber)
+            {
+                // The callee resumed or yielded. Stop if that went back to where the loop began.
+                if (vm->fiber == base_fiber && vm->frame_count == base_frame)
+                    return INTERPRET_OK;
+            }
+#ifdef USE_JIT
+            // If the callee has been compiled, run it natively. It returns to this frame.
+            else if (vm->frame_count > frame_count &&
+                     lox_JitRunFrame(vm, &vm->frames[vm->frame_count - 1]) == JIT_ERROR)
             {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            frame = &vm.frames[vm.frame_count - 1];
-            break;
+#endif
+            LOAD_FRAME();
+            DISPATCH();
         }
-        case OP_RETURN:
+        CASE(OP_TAIL_CALL)
         {
-            Value result = lox_PopStack();
-            vm.frame_count--;
-            if (vm.frame_count == 0)
+            // The OP_RETURN that follows only runs if the callee didn't take over this frame,
+            // like a native function.
+            int arg_count = READ_BYTE();
+            ObjFiber *fiber = vm->fiber;
+            STORE_FRAME();
+            if (!lox_TailCallValue(vm, PEEK(arg_count), arg_count))
             {
-                lox_PopStack();
-                return INTERPRET_OK;
+                return INTERPRET_RUNTIME_ERROR;
             }
-
-            vm.stack_top = frame->slots;
-            lox_PushStack(result);
-            frame = &vm.frames[vm.frame_count - 1];
-            break;
+            if (vm->fiber != fiber)
+            {
+                if (vm->fiber == base_fiber && vm->frame_count == base_frame)
+                    return INTERPRET_OK;
+            }
+#ifdef USE_JIT
+            // The frames don't grow, but the value stack may have moved.
+            else if (frame->ip != ip)
+            {
+                // If the callee has been compiled, run it natively. It returns from this frame.
+                JitResult result = lox_JitRunFrame(vm, frame);
+                if (result == JIT_ERROR)
+                    return INTERPRET_RUNTIME_ERROR;
+                if (result == JIT_OK && vm->frame_count == base_frame && vm->fiber == base_fiber)
+                    return INTERPRET_OK;
+            }
+#endif
+            LOAD_FRAME();
+            DISPATCH();
         }
-        default:
-            break;
+        CASE(OP_CLOSURE)
+        {
+            ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+            PUSH(OBJ_VAL(lox_CreateClosure(vm, function)));
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL_CONSTANT)
+        {
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            PUSH(READ_CONSTANT());
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL_LOCAL)
+        {
+            uint8_t a = READ_BYTE();
+            uint8_t b = READ_BYTE();
+            PUSH(slots[a]);
+            PUSH(slots[b]);
+            DISPATCH();
+        }
+        CASE(OP_INCREMENT_LOCAL)
+        {
+            // slots[slot] = slots[slot] + constant, without touching the stack for numbers.
+            uint8_t slot = READ_BYTE();
+            Value constant = READ_CONSTANT();
+            Value value = slots[slot];
+            if (IS_NUMBER(value) && IS_NUMBER(constant))
+            {
+                slots[slot] = NUMBER_VAL(AS_NUMBER(value) + AS_NUMBER(constant));
+            }
+            else if (IS_TEXT(value) && IS_TEXT(constant))
+            {
+                PUSH(value);
+                PUSH(constant);
+                STORE_FRAME();
+                if (!lox_Concatenate(vm))
+                    return INTERPRET_RUNTIME_ERROR;
+                stack_top = vm->stack_top;
+                slots[slot] = POP();
+            }
+            else
+            {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+            DISPATCH();
         }
+        CASE(OP_LESS_JUMP_IF_FALSE)
+        {
+            // OP_LESS; OP_JUMP_IF_FALSE; OP_POP. The condition is only left on the stack
+            // when the jump is taken, where it's popped by the target.
+            uint16_t offset = READ_SHORT();
+            if (!NUMBER_OPERANDS())
+                RUNTIME_ERROR("Operands must be numbers.");
+            double b = AS_NUMBER(POP());
+            double a = AS_NUMBER(POP());
+            if (!(a < b))
+            {
+                PUSH(BOOL_VAL(false));
+                ip += offset;
+            }
+            DISPATCH();
+        }
+        CASE(OP_ADD_NUMBER)
+        {
+            if (!NUMBER_OPERANDS())
+            {
+                DEOPTIMIZE(OP_ADD);
+                DISPATCH();
+            }
+            NUMBER_OP(NUMBER_VAL, +);
+            DISPATCH();
+        }
+        CASE(OP_ADD_STRING)
+        {
+            if (!IS_TEXT(PEEK(0)) || !IS_TEXT(PEEK(1)))
+            {
+                DEOPTIMIZE(OP_ADD);
+                DISPATCH();
+            }
+            STORE_FRAME();
+            if (!lox_Concatenate(vm))
+                return INTERPRET_RUNTIME_ERROR;
+            stack_top = vm->stack_top;
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT_NUMBER)
+        {
+            if (!NUMBER_OPERANDS())
+            {
+                DEOPTIMIZE(OP_SUBTRACT);
+                DISPATCH();
+            }
+            NUMBER_OP(NUMBER_VAL, -);
+            DISPATCH();
+        }
+        CASE(OP_MULTIPLY_NUMBER)
+        {
+            if (!NUMBER_OPERANDS())
+            {
+                DEOPTIMIZE(OP_MULTIPLY);
+                DISPATCH();
+            }
+            NUMBER_OP(NUMBER_VAL, *);
+            DISPATCH();
+        }
+        CASE(OP_DIVIDE_NUMBER)
+        {
+            if (!NUMBER_OPERANDS())
+            {
+                DEOPTIMIZE(OP_DIVIDE);
+                DISPATCH();
+            }
+            NUMBER_OP(NUMBER_VAL, /);
+            DISPATCH();
+        }
+        CASE(OP_GREATER_NUMBER)
+        {
+            if (!NUMBER_OPERANDS())
+            {
+                DEOPTIMIZE(OP_GREATER);
+                DISPATCH();
+            }
+            NUMBER_OP(BOOL_VAL, >);
+            DISPATCH();
+        }
+        CASE(OP_LESS_NUMBER)
+        {
+            if (!NUMBER_OPERANDS())
+            {
+                DEOPTIMIZE(OP_LESS);
+                DISPATCH();
+            }
+            NUMBER_OP(BOOL_VAL, <);
+            DISPATCH();
+        }
+        CASE(OP_RETURN)
+        {
+            Value result = POP();
+            vm->frame_count--;
+            vm->stack_top = slots;
+            if (vm->frame_count == 0 && vm->fiber != &vm->main_fiber)
+            {
+                // The fiber's function returned. Its resume returns the result.
+                if (!lox_FinishFiber(vm, result))
+                    return INTERPRET_RUNTIME_ERROR;
+            }
+            else
+            {
+                lox_PushStack(vm, result);
+            }
+            if (vm->frame_count == base_frame && vm->fiber == base_fiber)
+                return INTERPRET_OK;
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        DEFAULT
+        {
+            DISPATCH();
+        }
+#if defined(USE_COMPUTED_GOTO) && defined(USE_JIT)
+    do_RECORD:
+        {
+            // The opcode has been read, so step back to record the whole instruction.
+            ip--;
+            if (!lox_TraceRecord(vm, frame, ip, stack_top))
+                SET_RECORDING(false);
+            goto *dispatch_table[READ_BYTE()];
+        }
+#endif
     }
 
+#undef INTERPRET_LOOP
+#undef CASE
+#undef CASE_TARGET
+#undef DEFAULT
+#undef DISPATCH
+#undef TRACE_INSTRUCTION
+#undef RECORD_INSTRUCTION
+#undef SET_RECORDING
+#undef DISPATCH_TABLE
+#undef LOAD_FRAME
+#undef STORE_FRAME
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef GLOBAL_NAME
 #undef READ_SHORT
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef RUNTIME_ERROR
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef NUMBER_OPERANDS
+#undef QUICKEN
+#undef DEOPTIMIZE
 }
 
-void ResetStack()
+/// @brief Pops two strings or ropes and pushes them joined(see lox_ConcatenateText).
+///        This may collect garbage, so the frame's ip and stack top must have been stored.
+/// @return false if the result doesn't fit in the memory budget. The error has been reported.
+bool lox_Concatenate(VM *vm)
 {
-    vm.stack_top = vm.stack;
-    vm.frame_count = 0;
+    // Strings can double in length with every concatenation, so this is checked up front rather
+    // than at the next safepoint. The heap may hold garbage, which is collected before giving up.
+    // A rope only takes up a node, but counts as long as the string it will be flattened to.
+    size_t length = (size_t)TextLength(AS_OBJ(vm->stack_top[-2])) + TextLength(AS_OBJ(vm->stack_top[-1]));
+    if (length > INT_MAX)
+    {
+        lox_RuntimeError(vm, "String is too long.");
+        return false;
+    }
+#ifdef DEBUG_STRESS_GC
+    lox_CollectGarbage(vm);
+#else
+    if (vm->bytes_allocated + length + 1 > vm->memory_limit)
+        lox_CollectGarbage(vm);
+#endif
+    if (vm->bytes_allocated + length + 1 > vm->memory_limit)
+    {
+        vm->limit_exceeded = true;
+        lox_RuntimeError(vm, "Memory limit exceeded.");
+        return false;
+    }
+
+    // The collection may have moved the operands.
+    Obj *b = AS_OBJ(vm->stack_top[-1]);
+    Obj *a = AS_OBJ(vm->stack_top[-2]);
+    vm->stack_top -= 2;
+    lox_PushStack(vm, OBJ_VAL(lox_ConcatenateText(vm, a, b)));
+    return true;
 }
 
-Value Peek(int distance)
+void InitState(VM *vm, const Allocator *allocator)
 {
-    return vm.stack_top[-1 - distance];
+    lox_InitHashSeed();
+    // Before anything is allocated.
+    if (allocator != NULL)
+        vm->allocator = *allocator;
+    else
+        vm->allocator = (Allocator){0};
+    vm->bytes_allocated = 0;
+    vm->peak_bytes = 0;
+    memset(vm->objects_allocated, 0, sizeof(vm->objects_allocated));
+    memset(vm->objects_freed, 0, sizeof(vm->objects_freed));
+    vm->slabs = NULL;
+    vm->memory_limit = SIZE_MAX;
+    vm->fuel = INT64_MAX;
+    vm->fuel_reserve = 0;
+    vm->limit_exceeded = false;
+    vm->next_gc = GC_INITIAL_THRESHOLD;
+    vm->gray_stack = NULL;
+    vm->gray_count = 0;
+    vm->gray_capacity = 0;
+    vm->nursery = NULL;
+    vm->nursery_top = NULL;
+    vm->nursery_end = NULL;
+    vm->remembered = NULL;
+    vm->remembered_count = 0;
+    vm->remembered_capacity = 0;
+    vm->gc_quantum = 0;
+    vm->gc_concurrent = false;
+    vm->gc_phase = GC_IDLE;
+    vm->collector = NULL;
+    vm->frames = ALLOCATE(vm, CallFrame, FRAMES_INITIAL);
+    vm->frame_capacity = FRAMES_INITIAL;
+    vm->frames_max = FRAMES_MAX;
+    vm->stack = ALLOCATE(vm, Value, STACK_INITIAL);
+    vm->stack_capacity = STACK_INITIAL;
+    ResetStack(vm);
+    vm->objects = NULL;
+    vm->trace_loops = false;
+    vm->trace_recorder = NULL;
+    vm->io_loop = NULL;
+    vm->task_worker = NULL;
+    vm->native_depth = 0;
+    vm->shared_code = false;
+    // The main fiber isn't on the objects list, so the collector must never see it unmarked.
+    vm->main_fiber = (ObjFiber){.obj = {.type = OBJ_FIBER, .is_marked = true}, .state = FIBER_RUNNING};
+    vm->fiber = &vm->main_fiber;
+    vm->transfer_to = NULL;
+    lox_InitHashTable(&vm->strings);
+    lox_InitHashTable(&vm->global_slots);
+    lox_InitValueArray(&vm->global_names);
+    lox_InitValueArray(&vm->global_values);
+    lox_InitValueArray(&vm->handles);
 }
 
-bool IsFalsey(Value value)
+void ResetStack(VM *vm)
 {
-    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+    vm->stack_top = vm->stack;
+    vm->frame_count = 0;
 }
 
-void Concatenate()
+/// @brief Grows the value stack to hold at least 'count' values. The stack may move, so the
+///        slots of every frame and the stack top are moved with it.
+/// @param count of values needed.
+/// @return false if that exceeds the room of vm->frames_max frames.
+bool EnsureStack(VM *vm, size_t count)
 {
-    ObjString *b = AS_STRING(lox_PopStack());
-    ObjString *a = AS_STRING(lox_PopStack());
+    if (count <= (size_t)vm->stack_capacity)
+        return true;
+
+    if (count > (size_t)vm->frames_max * UINT8_COUNT)
+    {
+        StackOverflow(vm);
+        return false;
+    }
 
-    int length = a->length + b->length;
-    char *chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+    int capacity = vm->stack_capacity;
+    while ((size_t)capacity < count)
+        capacity *= 2;
 
-    ObjString *result = lox_TakeString(chars, length);
-    lox_PushStack(OBJ_VAL(result));
+    Value *old_stack = vm->stack;
+    vm->stack = GROW_ARRAY(vm, Value, vm->stack, vm->stack_capacity, capacity);
+    vm->stack_capacity = capacity;
+    if (vm->stack != old_stack)
+    {
+        for (int i = 0; i < vm->frame_count; i++)
+            vm->frames[i].slots = vm->stack + (vm->frames[i].slots - old_stack);
+        vm->stack_top = vm->stack + (vm->stack_top - old_stack);
+    }
+    return true;
 }
 
-void RuntimeError(const char *format, ...)
+bool IsFalsey(Value value)
+{
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+void lox_RuntimeError(VM *vm, const char *format, ...)
 {
     va_list args;
     va_start(args, format);
@@ -346,9 +1020,9 @@ void RuntimeError(const char *format, ...)
     va_end(args);
     fputs("\n", stderr);
 
-    for (int i = vm.frame_count - 1; i >= 0; i--)
+    for (int i = vm->frame_count - 1; i >= 0; i--)
     {
-        CallFrame *frame = &vm.frames[i];
+        CallFrame *frame = &vm->frames[i];
         ObjFunction *function = frame->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
         fprintf(stderr, "[line %d] in ",
@@ -363,60 +1037,191 @@ void RuntimeError(const char *format, ...)
         }
     }
 
-    ResetStack();
+#ifdef USE_JIT
+    lox_TraceAbort(vm);
+#endif
+    lox_UnwindFibers(vm);
+    ResetStack(vm);
 }
 
-bool CallValue(Value callee, int arg_count)
+/// @brief Makes the next back-edge or call stop at lox_Safepoint. Its fuel is set aside until
+///        then.
+void lox_RequestSafepoint(VM *vm)
+{
+    if (vm->fuel > 0)
+    {
+        vm->fuel_reserve += vm->fuel;
+        vm->fuel = 0;
+    }
+}
+
+/// @brief Called at a back-edge or call once vm->fuel has run out, with the state of the running
+///        frame stored. Collects garbage if it's due, and then checks the budgets.
+/// @return false if a budget ran out. The error has been reported.
+bool lox_Safepoint(VM *vm)
+{
+    lox_CollectAtSafepoint(vm);
+    // Collecting may have requested another safepoint. This is it.
+    vm->fuel += vm->fuel_reserve;
+    vm->fuel_reserve = 0;
+
+    if (vm->bytes_allocated > vm->memory_limit)
+    {
+        vm->limit_exceeded = true;
+        lox_RuntimeError(vm, "Memory limit exceeded.");
+        return false;
+    }
+    if (vm->fuel < 0)
+    {
+        vm->limit_exceeded = true;
+        lox_RuntimeError(vm, "Instruction limit exceeded.");
+        return false;
+    }
+    return true;
+}
+
+bool lox_CallValue(VM *vm, Value callee, int arg_count)
 {
     if (IS_OBJ(callee))
     {
         switch (OBJ_TYPE(callee))
         {
         case OBJ_FUNCTION:
-            return Call(AS_FUNCTION(callee), arg_count);
+            return Call(vm, AS_FUNCTION(callee), arg_count);
+        case OBJ_CLOSURE:
+            return Call(vm, AS_CLOSURE(callee)->function, arg_count);
         case OBJ_NATIVE:
         {
             NativeFn native = AS_NATIVE(callee);
-            Value result = native(arg_count, vm.stack_top - arg_count);
-            vm.stack_top -= arg_count + 1;
-            lox_PushStack(result);
+            Value result;
+            if (!native(vm, arg_count, vm->stack_top - arg_count, &result))
+                return false;
+            vm->stack_top -= arg_count + 1;
+            if (vm->transfer_to != NULL)
+                return lox_TransferFiber(vm, result);
+            lox_PushStack(vm, result);
             return true;
         }
         default:
             break; // Non-callable object type.
         }
     }
-    RuntimeError("Can only call functions and classes.");
+    lox_RuntimeError(vm, "Can only call functions and classes.");
     return false;
 }
 
-bool Call(ObjFunction *function, int arg_count)
+/// @brief Calls 'callee' from tail position. A Lox function takes over the newest frame: the
+///        callee and its arguments are moved down over the caller's slots. Anything else is
+///        called like lox_CallValue does.
+/// @param callee is below the arguments on the stack.
+/// @param arg_count is the number of arguments.
+/// @return false on a runtime error.
+bool lox_TailCallValue(VM *vm, Value callee, int arg_count)
+{
+    ObjFunction *function;
+    if (IS_CLOSURE(callee))
+        function = AS_CLOSURE(callee)->function;
+    else if (IS_FUNCTION(callee))
+        function = AS_FUNCTION(callee);
+    else
+        return lox_CallValue(vm, callee, arg_count);
+
+    if (!PrepareCall(vm, function, arg_count))
+        return false;
+
+    CallFrame *frame = &vm->frames[vm->frame_count - 1];
+    if (!EnsureStack(vm, frame->slots - vm->stack + UINT8_COUNT))
+        return false;
+    memmove(frame->slots, vm->stack_top - arg_count - 1, sizeof(Value) * (arg_count + 1));
+    vm->stack_top = frame->slots + arg_count + 1;
+    frame->function = function;
+    frame->ip = function->chunk.code;
+    return true;
+}
+
+bool Call(VM *vm, ObjFunction *function, int arg_count)
+{
+    if (!PrepareCall(vm, function, arg_count))
+        return false;
+
+    if (vm->frame_count == vm->frame_capacity)
+    {
+        if (vm->frame_count >= vm->frames_max)
+        {
+            StackOverflow(vm);
+            return false;
+        }
+        int capacity = vm->frame_capacity * 2 < vm->frames_max ? vm->frame_capacity * 2 : vm->frames_max;
+        vm->frames = GROW_ARRAY(vm, CallFrame, vm->frames, vm->frame_capacity, capacity);
+        vm->frame_capacity = capacity;
+    }
+
+    if (!EnsureStack(vm, vm->stack_top - arg_count - 1 - vm->stack + UINT8_COUNT))
+        return false;
+
+    CallFrame *frame = &vm->frames[vm->frame_count++];
+    frame->function = function;
+    frame->ip = function->chunk.code;
+    frame->slots = vm->stack_top - arg_count - 1;
+    return true;
+}
+
+/// @brief Checks the argument count, stops at the safepoint if one is due, and counts the call
+///        for the JIT.
+bool PrepareCall(VM *vm, ObjFunction *function, int arg_count)
 {
     if (arg_count != function->arity)
     {
-        RuntimeError("Expected %d arguments but got %d.",
+        lox_RuntimeError(vm, "Expected %d arguments but got %d.",
                      function->arity, arg_count);
         return false;
     }
 
-    if (vm.frame_count == FRAMES_MAX)
-    {
-        RuntimeError("Stack overflow.");
+    if (--vm->fuel < 0 && !lox_Safepoint(vm))
         return false;
-    }
 
-    CallFrame *frame = &vm.frames[vm.frame_count++];
-    frame->function = function;
-    frame->ip = function->chunk.code;
-    frame->slots = vm.stack_top - arg_count - 1;
+#ifdef USE_JIT
+    if (!vm->shared_code && ++function->call_count == JIT_THRESHOLD)
+    {
+        lox_JitCompile(function);
+    }
+#endif
     return true;
 }
 
-void DefineNative(const char *name, NativeFn function)
+void DefineNative(VM *vm, const char *name, NativeFn function)
+{
+    lox_PushStack(vm, OBJ_VAL(lox_CopyString(vm, name, (int)strlen(name))));
+    lox_PushStack(vm, OBJ_VAL(lox_CreateNative(vm, function)));
+    int slot = lox_ResolveGlobalSlot(vm, AS_STRING(vm->stack[0]));
+    vm->global_values.values[slot] = vm->stack[1];
+    lox_PopStack(vm);
+    lox_PopStack(vm);
+}
+
+/// @brief Turns a failed run into INTERPRET_LIMIT_EXCEEDED if a budget ran out.
+InterpretResult ErrorResult(VM *vm, InterpretResult result)
+{
+    return vm->limit_exceeded ? INTERPRET_LIMIT_EXCEEDED : result;
+}
+
+void StackOverflow(VM *vm)
 {
-    lox_PushStack(OBJ_VAL(lox_CopyString(name, (int)strlen(name))));
-    lox_PushStack(OBJ_VAL(lox_CreateNative(function)));
-    lox_AddEntryHashTable(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-    lox_PopStack();
-    lox_PopStack();
+    vm->limit_exceeded = true;
+    lox_RuntimeError(vm, "Stack overflow.");
 }
+
+#ifdef DEBUG_TRACE_EXECUTION
+void TraceInstruction(VM *vm, CallFrame *frame, uint8_t *ip, Value *stack_top)
+{
+    printf("          ");
+    for (Value *slot = vm->stack; slot < stack_top; slot++)
+    {
+        printf("[ ");
+        lox_PrintValue(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+    lox_DisassembleInstruction(vm, &frame->function->chunk, (int)(ip - frame->function->chunk.code));
+}
+#endif
@@ -0,0 +1,111 @@
+// Times the string hash(see CloxCore/include/common/hash.h) against the byte-at-a-time FNV-1a
+// it replaced, across string lengths, and interning keys like those read from input. Prints
+// nanoseconds per string, best of a few runs.
+// usage: hash-bench [runs]
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "common/hash.h"
+#include "core/object.h"
+#include "vm/vm.h"
+
+// Every length hashes about this many bytes, and at least this many strings.
+#define BYTES (1 << 26)
+#define STRINGS (1 << 20)
+// Interned keys, all distinct.
+#define KEYS (1 << 20)
+
+static VM vm;
+static char *text;
+// Keeps the hashes from being optimized away.
+static volatile uint32_t sink;
+
+// Called through a pointer like the library's, so it isn't inlined either.
+static __attribute__((noinline)) uint32_t Fnv1a(const char *chars, int length)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++)
+    {
+        hash ^= (uint8_t)chars[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static double Now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+// Hashes strings of 'length' at every offset into the text, so they aren't aligned.
+static double TimeHash(uint32_t (*hash)(const char *, int), int length, int runs)
+{
+    int count = BYTES / length > STRINGS ? BYTES / length : STRINGS;
+    double best = 0;
+    for (int r = 0; r < runs; r++)
+    {
+        double start = Now();
+        uint32_t sum = 0;
+        for (int i = 0; i < count; i++)
+            sum += hash(text + (i & 4095), length);
+        sink = sum;
+        double elapsed = Now() - start;
+        if (r == 0 || elapsed < best)
+            best = elapsed;
+    }
+    return best / count;
+}
+
+// Interns 'key0' to 'keyN', then looks them all up again. Every run uses a fresh VM.
+static double TimeIntern(int runs)
+{
+    double best = 0;
+    for (int r = 0; r < runs; r++)
+    {
+        lox_InitVM(&vm);
+        double start = Now();
+        for (int pass = 0; pass < 2; pass++)
+        {
+            for (int i = 0; i < KEYS; i++)
+            {
+                char chars[32];
+                int length = snprintf(chars, sizeof(chars), "key%d", i);
+                sink = lox_CopyString(&vm, chars, length)->hash;
+            }
+        }
+        double elapsed = Now() - start;
+        lox_FreeVM(&vm);
+        if (r == 0 || elapsed < best)
+            best = elapsed;
+    }
+    return best / (2.0 * KEYS);
+}
+
+int main(int argc, char *argv[])
+{
+    static const int lengths[] = {1, 3, 4, 8, 12, 16, 24, 32, 64, 256, 4096};
+    int runs = argc > 1 ? atoi(argv[1]) : 3;
+    if (runs < 1)
+        runs = 1;
+
+    lox_InitHashSeed();
+    text = malloc(4096 + 4096);
+    for (int i = 0; i < 4096 + 4096; i++)
+        text[i] = (char)(' ' + (i * 7919 % 95));
+
+    printf("%-8s %10s %10s\n", "length", "fnv-1a", "hash");
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+    {
+        int length = lengths[i];
+        double fnv_ns = TimeHash(Fnv1a, length, runs);
+        double hash_ns = TimeHash(lox_HashString, length, runs);
+        printf("%-8d %10.2f %10.2f\n", length, fnv_ns, hash_ns);
+    }
+    printf("%-8s %21.2f\n", "intern", TimeIntern(runs));
+
+    free(text);
+    return 0;
+}
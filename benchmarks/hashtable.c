@@ -0,0 +1,318 @@
+// Times the hash table(see CloxCore/include/common/hashtable.h) against the linear-probing table
+// it replaced, which is kept below. Both are keyed by the same interned strings, and each
+// workload is run at a few sizes. Prints nanoseconds per operation, best of a few runs.
+// usage: hashtable-bench [runs]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common/hashtable.h"
+#include "core/object.h"
+#include "vm/vm.h"
+
+#define LEGACY_MAX_LOAD 0.75
+// Every workload does about this many operations, whatever the size of the table.
+#define OPERATIONS (1 << 22)
+
+// The previous table: one array of entries, probed one at a time from 'hash % capacity', with
+// tombstones(no key, but not a nil value) left by removals until the table is compacted.
+typedef struct
+{
+    size_t count;
+    size_t capacity;
+    Entry *entries;
+} LegacyTable;
+
+typedef struct
+{
+    const char *name;
+    void (*legacy)(int size, int repeat);
+    void (*swiss)(int size, int repeat);
+} Workload;
+
+// The table's functions are called across the library, so these aren't inlined either.
+#define LEGACY_API __attribute__((noinline))
+
+static VM vm;
+static ObjString **keys;
+static ObjString **missing;
+static LegacyTable legacy;
+static HashTable table;
+// Keeps the lookups from being optimized away.
+static volatile size_t found;
+
+static Entry *LegacyFind(Entry *entries, size_t capacity, ObjString *key)
+{
+    size_t index = key->hash % capacity;
+    Entry *tombstone = NULL;
+    for (;;)
+    {
+        Entry *entry = &entries[index];
+        if (entry->key == NULL)
+        {
+            if (IS_NIL(entry->value))
+                return tombstone != NULL ? tombstone : entry;
+            if (tombstone == NULL)
+                tombstone = entry;
+        }
+        else if (entry->key == key)
+        {
+            return entry;
+        }
+        index = (index + 1) % capacity;
+    }
+}
+
+static void LegacyResize(size_t capacity)
+{
+    Entry *entries = malloc(sizeof(Entry) * capacity);
+    for (size_t i = 0; i < capacity; i++)
+    {
+        entries[i].key = NULL;
+        entries[i].value = NIL_VAL;
+    }
+    legacy.count = 0;
+    for (size_t i = 0; i < legacy.capacity; i++)
+    {
+        Entry *entry = &legacy.entries[i];
+        if (entry->key == NULL)
+            continue;
+        Entry *dest = LegacyFind(entries, capacity, entry->key);
+        *dest = *entry;
+        legacy.count++;
+    }
+    free(legacy.entries);
+    legacy.entries = entries;
+    legacy.capacity = capacity;
+}
+
+LEGACY_API static void LegacyAdd(ObjString *key, Value value)
+{
+    if (legacy.count + 1 > legacy.capacity * LEGACY_MAX_LOAD)
+        LegacyResize(legacy.capacity < 8 ? 8 : legacy.capacity * 2);
+    Entry *entry = LegacyFind(legacy.entries, legacy.capacity, key);
+    if (entry->key == NULL && IS_NIL(entry->value))
+        legacy.count++;
+    entry->key = key;
+    entry->value = value;
+}
+
+LEGACY_API static bool LegacyGet(ObjString *key, Value *value)
+{
+    if (legacy.count == 0)
+        return false;
+    Entry *entry = LegacyFind(legacy.entries, legacy.capacity, key);
+    if (entry->key == NULL)
+        return false;
+    *value = entry->value;
+    return true;
+}
+
+LEGACY_API static void LegacyRemove(ObjString *key)
+{
+    Entry *entry = LegacyFind(legacy.entries, legacy.capacity, key);
+    if (entry->key == NULL)
+        return;
+    entry->key = NULL;
+    entry->value = BOOL_VAL(true);
+}
+
+LEGACY_API static void LegacyCompact(void)
+{
+    size_t live = 0;
+    for (size_t i = 0; i < legacy.capacity; i++)
+    {
+        if (legacy.entries[i].key != NULL)
+            live++;
+    }
+    size_t capacity = 8;
+    while (live + 1 > capacity * LEGACY_MAX_LOAD)
+        capacity *= 2;
+    LegacyResize(capacity);
+}
+
+LEGACY_API static ObjString *LegacyFindString(const char *chars, int length, uint32_t hash)
+{
+    size_t index = hash % legacy.capacity;
+    for (;;)
+    {
+        Entry *entry = &legacy.entries[index];
+        if (entry->key == NULL)
+        {
+            if (IS_NIL(entry->value))
+                return NULL;
+        }
+        else if (entry->key->length == length && entry->key->hash == hash &&
+                 memcmp(entry->key->chars, chars, length) == 0)
+        {
+            return entry->key;
+        }
+        index = (index + 1) % legacy.capacity;
+    }
+}
+
+static void LegacyFill(int size)
+{
+    free(legacy.entries);
+    legacy = (LegacyTable){0};
+    for (int i = 0; i < size; i++)
+        LegacyAdd(keys[i], NUMBER_VAL(i));
+}
+
+static void Fill(int size)
+{
+    lox_FreeHashTable(&vm, &table);
+    for (int i = 0; i < size; i++)
+        lox_AddEntryHashTable(&vm, &table, keys[i], NUMBER_VAL(i));
+}
+
+static void LegacyInsert(int size, int repeat)
+{
+    for (int r = 0; r < repeat; r++)
+        LegacyFill(size);
+}
+
+static void Insert(int size, int repeat)
+{
+    for (int r = 0; r < repeat; r++)
+        Fill(size);
+}
+
+static void LegacyHit(int size, int repeat)
+{
+    Value value;
+    for (int r = 0; r < repeat; r++)
+        for (int i = 0; i < size; i++)
+            found += LegacyGet(keys[i], &value);
+}
+
+static void Hit(int size, int repeat)
+{
+    Value value;
+    for (int r = 0; r < repeat; r++)
+        for (int i = 0; i < size; i++)
+            found += lox_GetEntryHashTable(&table, keys[i], &value);
+}
+
+static void LegacyMiss(int size, int repeat)
+{
+    Value value;
+    for (int r = 0; r < repeat; r++)
+        for (int i = 0; i < size; i++)
+            found += LegacyGet(missing[i], &value);
+}
+
+static void Miss(int size, int repeat)
+{
+    Value value;
+    for (int r = 0; r < repeat; r++)
+        for (int i = 0; i < size; i++)
+            found += lox_GetEntryHashTable(&table, missing[i], &value);
+}
+
+static void LegacyIntern(int size, int repeat)
+{
+    for (int r = 0; r < repeat; r++)
+        for (int i = 0; i < size; i++)
+            found += LegacyFindString(keys[i]->chars, keys[i]->length, keys[i]->hash) != NULL;
+}
+
+static void Intern(int size, int repeat)
+{
+    for (int r = 0; r < repeat; r++)
+        for (int i = 0; i < size; i++)
+            found += lox_FindStringHashTable(&table, keys[i]->chars, keys[i]->length, keys[i]->hash) != NULL;
+}
+
+// Half the entries are removed and put back each round, compacting in between like the
+// collector does with the intern table.
+static void LegacyChurn(int size, int repeat)
+{
+    for (int r = 0; r < repeat; r++)
+    {
+        for (int i = r & 1; i < size; i += 2)
+            LegacyRemove(keys[i]);
+        LegacyCompact();
+        for (int i = r & 1; i < size; i += 2)
+            LegacyAdd(keys[i], NUMBER_VAL(i));
+    }
+}
+
+static void Churn(int size, int repeat)
+{
+    for (int r = 0; r < repeat; r++)
+    {
+        for (int i = r & 1; i < size; i += 2)
+            lox_RemoveEntryHashTable(&table, keys[i]);
+        lox_CompactHashTable(&vm, &table);
+        for (int i = r & 1; i < size; i += 2)
+            lox_AddEntryHashTable(&vm, &table, keys[i], NUMBER_VAL(i));
+    }
+}
+
+static double Time(void (*run)(int, int), int size, int runs)
+{
+    int repeat = OPERATIONS / size;
+    double best = 0;
+    for (int i = 0; i < runs; i++)
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        run(size, repeat);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double elapsed = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+        if (i == 0 || elapsed < best)
+            best = elapsed;
+    }
+    return best / ((double)size * repeat);
+}
+
+int main(int argc, char *argv[])
+{
+    static const int sizes[] = {64, 4096, 262144};
+    static const Workload workloads[] = {
+        {"insert", LegacyInsert, Insert},
+        {"hit", LegacyHit, Hit},
+        {"miss", LegacyMiss, Miss},
+        {"intern", LegacyIntern, Intern},
+        {"churn", LegacyChurn, Churn},
+    };
+    int runs = argc > 1 ? atoi(argv[1]) : 3;
+    if (runs < 1)
+        runs = 1;
+
+    lox_InitVM(&vm);
+    int count = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    keys = malloc(sizeof(ObjString *) * count);
+    missing = malloc(sizeof(ObjString *) * count);
+    for (int i = 0; i < count; i++)
+    {
+        char chars[32];
+        int length = snprintf(chars, sizeof(chars), "key%d", i);
+        keys[i] = lox_CopyString(&vm, chars, length);
+        length = snprintf(chars, sizeof(chars), "missing%d", i);
+        missing[i] = lox_CopyString(&vm, chars, length);
+    }
+
+    printf("%-8s %8s %10s %10s\n", "workload", "size", "legacy", "swiss");
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++)
+    {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        {
+            int size = sizes[s];
+            LegacyFill(size);
+            Fill(size);
+            double legacy_ns = Time(workloads[w].legacy, size, runs);
+            double swiss_ns = Time(workloads[w].swiss, size, runs);
+            printf("%-8s %8d %10.2f %10.2f\n", workloads[w].name, size, legacy_ns, swiss_ns);
+        }
+    }
+
+    free(legacy.entries);
+    lox_FreeHashTable(&vm, &table);
+    free(keys);
+    free(missing);
+    lox_FreeVM(&vm);
+    return 0;
+}
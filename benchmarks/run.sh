@@ -0,0 +1,38 @@
+#!/bin/sh
+# Builds the interpreter with and without the slab allocator(see CloxCore/include/core/slab.h)
+# and times every script in this directory with both. Prints the best of RUNS runs, in seconds.
+# Then runs the microbenchmarks.
+# usage: benchmarks/run.sh [runs]
+set -e
+cd "$(dirname "$0")/.."
+RUNS=${1:-5}
+
+build() {
+    cmake -S . -B "build/bench-$1" -DCMAKE_C_FLAGS="-O2 $2" > /dev/null
+    cmake --build "build/bench-$1" -j > /dev/null
+}
+build slab ""
+build malloc "-DNO_SLAB_ALLOCATOR"
+
+best() {
+    best_ns=
+    for run in $(seq "$RUNS"); do
+        start=$(date +%s%N)
+        "build/bench-$1/CloxCore/clox" "$2" > /dev/null
+        elapsed=$(($(date +%s%N) - start))
+        if [ -z "$best_ns" ] || [ "$elapsed" -lt "$best_ns" ]; then
+            best_ns=$elapsed
+        fi
+    done
+    echo "$best_ns" | awk '{ printf "%.3f", $1 / 1e9 }'
+}
+
+printf "%-16s %10s %10s\n" script slab malloc
+for script in benchmarks/*.lox; do
+    printf "%-16s %10s %10s\n" "$(basename "$script")" "$(best slab "$script")" "$(best malloc "$script")"
+done
+
+echo
+build/bench-slab/benchmarks/hashtable-bench "$RUNS"
+echo
+build/bench-slab/benchmarks/hash-bench "$RUNS"